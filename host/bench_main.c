@@ -0,0 +1,293 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "fixtures.h"
+#include "usb_crc.h"
+
+/**================================================== *
+ * ==============  Host-side benchmarks  ============ *
+ * ================================================== *
+ *
+ * Each benchmark runs one operation on realistic input, repeated enough times
+ * to get stable numbers. Results are given in ns and host cycles per op, plus
+ * ops/sec divided by the host clock in MHz. The last one is roughly comparable
+ * across machines, and a rough hint of what to expect from a 125 MHz RP2040
+ * (expect it to be several times worse, the M0+ is a much simpler core).
+ *
+ * Host clock is read from /proc/cpuinfo, override with DESKHOP_BENCH_MHZ.
+ */
+
+/* Not exported through main.h */
+hotkey_combo_t *check_all_hotkeys(hid_keyboard_report_t *, device_t *);
+bool extract_report_values(uint8_t *, int, mouse_t *, mouse_values_t *);
+int16_t scale_y_coordinate(int, int, device_t *);
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*run)(void);
+    int iterations;
+} bench_t;
+
+volatile uint32_t bench_sink;
+bool bench_invalid; // Input didn't exercise what the benchmark is meant to time
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+double host_cpu_mhz(void) {
+    const char *env = getenv("DESKHOP_BENCH_MHZ");
+    char line[256];
+    double mhz = 0;
+
+    if (env)
+        return atof(env);
+
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (!cpuinfo)
+        return 0;
+
+    while (fgets(line, sizeof(line), cpuinfo))
+        if (sscanf(line, "cpu MHz : %lf", &mhz) == 1)
+            break;
+
+    fclose(cpuinfo);
+    return mhz;
+}
+
+/* ==================================================
+ * Inputs
+ * ================================================== */
+
+/* Report ID 2, buttons 0x0001, X = -3, Y = +2 (12-bit each), wheel +1 */
+uint8_t gaming_mouse_report[] = {0x02, 0x01, 0x00, 0xFD, 0x2F, 0x00, 0x01, 0x00};
+
+/* Typing "as" with left shift held, matches no hotkey so all of them get checked */
+hid_keyboard_report_t typing_report = {.modifier = KEYBOARD_MODIFIER_LEFTSHIFT, .keycode = {HID_KEY_A, HID_KEY_S}};
+
+/* A full inter-board packet payload */
+uint8_t uart_payload[PACKET_DATA_LENGTH];
+
+/* A full-speed USB transaction worth of data */
+uint8_t usb_packet[64];
+
+/* Plain mouse report, buttons 0x01, X = -5, Y = +300, wheel -1 */
+uint8_t mouse_report[] = {0x01, 0xFB, 0xFF, 0x2C, 0x01, 0xFF};
+
+/* The first mouse plugged in */
+hid_device_t *bench_mouse = &global_state.hid_devices[0];
+
+void mount_mouse(const uint8_t *desc, uint16_t desc_len) {
+    host_setup();
+    host_usb.itf_protocol = HID_ITF_PROTOCOL_MOUSE;
+    tuh_hid_mount_cb(1, 0, desc, desc_len);
+}
+
+void setup_gaming_mouse(void) {
+    mount_mouse(gaming_mouse_report_desc, gaming_mouse_report_desc_len);
+
+    /* Away from the edges, host_setup() leaves the pointer in the corner */
+    global_state.mouse_x = MAX_SCREEN_COORD / 2;
+    global_state.mouse_y = MAX_SCREEN_COORD / 2;
+}
+
+void setup_mouse(void) {
+    mount_mouse(mouse_report_desc, mouse_report_desc_len);
+}
+
+/* Same mouse, but pretend no fast paths exist, to compare against */
+void setup_mouse_generic(void) {
+    report_layout_t *layout = &bench_mouse->mouse.reports[0];
+
+    setup_mouse();
+    layout->buttons.kind = EXTRACT_GENERIC;
+    layout->move_x.kind  = EXTRACT_GENERIC;
+    layout->move_y.kind  = EXTRACT_GENERIC;
+    layout->wheel.kind   = EXTRACT_GENERIC;
+}
+
+void setup_borders(void) {
+    host_setup();
+    global_state.config.output[OUTPUT_A].border = (border_size_t){.top = 2000, .bottom = 30000};
+    global_state.config.output[OUTPUT_B].border = (border_size_t){.top = 0, .bottom = MAX_SCREEN_COORD};
+}
+
+/* ==================================================
+ * Individual benchmarks, one iteration each
+ * ================================================== */
+
+void bench_process_mouse_report(void) {
+    /* Alternate between X, Y = -3, +2 and +3, -2 so we wiggle in place and never switch screens */
+    gaming_mouse_report[3] ^= 0xFE;
+    gaming_mouse_report[4] ^= 0xCF;
+    gaming_mouse_report[5] ^= 0xFF;
+    process_mouse_report(gaming_mouse_report, sizeof(gaming_mouse_report), bench_mouse, &global_state);
+
+    /* Pinned to an edge, we'd be timing the clamped path instead */
+    if (global_state.mouse_x <= MIN_SCREEN_COORD || global_state.mouse_x >= MAX_SCREEN_COORD
+        || global_state.mouse_y <= MIN_SCREEN_COORD || global_state.mouse_y >= MAX_SCREEN_COORD)
+        bench_invalid = true;
+}
+
+void bench_extract_report_values(void) {
+    mouse_values_t values;
+    extract_report_values(gaming_mouse_report, sizeof(gaming_mouse_report), &bench_mouse->mouse, &values);
+    bench_sink += values.move_x;
+}
+
+void bench_extract_plain_mouse(void) {
+    mouse_values_t values;
+    extract_report_values(mouse_report, sizeof(mouse_report), &bench_mouse->mouse, &values);
+    bench_sink += values.move_x;
+}
+
+void bench_get_report_value(void) {
+    bench_sink += get_report_value(gaming_mouse_report + 1, &bench_mouse->mouse.reports[0].move_y);
+}
+
+void bench_check_all_hotkeys(void) {
+    bench_sink += check_all_hotkeys(&typing_report, &global_state) != NULL;
+}
+
+void bench_calc_checksum_packet(void) {
+    bench_sink += calc_checksum(uart_payload, sizeof(uart_payload));
+}
+
+void bench_calc_crc8_packet(void) {
+    bench_sink += calc_crc8(uart_payload, sizeof(uart_payload), 0);
+}
+
+void bench_calc_checksum_config(void) {
+    bench_sink += calc_checksum((uint8_t *)&global_state.config, sizeof(config_t));
+}
+
+void bench_scale_y_coordinate(void) {
+    global_state.mouse_y = (global_state.mouse_y + 997) & MAX_SCREEN_COORD;
+    bench_sink += scale_y_coordinate(OUTPUT_A, OUTPUT_B, &global_state);
+}
+
+void bench_parse_report_descriptor(void) {
+    static mouse_t mouse;
+    parse_report_descriptor(&mouse, MAX_REPORTS, gaming_mouse_report_desc, gaming_mouse_report_desc_len);
+    bench_sink += mouse.reports[0].move_x.offset;
+}
+
+void bench_parse_report_descriptor_cached(void) {
+    static mouse_t mouse;
+    parse_report_descriptor_cached(
+        &global_state.descriptor_cache, &mouse, 0x046D, 0xC539, gaming_mouse_report_desc, gaming_mouse_report_desc_len);
+    bench_sink += mouse.reports[0].move_x.offset;
+}
+
+void bench_calc_usb_crc16(void) {
+    bench_sink += calc_usb_crc16(usb_packet, sizeof(usb_packet));
+}
+
+void bench_cobs_encode(void) {
+    uint8_t packet[PACKET_LENGTH] = {MOUSE_REPORT_MSG, 1, 0, 2, 0, 3}, frame[PACKET_LENGTH + 2];
+    bench_sink += cobs_encode(packet, sizeof(packet), frame);
+}
+
+void bench_spsc_ring(void) {
+    hid_keyboard_report_t report = {0};
+    ring_try_add(&global_state.kbd_queue, &report);
+    ring_try_remove(&global_state.kbd_queue, &report);
+}
+
+void bench_uart_loopback(void) {
+    uart_packet_t packet;
+    mouse_abs_report_t report = {.x = 1234, .y = 4321};
+
+    send_packet((uint8_t *)&report, MOUSE_REPORT_MSG, MOUSE_REPORT_LENGTH);
+    host_service_irqs();
+    receive_packets(&packet, &global_state);
+    process_mouse_queue_task(&global_state);
+}
+
+/* ==================================================
+ * Runner
+ * ================================================== */
+
+#define BENCH(setup, fn, n) {#fn " (" #setup ")", setup, fn, n}
+
+const bench_t benchmarks[] = {
+    BENCH(setup_gaming_mouse, bench_process_mouse_report, 2000000),
+    BENCH(setup_gaming_mouse, bench_extract_report_values, 10000000),
+    BENCH(setup_mouse, bench_extract_plain_mouse, 10000000),
+    BENCH(setup_mouse_generic, bench_extract_plain_mouse, 10000000),
+    BENCH(setup_gaming_mouse, bench_get_report_value, 10000000),
+    BENCH(host_setup, bench_check_all_hotkeys, 10000000),
+    BENCH(host_setup, bench_calc_checksum_packet, 10000000),
+    BENCH(host_setup, bench_calc_crc8_packet, 10000000),
+    BENCH(host_setup, bench_calc_checksum_config, 1000000),
+    BENCH(setup_borders, bench_scale_y_coordinate, 10000000),
+    BENCH(host_setup, bench_parse_report_descriptor, 1000000),
+    BENCH(host_setup, bench_parse_report_descriptor_cached, 1000000),
+    BENCH(host_setup, bench_calc_usb_crc16, 2000000),
+    BENCH(host_setup, bench_cobs_encode, 10000000),
+    BENCH(host_setup, bench_spsc_ring, 10000000),
+    BENCH(host_setup, bench_uart_loopback, 1000000),
+};
+
+int main(int argc, char **argv) {
+    double mhz  = host_cpu_mhz();
+    bool failed = false;
+
+    for (int i = 0; i < sizeof(usb_packet); i++)
+        usb_packet[i] = i * 37;
+
+    memcpy(uart_payload, gaming_mouse_report, sizeof(gaming_mouse_report));
+
+    printf("Host clock: %.0f MHz\n\n", mhz);
+    printf("%-50s %10s %10s %12s %12s\n", "benchmark", "ns/op", "cycles/op", "ops/sec", "ops/sec/MHz");
+
+    for (int i = 0; i < ARRAY_SIZE(benchmarks); i++) {
+        const bench_t *bench = &benchmarks[i];
+
+        /* Optional filter, run only benchmarks containing the given string */
+        if (argc > 1 && !strstr(bench->name, argv[1]))
+            continue;
+
+        bench->setup();
+        uint64_t start = now_ns();
+
+        for (int n = 0; n < bench->iterations; n++)
+            bench->run();
+
+        double ns_per_op   = (double)(now_ns() - start) / bench->iterations;
+        double ops_per_sec = 1e9 / ns_per_op;
+
+        printf("%-50s %10.1f %10.0f %12.0f %12.0f\n",
+               bench->name,
+               ns_per_op,
+               ns_per_op * mhz / 1000,
+               ops_per_sec,
+               mhz ? ops_per_sec / mhz : 0);
+
+        if (bench_invalid) {
+            printf("  ^ not valid, the input didn't do what this benchmark is meant to time\n");
+            bench_invalid = false;
+            failed        = true;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "main.h"
+
+/* Sample inputs shared by the host tests and benchmarks */
+
+/* Plain mouse, no report ID: 5 buttons + padding, 16-bit X/Y, 8-bit wheel */
+extern const uint8_t mouse_report_desc[];
+extern const uint16_t mouse_report_desc_len;
+
+/* Gaming mouse with report ID 2: 16 buttons, 12-bit X/Y, 8-bit wheel, AC pan */
+extern const uint8_t gaming_mouse_report_desc[];
+extern const uint16_t gaming_mouse_report_desc_len;
+
+/* Wireless receiver: keyboard on report ID 1, mouse on 2 (with push/pop and an extended
+   usage for AC pan), consumer control on 3 */
+extern const uint8_t combo_report_desc[];
+extern const uint16_t combo_report_desc_len;
+
+/* Plain mouse, no report ID: 3 buttons + padding, 8-bit X/Y from -127..127, then an 8-bit
+   wheel from 0..255 that gives Logical Max before Logical Min */
+extern const uint8_t late_min_report_desc[];
+extern const uint16_t late_min_report_desc_len;
+
+/* Configs as stored in flash by older firmware: version 2 and version 3 (with acceleration).
+   Output A has speed 23/19 and border 1200..28000, output B speed 11/13, mouse boot mode forced.
+   Acceleration is mild on A and strong on B. */
+extern const uint8_t config_v2_blob[];
+extern const uint16_t config_v2_blob_len;
+extern const uint8_t config_v3_blob[];
+extern const uint16_t config_v3_blob_len;
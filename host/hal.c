@@ -0,0 +1,356 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <time.h>
+
+#include "main.h"
+
+/**================================================== *
+ * ===============  Host HAL shim  ================== *
+ * ================================================== *
+ *
+ * Fake hardware for running the firmware logic on a computer. The UART is
+ * looped back, whatever the TX DMA sends shows up in the RX ring, so a single
+ * process plays both boards. Turn host_uart_loopback off to play a board in
+ * the middle of a longer ring instead, sent bytes are then only logged.
+ */
+
+device_t global_state = {0};
+host_usb_t host_usb;
+uint32_t host_uart_tx_bytes;
+uint8_t host_uart_tx_log[UART_TX_RING_SIZE];
+uint64_t host_uart_tx_time_us;
+bool host_uart_loopback = true;
+
+/* ==================================================
+ * Timer
+ * ================================================== */
+
+static uint64_t time_offset_us;
+static bool time_frozen;
+static uint64_t frozen_us;
+
+uint64_t time_us_64(void) {
+    struct timespec now;
+
+    if (time_frozen)
+        return frozen_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 + time_offset_us;
+}
+
+uint32_t time_us_32(void) {
+    return (uint32_t)time_us_64();
+}
+
+void sleep_ms(uint32_t ms) {
+    host_advance_time_us((uint64_t)ms * 1000);
+}
+
+absolute_time_t make_timeout_time_us(uint64_t us) {
+    return time_us_64() + us;
+}
+
+/* Nothing to wait for on the host, report the timeout as reached */
+bool best_effort_wfe_or_timeout(absolute_time_t timeout) {
+    return true;
+}
+
+void host_advance_time_us(uint64_t us) {
+    time_offset_us += us;
+    frozen_us += us;
+}
+
+/* Frozen, the clock only moves through host_advance_time_us() */
+void host_freeze_time(bool frozen) {
+    frozen_us   = time_us_64();
+    time_frozen = frozen;
+}
+
+/* ==================================================
+ * Sync and interrupts
+ * ================================================== */
+
+void critical_section_init(critical_section_t *crit_sec) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&crit_sec->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void critical_section_enter_blocking(critical_section_t *crit_sec) {
+    pthread_mutex_lock(&crit_sec->mutex);
+}
+
+void critical_section_exit(critical_section_t *crit_sec) {
+    pthread_mutex_unlock(&crit_sec->mutex);
+}
+
+uint32_t save_and_disable_interrupts(void) {
+    return 0;
+}
+
+void restore_interrupts(uint32_t status) {
+}
+
+void tight_loop_contents(void) {
+    host_service_irqs();
+}
+
+/* ==================================================
+ * GPIO, watchdog, bootrom
+ * ================================================== */
+
+static bool gpio_state[32];
+
+void gpio_put(uint32_t gpio, bool value) {
+    gpio_state[gpio] = value;
+}
+
+bool gpio_get(uint32_t gpio) {
+    return gpio_state[gpio];
+}
+
+void watchdog_update(void) {
+}
+
+void reset_usb_boot(uint32_t gpio_mask, uint32_t disable_interface_mask) {
+}
+
+/* There is only one core here, so nobody to park */
+void multicore_lockout_victim_init(void) {
+}
+
+void multicore_lockout_start_blocking(void) {
+}
+
+void multicore_lockout_end_blocking(void) {
+}
+
+/* ==================================================
+ * DMA and UART, looped back
+ * ================================================== */
+
+static dma_channel_hw_t dma_channels[12];
+static const volatile uint8_t *dma_read_ptr[12];
+static uint32_t rx_write_index;
+static bool tx_irq_pending;
+
+dma_channel_hw_t *dma_channel_hw_addr(uint32_t channel) {
+    return &dma_channels[channel];
+}
+
+void dma_channel_set_read_addr(uint32_t channel, const volatile void *read_addr, bool trigger) {
+    dma_read_ptr[channel] = read_addr;
+}
+
+void host_uart_inject(const uint8_t *data, int length) {
+    for (int i = 0; i < length; i++)
+        uart_rx_ring[rx_write_index++ & UART_RX_RING_MASK] = data[i];
+
+    dma_channels[SERIAL_RX_DMA_CHANNEL].write_addr
+        = (uint32_t)(uintptr_t)&uart_rx_ring[rx_write_index & UART_RX_RING_MASK];
+}
+
+/* Only the TX channel is ever triggered this way. The transfer completes instantly,
+   the "interrupt" runs the next time host_service_irqs() is called. */
+void dma_channel_set_trans_count(uint32_t channel, uint32_t count, bool trigger) {
+    assert(channel == SERIAL_TX_DMA_CHANNEL);
+
+    uint32_t start = dma_read_ptr[channel] - uart_tx_ring;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t byte = uart_tx_ring[(start + i) & UART_TX_RING_MASK];
+        host_uart_tx_log[(host_uart_tx_bytes + i) & UART_TX_RING_MASK] = byte;
+
+        if (host_uart_loopback)
+            host_uart_inject(&byte, 1);
+    }
+
+    host_uart_tx_bytes   += count;
+    host_uart_tx_time_us = time_us_64();
+    tx_irq_pending       = true;
+}
+
+void dma_channel_acknowledge_irq0(uint32_t channel) {
+}
+
+void host_service_irqs(void) {
+    while (tx_irq_pending) {
+        tx_irq_pending = false;
+        uart_tx_dma_handler();
+    }
+}
+
+void uart_tx_wait_blocking(uart_inst_t *uart) {
+}
+
+/* ==================================================
+ * Flash, only the config storage area exists
+ * ================================================== */
+
+uint8_t ADDR_CONFIG[CONFIG_STORAGE_LEN] __attribute__((aligned(FLASH_SECTOR_SIZE)));
+uint32_t host_flash_erase_count;
+
+static uint8_t *flash_address(uint32_t offset, size_t count) {
+    assert(offset >= CONFIG_STORAGE_OFFSET && offset + count <= PICO_FLASH_SIZE_BYTES);
+    return ADDR_CONFIG + (offset - CONFIG_STORAGE_OFFSET);
+}
+
+void flash_range_erase(uint32_t offset, size_t count) {
+    assert(offset % FLASH_SECTOR_SIZE == 0 && count % FLASH_SECTOR_SIZE == 0);
+    memset(flash_address(offset, count), 0xFF, count);
+    host_flash_erase_count += count / FLASH_SECTOR_SIZE;
+}
+
+/* Like real flash, programming can only clear bits, so writing without erasing shows up */
+void flash_range_program(uint32_t offset, const uint8_t *data, size_t count) {
+    assert(offset % FLASH_PAGE_SIZE == 0 && count % FLASH_PAGE_SIZE == 0);
+    uint8_t *flash = flash_address(offset, count);
+
+    for (size_t i = 0; i < count; i++)
+        flash[i] &= data[i];
+}
+
+/* ==================================================
+ * TinyUSB device and host stack
+ * ================================================== */
+
+bool tud_hid_n_ready(uint8_t instance) {
+    return host_usb.ready[instance];
+}
+
+bool tud_hid_n_report(uint8_t instance, uint8_t report_id, void const *report, uint16_t len) {
+    if (!host_usb.ready[instance])
+        return false;
+
+    if (len > sizeof(host_usb.last_report[instance]))
+        len = sizeof(host_usb.last_report[instance]);
+
+    memcpy(host_usb.last_report[instance], report, len);
+    host_usb.last_report_id[instance] = report_id;
+    host_usb.report_count[instance]++;
+
+    return true;
+}
+
+bool tud_hid_n_keyboard_report(uint8_t instance, uint8_t report_id, uint8_t modifier, uint8_t const *keycode) {
+    hid_keyboard_report_t report = {.modifier = modifier};
+
+    if (keycode)
+        memcpy(report.keycode, keycode, sizeof(report.keycode));
+
+    return tud_hid_n_report(instance, report_id, &report, sizeof(report));
+}
+
+bool tud_hid_abs_mouse_report(
+    uint8_t report_id, uint8_t buttons, int16_t x, int16_t y, int8_t vertical, int8_t horizontal) {
+    mouse_abs_report_t report = {.buttons = buttons, .x = x, .y = y, .wheel = vertical, .pan = horizontal};
+    return tud_hid_n_report(ITF_NUM_MOUSE, report_id, &report, sizeof(report));
+}
+
+bool tud_suspended(void) {
+    return host_usb.suspended;
+}
+
+bool tud_remote_wakeup(void) {
+    return true;
+}
+
+bool tud_task_event_ready(void) {
+    return false;
+}
+
+void tud_task(void) {
+}
+
+bool tuh_inited(void) {
+    return true;
+}
+
+void tuh_task(void) {
+}
+
+bool tuh_hid_set_report(
+    uint8_t dev_addr, uint8_t instance, uint8_t report_id, uint8_t report_type, void *report, uint16_t len) {
+    host_usb.led_report_count++;
+    return true;
+}
+
+bool tuh_vid_pid_get(uint8_t dev_addr, uint16_t *vid, uint16_t *pid) {
+    *vid = host_usb.vid;
+    *pid = host_usb.pid;
+    return true;
+}
+
+uint8_t tuh_hid_interface_protocol(uint8_t dev_addr, uint8_t instance) {
+    return host_usb.itf_protocol;
+}
+
+/* Pretend devices always come up in report protocol, so no set_protocol round trip is needed */
+uint8_t tuh_hid_get_protocol(uint8_t dev_addr, uint8_t instance) {
+    return HID_PROTOCOL_REPORT;
+}
+
+bool tuh_hid_set_protocol(uint8_t dev_addr, uint8_t instance, uint8_t protocol) {
+    return true;
+}
+
+bool tuh_hid_receive_report(uint8_t dev_addr, uint8_t instance) {
+    return true;
+}
+
+/* ==================================================
+ * Reset everything to the state right after initial_setup()
+ * ================================================== */
+
+void host_setup(void) {
+    device_t *state = &global_state;
+
+    free(state->kbd_queue.items);
+    free(state->mouse_queue.items);
+    free(state->deferred_queue.items);
+
+    memset(state, 0, sizeof(device_t));
+    memset(schedulers, 0, sizeof(schedulers));
+    memcpy(&state->config, &default_config, sizeof(config_t));
+    build_edge_tables(state);
+
+    critical_section_init(&state->uart_tx.lock);
+    state->uart_rx.reload_count = UART_RX_DMA_COUNT;
+
+    ring_init(&state->kbd_queue, sizeof(hid_keyboard_report_t), KBD_QUEUE_LENGTH);
+    ring_init(&state->mouse_queue, sizeof(mouse_event_t), MOUSE_QUEUE_LENGTH);
+    ring_init(&state->deferred_queue, sizeof(uart_packet_t), DEFERRED_QUEUE_LENGTH);
+
+    memset(dma_channels, 0, sizeof(dma_channels));
+    rx_write_index     = 0;
+    tx_irq_pending     = false;
+    host_uart_tx_bytes = 0;
+    host_uart_loopback = true;
+    host_uart_inject(NULL, 0);
+    host_freeze_time(false);
+
+    memset(&host_usb, 0, sizeof(host_usb));
+    host_usb.ready[ITF_NUM_KEYBOARD] = true;
+    host_usb.ready[ITF_NUM_MOUSE]    = true;
+
+    state->tud_connected = true;
+}
@@ -0,0 +1,140 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**================================================== *
+ * ===========  Host HAL shim definitions  ========== *
+ * ================================================== *
+ *
+ * Just enough of the pico-sdk and TinyUSB API to compile the firmware logic
+ * on a regular computer. Every pico/ hardware/ and tusb.h header in this
+ * directory includes this one. Implementations are in host/hal.c.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TU_ATTR_PACKED __attribute__((packed))
+#define __not_in_flash(group)
+#define __not_in_flash_func(func) func
+#define __time_critical_func(func) func
+
+typedef volatile uint32_t io_rw_32;
+
+/*********  Timer  **********/
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+void sleep_ms(uint32_t);
+
+typedef uint64_t absolute_time_t;
+
+absolute_time_t make_timeout_time_us(uint64_t);
+bool best_effort_wfe_or_timeout(absolute_time_t);
+
+/*********  Sync and interrupts  **********/
+#define __dmb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define __sev() ((void)0)
+
+typedef struct {
+    pthread_mutex_t mutex;
+} critical_section_t;
+
+void critical_section_init(critical_section_t *);
+void critical_section_enter_blocking(critical_section_t *);
+void critical_section_exit(critical_section_t *);
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t);
+
+/* Busy-wait loops on the target spin on hardware, here they run the pending "interrupts" */
+void tight_loop_contents(void);
+
+/*********  GPIO  **********/
+#define PICO_DEFAULT_LED_PIN 25
+
+void gpio_put(uint32_t, bool);
+bool gpio_get(uint32_t);
+
+/*********  UART  **********/
+typedef struct uart_inst uart_inst_t;
+#define uart0                 ((uart_inst_t *)0)
+#define UART_PARITY_NONE      0
+
+void uart_tx_wait_blocking(uart_inst_t *);
+
+/*********  DMA  **********/
+typedef struct {
+    io_rw_32 read_addr;
+    io_rw_32 write_addr;
+    io_rw_32 transfer_count;
+} dma_channel_hw_t;
+
+dma_channel_hw_t *dma_channel_hw_addr(uint32_t);
+void dma_channel_set_read_addr(uint32_t, const volatile void *, bool);
+void dma_channel_set_trans_count(uint32_t, uint32_t, bool);
+void dma_channel_acknowledge_irq0(uint32_t);
+
+/*********  Flash  **********/
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+#define NUM_CORES             2
+#define FLASH_SECTOR_SIZE     4096
+#define FLASH_PAGE_SIZE       256
+
+void flash_range_erase(uint32_t, size_t);
+void flash_range_program(uint32_t, const uint8_t *, size_t);
+
+/*********  Watchdog, bootrom  **********/
+void watchdog_update(void);
+void reset_usb_boot(uint32_t, uint32_t);
+
+/*********  Multicore  **********/
+void multicore_lockout_victim_init(void);
+void multicore_lockout_start_blocking(void);
+void multicore_lockout_end_blocking(void);
+
+/**================================================== *
+ * ============  Test and benchmark hooks  ========== *
+ * ================================================== */
+
+/* What the fake USB device stack saw, per HID instance */
+typedef struct {
+    bool ready[2];               // Returned by tud_hid_n_ready()
+    bool suspended;              // Returned by tud_suspended()
+    uint32_t report_count[2];    // Reports accepted so far
+    uint8_t last_report[2][32];  // Last report accepted, without the report ID
+    uint8_t last_report_id[2];   // Report ID it was sent with
+
+    uint8_t itf_protocol;       // What tuh_hid_interface_protocol() says the next device mounted is
+    uint16_t vid, pid;          // What tuh_vid_pid_get() says the next device mounted is
+    uint32_t led_report_count;  // SetReport requests sent to attached keyboards
+} host_usb_t;
+
+extern host_usb_t host_usb;
+extern uint32_t host_uart_tx_bytes; // Bytes "sent" over the UART since host_setup()
+extern uint8_t host_uart_tx_log[];  // The bytes themselves, indexed by host_uart_tx_bytes & UART_TX_RING_MASK
+extern bool host_uart_loopback;     // Whether sent bytes come back to us, on by default
+extern uint64_t host_uart_tx_time_us; // time_us_64() when the last bytes went to the TX DMA
+extern uint32_t host_flash_erase_count; // Sectors erased so far
+
+void host_setup(void);                         // Reset global_state and the fake hardware
+void host_service_irqs(void);                  // Run the DMA completion "interrupt" if pending
+void host_uart_inject(const uint8_t *, int);   // Bytes appear on the RX line
+void host_advance_time_us(uint64_t);           // Move the clock forward
+void host_freeze_time(bool);                   // Stop the clock, or let it run again
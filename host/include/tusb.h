@@ -0,0 +1,171 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**================================================== *
+ * ============  Host TinyUSB shim  ================= *
+ * ================================================== *
+ *
+ * Types, constants and entry points the firmware uses, values match TinyUSB.
+ */
+
+#pragma once
+
+#include "host_hal.h"
+
+/*********  Helpers  **********/
+static inline uint16_t tu_u16(uint8_t high, uint8_t low) {
+    return (uint16_t)((high << 8) | low);
+}
+
+static inline uint32_t tu_u32(uint8_t b3, uint8_t b2, uint8_t b1, uint8_t b0) {
+    return ((uint32_t)b3 << 24) | ((uint32_t)b2 << 16) | ((uint32_t)b1 << 8) | b0;
+}
+
+/*********  HID reports  **********/
+typedef struct TU_ATTR_PACKED {
+    uint8_t modifier;
+    uint8_t reserved;
+    uint8_t keycode[6];
+} hid_keyboard_report_t;
+
+typedef struct TU_ATTR_PACKED {
+    uint8_t buttons;
+    int8_t x;
+    int8_t y;
+    int8_t wheel;
+    int8_t pan;
+} hid_mouse_report_t;
+
+typedef enum {
+    HID_REPORT_TYPE_INVALID = 0,
+    HID_REPORT_TYPE_INPUT,
+    HID_REPORT_TYPE_OUTPUT,
+    HID_REPORT_TYPE_FEATURE
+} hid_report_type_t;
+
+enum { HID_PROTOCOL_BOOT = 0, HID_PROTOCOL_REPORT = 1 };
+enum { HID_ITF_PROTOCOL_NONE = 0, HID_ITF_PROTOCOL_KEYBOARD = 1, HID_ITF_PROTOCOL_MOUSE = 2 };
+
+/*********  Report descriptor items  **********/
+enum { RI_TYPE_MAIN = 0, RI_TYPE_GLOBAL = 1, RI_TYPE_LOCAL = 2 };
+
+enum {
+    RI_MAIN_INPUT          = 8,
+    RI_MAIN_OUTPUT         = 9,
+    RI_MAIN_COLLECTION     = 10,
+    RI_MAIN_FEATURE        = 11,
+    RI_MAIN_COLLECTION_END = 12
+};
+
+enum {
+    RI_GLOBAL_USAGE_PAGE    = 0,
+    RI_GLOBAL_LOGICAL_MIN   = 1,
+    RI_GLOBAL_LOGICAL_MAX   = 2,
+    RI_GLOBAL_PHYSICAL_MIN  = 3,
+    RI_GLOBAL_PHYSICAL_MAX  = 4,
+    RI_GLOBAL_UNIT_EXPONENT = 5,
+    RI_GLOBAL_UNIT          = 6,
+    RI_GLOBAL_REPORT_SIZE   = 7,
+    RI_GLOBAL_REPORT_ID     = 8,
+    RI_GLOBAL_REPORT_COUNT  = 9,
+    RI_GLOBAL_PUSH          = 10,
+    RI_GLOBAL_POP           = 11
+};
+
+enum {
+    RI_LOCAL_USAGE     = 0,
+    RI_LOCAL_USAGE_MIN = 1,
+    RI_LOCAL_USAGE_MAX = 2,
+    RI_LOCAL_DELIMITER = 10
+};
+
+/*********  Usages  **********/
+enum {
+    HID_USAGE_PAGE_DESKTOP  = 0x01,
+    HID_USAGE_PAGE_KEYBOARD = 0x07,
+    HID_USAGE_PAGE_LED      = 0x08,
+    HID_USAGE_PAGE_BUTTON   = 0x09,
+    HID_USAGE_PAGE_CONSUMER = 0x0C
+};
+
+enum {
+    HID_USAGE_DESKTOP_POINTER  = 0x01,
+    HID_USAGE_DESKTOP_MOUSE    = 0x02,
+    HID_USAGE_DESKTOP_KEYBOARD = 0x06,
+    HID_USAGE_DESKTOP_X        = 0x30,
+    HID_USAGE_DESKTOP_Y        = 0x31,
+    HID_USAGE_DESKTOP_WHEEL    = 0x38
+};
+
+#define HID_USAGE_CONSUMER_AC_PAN 0x0238
+
+/*********  Keyboard  **********/
+enum {
+    KEYBOARD_MODIFIER_LEFTCTRL   = 0x01,
+    KEYBOARD_MODIFIER_LEFTSHIFT  = 0x02,
+    KEYBOARD_MODIFIER_LEFTALT    = 0x04,
+    KEYBOARD_MODIFIER_LEFTGUI    = 0x08,
+    KEYBOARD_MODIFIER_RIGHTCTRL  = 0x10,
+    KEYBOARD_MODIFIER_RIGHTSHIFT = 0x20,
+    KEYBOARD_MODIFIER_RIGHTALT   = 0x40,
+    KEYBOARD_MODIFIER_RIGHTGUI   = 0x80
+};
+
+enum { KEYBOARD_LED_NUMLOCK = 0x01, KEYBOARD_LED_CAPSLOCK = 0x02, KEYBOARD_LED_SCROLLLOCK = 0x04 };
+
+#define HID_KEY_A         0x04
+#define HID_KEY_B         0x05
+#define HID_KEY_C         0x06
+#define HID_KEY_D         0x07
+#define HID_KEY_I         0x0C
+#define HID_KEY_L         0x0F
+#define HID_KEY_S         0x16
+#define HID_KEY_Y         0x1C
+#define HID_KEY_1         0x1E
+#define HID_KEY_0         0x27
+#define HID_KEY_ENTER     0x28
+#define HID_KEY_SPACE     0x2C
+#define HID_KEY_MINUS     0x2D
+#define HID_KEY_SEMICOLON 0x33
+#define HID_KEY_COMMA     0x36
+#define HID_KEY_PERIOD    0x37
+#define HID_KEY_CAPS_LOCK 0x39
+#define HID_KEY_F12       0x45
+
+/*********  Device stack  **********/
+bool tud_hid_n_ready(uint8_t);
+bool tud_hid_n_report(uint8_t, uint8_t, void const *, uint16_t);
+bool tud_hid_n_keyboard_report(uint8_t, uint8_t, uint8_t, uint8_t const *);
+bool tud_suspended(void);
+bool tud_remote_wakeup(void);
+bool tud_task_event_ready(void);
+void tud_task(void);
+bool tuh_inited(void);
+void tuh_task(void);
+
+/*********  Host stack  **********/
+bool tuh_hid_set_report(uint8_t, uint8_t, uint8_t, uint8_t, void *, uint16_t);
+bool tuh_vid_pid_get(uint8_t, uint16_t *, uint16_t *);
+uint8_t tuh_hid_interface_protocol(uint8_t, uint8_t);
+uint8_t tuh_hid_get_protocol(uint8_t, uint8_t);
+bool tuh_hid_set_protocol(uint8_t, uint8_t, uint8_t);
+bool tuh_hid_receive_report(uint8_t, uint8_t);
+
+void tuh_hid_mount_cb(uint8_t, uint8_t, uint8_t const *, uint16_t);
+void tuh_hid_umount_cb(uint8_t, uint8_t);
+void tuh_hid_report_received_cb(uint8_t, uint8_t, uint8_t const *, uint16_t);
+void tuh_hid_set_protocol_complete_cb(uint8_t, uint8_t, uint8_t);
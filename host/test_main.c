@@ -0,0 +1,1379 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sched.h>
+
+#include "fixtures.h"
+
+/**================================================== *
+ * ==============  Host-side test runner  =========== *
+ * ================================================== */
+
+static int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+/* Not exported through main.h */
+hotkey_combo_t *check_all_hotkeys(hid_keyboard_report_t *, device_t *);
+bool extract_report_values(uint8_t *, int, mouse_t *, mouse_values_t *);
+void set_keyboard_leds(uint8_t, device_t *);
+void update_mouse_position(device_t *, mouse_values_t *);
+uint8_t char_to_key(char, uint8_t *);
+
+static mouse_t test_mouse;
+
+/* Receive whatever the loopback UART has delivered so far */
+static void pump_uart(void) {
+    uart_packet_t packet;
+    host_service_irqs();
+    receive_packets(&packet, &global_state);
+}
+
+/* ==================================================
+ * Framing and checksums
+ * ================================================== */
+
+void test_cobs_roundtrip(void) {
+    uint8_t data[300], encoded[310], decoded[310];
+    srand(1);
+
+    for (int round = 0; round < 10000; round++) {
+        int length = rand() % 300;
+
+        for (int i = 0; i < length; i++)
+            data[i] = (rand() % 4) ? rand() : 0;
+
+        int encoded_length = cobs_encode(data, length, encoded);
+        CHECK(memchr(encoded, 0, encoded_length) == NULL);
+        CHECK(cobs_decode(encoded, encoded_length, decoded) == length);
+        CHECK(memcmp(data, decoded, length) == 0);
+    }
+}
+
+void test_crc8(void) {
+    /* Standard check value for CRC-8, polynomial 0x07 */
+    CHECK(calc_crc8((const uint8_t *)"123456789", 9, 0) == 0xF4);
+
+    /* Packet CRC covers the type and address bytes too */
+    uint8_t payload[] = {1, 2, 3};
+    CHECK(calc_packet_crc(MOUSE_REPORT_MSG, 0, payload, 3) != calc_packet_crc(KEYBOARD_REPORT_MSG, 0, payload, 3));
+    CHECK(calc_packet_crc(MOUSE_REPORT_MSG, 0x01, payload, 3) != calc_packet_crc(MOUSE_REPORT_MSG, 0x02, payload, 3));
+
+    uint8_t packet[] = {MOUSE_REPORT_MSG, 0x01, 1, 2, 3};
+    CHECK(calc_packet_crc(MOUSE_REPORT_MSG, 0x01, payload, 3) == calc_crc8(packet, sizeof(packet), 0));
+
+    /* Four bytes at a time gives the same as the plain bitwise CRC, whatever the length */
+    uint8_t data[40];
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = i * 37 + 11;
+
+    for (int length = 0; length <= sizeof(data); length++) {
+        uint8_t crc = 0x5A;
+
+        for (int i = 0; i < length; i++) {
+            crc ^= data[i];
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+
+        CHECK(calc_crc8(data, length, 0x5A) == crc);
+    }
+}
+
+/* ==================================================
+ * UART link, looped back to ourselves
+ * ================================================== */
+
+#ifndef PROTOCOL_V1
+/* Build a complete v2 frame by hand, as if another board sent it */
+static int make_frame(uint8_t type, uint8_t address, const void *payload, uint8_t *frame) {
+    uint8_t packet[PACKET_LENGTH] = {type, address};
+    int length = get_payload_length(type);
+
+    memcpy(&packet[TYPE_LENGTH + ADDRESS_LENGTH], payload, length);
+    length += TYPE_LENGTH + ADDRESS_LENGTH;
+    packet[length] = calc_crc8(packet, length, 0);
+
+    int frame_length      = cobs_encode(packet, length + CHECKSUM_LENGTH, frame);
+    frame[frame_length++] = FRAME_DELIMITER;
+    return frame_length;
+}
+#endif
+
+void test_uart_keyboard_relay(void) {
+    hid_keyboard_report_t report = {.modifier = KEYBOARD_MODIFIER_LEFTSHIFT, .keycode = {HID_KEY_A}};
+    host_setup();
+
+    send_packet((uint8_t *)&report, KEYBOARD_REPORT_MSG, KBD_REPORT_LENGTH);
+    pump_uart();
+
+    hid_keyboard_report_t *queued = ring_peek(&global_state.kbd_queue);
+    CHECK(queued != NULL);
+    CHECK(queued && memcmp(queued, &report, sizeof(report)) == 0);
+    CHECK(global_state.uart_rx.packet_count[KEYBOARD_REPORT_MSG] == 1);
+}
+
+void test_uart_short_message(void) {
+    host_setup();
+
+    send_value(1, MOUSE_ZOOM_MSG);
+    pump_uart();
+
+    CHECK(global_state.mouse_zoom == 1);
+#ifndef PROTOCOL_V1
+    /* COBS code byte + type + address + value + CRC + delimiter */
+    CHECK(host_uart_tx_bytes == 6);
+#endif
+}
+
+void test_uart_resync_and_corruption(void) {
+    const uint8_t garbage[] = {0x13, 0x37, 0xAA, 0x55, 0x42};
+    host_setup();
+
+    /* Line noise swallows the frame that follows it, but the one after that gets through */
+    host_uart_inject(garbage, sizeof(garbage));
+    send_value(1, SWITCH_LOCK_MSG);
+    pump_uart();
+    send_value(1, SWITCH_LOCK_MSG);
+    pump_uart();
+    CHECK(global_state.switch_lock == 1);
+
+#ifndef PROTOCOL_V1
+    /* Flip a bit in a frame, the CRC has to catch it */
+    uint8_t unlock = 0, frame[MAX_FRAME_LENGTH + 1];
+    uint32_t failed = global_state.uart_rx.checksum_fail_count;
+
+    /* Type and address are the first two bytes after the COBS code byte */
+    int length = make_frame(SWITCH_LOCK_MSG, MAKE_ADDRESS(OUTPUT_B, ADDR_BROADCAST), &unlock, frame);
+    frame[2] ^= 0x04;
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(global_state.switch_lock == 1);
+    CHECK(global_state.uart_rx.checksum_fail_count == failed + 1);
+#endif
+}
+
+void test_deferred_handler(void) {
+    border_size_t border = {.top = 100, .bottom = 20000};
+    host_setup();
+
+    send_packet((uint8_t *)&border, SYNC_BORDERS_MSG, sizeof(border));
+    pump_uart();
+
+    /* Received on core1, but not handled until core0 gets to it */
+    CHECK(global_state.config.output[0].border.bottom != 20000);
+    process_deferred_packets_task(&global_state);
+    CHECK(global_state.config.output[0].border.top == 100);
+    CHECK(global_state.config.output[0].border.bottom == 20000);
+}
+
+#if !defined(PROTOCOL_V1) && NUM_SCREENS > 2
+/* We're board A in the middle of a ring of four: B is the next hop, D sends to us */
+void test_uart_routing(void) {
+    hid_keyboard_report_t report = {.keycode = {HID_KEY_A}};
+    uint8_t lock = 1, frame[MAX_FRAME_LENGTH + 1];
+    uart_rx_t *rx = &global_state.uart_rx;
+    int length;
+
+    host_setup();
+    host_uart_loopback = false;
+
+    /* From D for C, we just pass it on, exactly as it is */
+    length = make_frame(KEYBOARD_REPORT_MSG, MAKE_ADDRESS(OUTPUT_D, OUTPUT_C), &report, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(rx->forwarded_count == 1);
+    CHECK(host_uart_tx_bytes == length);
+    CHECK(memcmp(host_uart_tx_log, frame, length) == 0);
+    CHECK(ring_peek(&global_state.kbd_queue) == NULL);
+
+    /* From D for us, it stops here */
+    length = make_frame(KEYBOARD_REPORT_MSG, MAKE_ADDRESS(OUTPUT_D, OUTPUT_A), &report, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(rx->forwarded_count == 1);
+    CHECK(ring_peek(&global_state.kbd_queue) != NULL);
+
+    /* Broadcast from D is for us and for B and C down the ring */
+    length = make_frame(SWITCH_LOCK_MSG, MAKE_ADDRESS(OUTPUT_D, ADDR_BROADCAST), &lock, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(global_state.switch_lock == 1);
+    CHECK(rx->forwarded_count == 2);
+
+    /* Broadcast from B already went all the way around, only we were left */
+    global_state.switch_lock = 0;
+    length = make_frame(SWITCH_LOCK_MSG, MAKE_ADDRESS(OUTPUT_B, ADDR_BROADCAST), &lock, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(global_state.switch_lock == 1);
+    CHECK(rx->forwarded_count == 2);
+
+    /* Our own frame coming back means nobody took it, it must not circle forever */
+    length = make_frame(KEYBOARD_REPORT_MSG, MAKE_ADDRESS(OUTPUT_A, OUTPUT_C), &report, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+    CHECK(rx->forwarded_count == 2);
+
+    /* Corrupted frames are not passed on */
+    uint32_t failed = rx->checksum_fail_count;
+    length = make_frame(KEYBOARD_REPORT_MSG, MAKE_ADDRESS(OUTPUT_D, OUTPUT_C), &report, frame);
+    frame[2] ^= 0x01;
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(rx->forwarded_count == 2);
+    CHECK(rx->checksum_fail_count == failed + 1);
+}
+
+/* A hop adds no more than handling the frame once: it goes out in the same receive pass it came
+   in, exactly as it was received, so it's never re-encoded or held back for a later pass */
+#define HOP_FRAMES        1000
+#define HOP_FRAME_TIME_US 100
+
+void test_uart_hop_latency(void) {
+    hid_keyboard_report_t report = {.keycode = {HID_KEY_A}};
+    uint8_t frame[MAX_FRAME_LENGTH + 1];
+
+    host_setup();
+    host_uart_loopback = false;
+    host_freeze_time(true);
+
+    int length = make_frame(KEYBOARD_REPORT_MSG, MAKE_ADDRESS(OUTPUT_D, OUTPUT_C), &report, frame);
+
+    for (int i = 0; i < HOP_FRAMES; i++) {
+        uint32_t sent = host_uart_tx_bytes;
+
+        /* Frames arrive one frame time apart, the clock only moves when we say so */
+        host_advance_time_us(HOP_FRAME_TIME_US);
+        uint64_t received = time_us_64();
+
+        host_uart_inject(frame, length);
+        pump_uart();
+
+        /* Out already, byte for byte, without waiting for anything that's timed */
+        CHECK(host_uart_tx_time_us == received);
+        CHECK(host_uart_tx_bytes == sent + length);
+        for (int j = 0; j < length; j++)
+            CHECK(host_uart_tx_log[(sent + j) & UART_TX_RING_MASK] == frame[j]);
+    }
+
+    CHECK(global_state.uart_rx.forwarded_count == HOP_FRAMES);
+}
+#endif
+
+#ifndef PROTOCOL_V1
+/* Every board knows how long the probes are, so they pass through boards that can't answer them */
+void test_uart_probe_passthrough(void) {
+    uint8_t frame[MAX_FRAME_LENGTH + 1];
+    uint32_t timestamp = 1234, sent;
+    int length;
+
+    host_setup();
+    host_uart_loopback = false;
+
+    sent   = host_uart_tx_bytes;
+    length = make_frame(PING_MSG, MAKE_ADDRESS(OUTPUT_B, BOARD_ROLE), &timestamp, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(global_state.uart_rx.unknown_type_count == 0);
+    CHECK(global_state.uart_rx.packet_count[PING_MSG] == 1);
+#ifdef INSTRUMENTATION
+    CHECK(host_uart_tx_bytes > sent);
+#else
+    CHECK(host_uart_tx_bytes == sent);
+#endif
+
+#if NUM_SCREENS > 2
+    /* Between two other boards, it goes on to the next one */
+    length = make_frame(PING_MSG, MAKE_ADDRESS(OUTPUT_D, OUTPUT_C), &timestamp, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+    CHECK(global_state.uart_rx.forwarded_count == 1);
+#endif
+}
+#endif
+
+void test_output_cycling(void) {
+    hid_keyboard_report_t report = {.keycode = {HID_KEY_A}};
+    host_setup();
+
+    /* Toggle hotkey goes through all outputs and back to the first one */
+    for (int i = 1; i <= NUM_SCREENS; i++) {
+        output_toggle_hotkey_handler(&global_state);
+        CHECK(global_state.active_output == i % NUM_SCREENS);
+    }
+
+    /* Keys for another output are addressed to that board only */
+    switch_output(&global_state, NUM_SCREENS - 1);
+    pump_uart();
+    while (ring_try_remove(&global_state.kbd_queue, &report))
+        ;
+
+    uint32_t sent = host_uart_tx_bytes;
+    send_key(&report, &global_state);
+    pump_uart();
+
+    CHECK(host_uart_tx_bytes > sent);
+#ifndef PROTOCOL_V1
+    /* Not for us, so it doesn't come back through loopback either */
+    CHECK(ring_peek(&global_state.kbd_queue) == NULL);
+
+    /* COBS code byte, type, then the address */
+    CHECK(host_uart_tx_log[(sent + 2) & UART_TX_RING_MASK] == MAKE_ADDRESS(BOARD_ROLE, NUM_SCREENS - 1));
+#endif
+}
+
+/* ==================================================
+ * Scheduler
+ * ================================================== */
+
+static int event_runs, timed_runs, polled_runs;
+static bool event_waiting;
+
+static void count_event(device_t *state) {
+    event_runs++;
+    event_waiting = false;
+}
+
+static bool event_ready(device_t *state) {
+    return event_waiting;
+}
+
+static void count_timed(device_t *state) {
+    timed_runs++;
+}
+
+static void count_polled(device_t *state) {
+    polled_runs++;
+}
+
+void test_scheduler(void) {
+    task_t tasks[] = {
+        {.name = "event", .exec = count_event, .ready = event_ready},
+        {.name = "timed", .exec = count_timed, .period_us = 1000, .deadline_us = 500},
+    };
+    task_t polled_tasks[] = {
+        {.name = "polled", .exec = count_polled},
+    };
+    scheduler_t timed = {.core = 0, .tasks = tasks, .count = ARRAY_SIZE(tasks)};
+    scheduler_t polled = {.core = 1, .tasks = polled_tasks, .count = ARRAY_SIZE(polled_tasks)};
+
+    host_setup();
+    event_runs = timed_runs = polled_runs = 0;
+    event_waiting = false;
+    start_tasks(&timed);
+    start_tasks(&polled);
+
+    /* Nothing to do yet, so nothing gets called and we can sleep until the timed task is due */
+    run_tasks(&timed, &global_state);
+    CHECK(event_runs == 0 && timed_runs == 0);
+
+    uint32_t wait = time_until_next_task(&timed, &global_state);
+    CHECK(wait > 0 && wait <= 1000);
+
+    /* An event means no sleeping, and the task runs on the next pass */
+    event_waiting = true;
+    CHECK(time_until_next_task(&timed, &global_state) == 0);
+    run_tasks(&timed, &global_state);
+    CHECK(event_runs == 1 && timed_runs == 0);
+
+    /* Timed task runs once per period */
+    host_advance_time_us(1000);
+    run_tasks(&timed, &global_state);
+    run_tasks(&timed, &global_state);
+    CHECK(timed_runs == 1 && event_runs == 1);
+    CHECK(tasks[1].stats.run_count == 1);
+    CHECK(tasks[1].stats.missed_deadlines == 0);
+
+    /* Way too late is a missed deadline, but we don't try to make up for the runs we skipped */
+    host_advance_time_us(5000);
+    run_tasks(&timed, &global_state);
+    run_tasks(&timed, &global_state);
+    CHECK(timed_runs == 2);
+    CHECK(tasks[1].stats.missed_deadlines == 1);
+    CHECK(tasks[1].stats.max_lateness_us >= 4000);
+
+    /* Tasks without a period or ready() run on every pass, and keep the core awake */
+    run_tasks(&polled, &global_state);
+    run_tasks(&polled, &global_state);
+    CHECK(polled_runs == 2);
+    CHECK(time_until_next_task(&polled, &global_state) == 0);
+
+#ifdef INSTRUMENTATION
+    /* Passes where nothing ran aren't counted as loops */
+    CHECK(timed.loop_count == 3);
+    CHECK(polled.loop_count == 2);
+    CHECK(tasks[1].stats.run_time.bucket[0] + tasks[1].stats.run_time.bucket[1] == 2);
+
+    /* Text has to be typeable, then it's typed out as key presses and releases */
+    char text[STATS_TEXT_LENGTH];
+    int length = format_stats(text, sizeof(text), &global_state);
+    CHECK(length > 0 && length < STATS_TEXT_LENGTH);
+    CHECK(strstr(text, "- timed, runs 2") != NULL);
+    CHECK(strstr(text, "core1 loop, passes 2") != NULL);
+
+    uint8_t modifier;
+    for (int i = 0; i < length; i++)
+        CHECK(char_to_key(text[i], &modifier) != 0);
+
+    hid_keyboard_report_t report;
+    int presses = 0;
+
+    stats_dump_hotkey_handler(&global_state);
+    CHECK(stats_dump_ready(&global_state));
+    stats_dump_task(&global_state);
+    CHECK(!stats_dump_ready(&global_state));
+
+    while (typewriter_ready(&global_state)) {
+        typewriter_task(&global_state);
+
+        while (ring_try_remove(&global_state.kbd_queue, &report))
+            presses += report.keycode[0] != 0;
+    }
+
+    CHECK(global_state.typewriter.length == 0);
+    CHECK(presses == format_stats(text, sizeof(text), &global_state));
+#endif
+}
+
+/* ==================================================
+ * Queues
+ * ================================================== */
+
+#define STRESS_ITEMS 1000000
+
+static spsc_ring_t stress_ring;
+
+static void *stress_producer(void *arg) {
+    for (uint32_t i = 0; i < STRESS_ITEMS;) {
+        if (ring_try_add(&stress_ring, &i))
+            i++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+void test_spsc_stress(void) {
+    pthread_t producer;
+    uint32_t expected = 0, errors = 0;
+
+    ring_init(&stress_ring, sizeof(uint32_t), 64);
+    pthread_create(&producer, NULL, stress_producer, NULL);
+
+    while (expected < STRESS_ITEMS) {
+        uint32_t *item = ring_peek(&stress_ring);
+
+        if (item == NULL) {
+            sched_yield();
+            continue;
+        }
+
+        errors += (*item != expected++);
+        ring_commit(&stress_ring);
+    }
+
+    pthread_join(producer, NULL);
+    CHECK(errors == 0);
+    CHECK(ring_peek(&stress_ring) == NULL);
+    free(stress_ring.items);
+}
+
+void test_mouse_coalescing(void) {
+    mouse_abs_report_t report = {0};
+    mouse_abs_report_t *sent  = (mouse_abs_report_t *)host_usb.last_report[ITF_NUM_MOUSE];
+    host_setup();
+
+    /* Lots of motion while the host is busy collapses into one report with the latest position */
+    host_usb.ready[ITF_NUM_MOUSE] = false;
+    for (int i = 1; i <= 100; i++) {
+        report.x     = i * 10;
+        report.y     = i * 5;
+        report.wheel = 1;
+        queue_mouse_report(&report, &global_state);
+    }
+
+    host_usb.ready[ITF_NUM_MOUSE] = true;
+    process_mouse_queue_task(&global_state);
+    process_mouse_queue_task(&global_state);
+
+    CHECK(host_usb.report_count[ITF_NUM_MOUSE] == 1);
+    CHECK(sent->x == 1000 && sent->y == 500);
+    CHECK(sent->wheel == 100);
+
+    /* Press and release are both delivered, in order */
+    host_usb.ready[ITF_NUM_MOUSE] = false;
+    report.wheel                  = 0;
+    report.buttons                = 1;
+    queue_mouse_report(&report, &global_state);
+    report.buttons = 0;
+    queue_mouse_report(&report, &global_state);
+
+    host_usb.ready[ITF_NUM_MOUSE] = true;
+    process_mouse_queue_task(&global_state);
+    CHECK(sent->buttons == 1);
+    process_mouse_queue_task(&global_state);
+    CHECK(sent->buttons == 0);
+    process_mouse_queue_task(&global_state);
+    CHECK(host_usb.report_count[ITF_NUM_MOUSE] == 3);
+}
+
+void test_subpixel_motion(void) {
+    mouse_values_t one_count = {.move_x = 1, .move_y = -1};
+    host_setup();
+
+    global_state.mouse_x                  = 1000;
+    global_state.mouse_y                  = 1000;
+    global_state.mouse_zoom               = true;
+    global_state.config.output[0].speed_x = 2;
+    global_state.config.output[0].speed_y = 2;
+
+    /* Half a pixel per count in zoom mode, it used to round down to nothing */
+    for (int i = 0; i < 8; i++)
+        update_mouse_position(&global_state, &one_count);
+
+    CHECK(global_state.mouse_x == 1004);
+    CHECK(global_state.mouse_y == 996);
+
+    /* No zoom, no acceleration, exactly the same as plain multiplication */
+    mouse_values_t fast = {.move_x = 40, .move_y = 0};
+    global_state.mouse_zoom = false;
+    update_mouse_position(&global_state, &fast);
+    CHECK(global_state.mouse_x == 1004 + 80);
+
+    /* Strong curve triples fast movement, slow one stays as is */
+    global_state.config.output[0].accel_curve = ACCEL_CURVE_STRONG;
+    update_mouse_position(&global_state, &fast);
+    CHECK(global_state.mouse_x == 1084 + 240);
+
+    mouse_values_t slow = {.move_x = 2};
+    update_mouse_position(&global_state, &slow);
+    CHECK(global_state.mouse_x == 1324 + 4);
+
+    /* Garbage curve from config is treated as none */
+    global_state.config.output[0].accel_curve = 99;
+    update_mouse_position(&global_state, &fast);
+    CHECK(global_state.mouse_x == 1328 + 80);
+}
+
+/* ==================================================
+ * HID parsing and hotkeys
+ * ================================================== */
+
+void test_report_parser(void) {
+    mouse_values_t values = {0};
+    uint8_t report[]      = {0x05, 0xFB, 0xFF, 0x2C, 0x01, 0xFF};
+    host_setup();
+
+    test_mouse.protocol = HID_PROTOCOL_REPORT;
+    CHECK(parse_report_descriptor(&test_mouse, MAX_REPORTS, mouse_report_desc, mouse_report_desc_len) == 1);
+
+    report_layout_t *layout = find_report_layout(&test_mouse, 0);
+    CHECK(layout != NULL);
+    CHECK(layout && layout->buttons.size == 5);
+    CHECK(layout && layout->move_x.offset == 8 && layout->move_x.size == 16);
+    CHECK(layout && layout->move_y.offset == 24);
+    CHECK(layout && layout->wheel.offset == 40);
+    CHECK(layout && layout->length == sizeof(report));
+
+    CHECK(extract_report_values(report, sizeof(report), &test_mouse, &values));
+    CHECK(values.buttons == 5);
+    CHECK(values.move_x == -5);
+    CHECK(values.move_y == 300);
+    CHECK(values.wheel == -1);
+
+    /* Too short to hold all the fields */
+    CHECK(!extract_report_values(report, sizeof(report) - 1, &test_mouse, &values));
+
+    /* Logical Max comes first, the minimum left over from X/Y must not make it signed */
+    CHECK(parse_report_descriptor(&test_mouse, MAX_REPORTS, late_min_report_desc, late_min_report_desc_len) == 1);
+    layout = find_report_layout(&test_mouse, 0);
+    CHECK(layout && layout->move_x.min == -127 && layout->move_x.max == 127);
+    CHECK(layout && layout->wheel.offset == 24 && layout->wheel.min == 0 && layout->wheel.max == 255);
+}
+
+void test_report_parser_multiple_ids(void) {
+    mouse_values_t values     = {0};
+    uint8_t mouse_report[]    = {0x02, 0x03, 0xFE, 0xFF, 0x10, 0x00, 0x01, 0xFF};
+    uint8_t consumer_report[] = {0x03, 0xE9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    host_setup();
+
+    test_mouse.protocol = HID_PROTOCOL_REPORT;
+    CHECK(parse_report_descriptor(&test_mouse, MAX_REPORTS, combo_report_desc, combo_report_desc_len) == 1);
+    CHECK(test_mouse.uses_report_id);
+
+    /* Only the mouse report gets a layout */
+    CHECK(find_report_layout(&test_mouse, 1) == NULL);
+    CHECK(find_report_layout(&test_mouse, 3) == NULL);
+
+    report_layout_t *layout = find_report_layout(&test_mouse, 2);
+    CHECK(layout != NULL);
+    CHECK(layout && layout->buttons.offset == 0 && layout->buttons.size == 8);
+    CHECK(layout && layout->move_x.offset == 8 && layout->move_x.size == 16 && layout->move_x.min == -32768);
+    CHECK(layout && layout->wheel.offset == 40 && layout->wheel.size == 8);
+    CHECK(layout && layout->pan.offset == 48 && layout->pan.size == 8);
+
+    CHECK(extract_report_values(mouse_report, sizeof(mouse_report), &test_mouse, &values));
+    CHECK(values.buttons == 3);
+    CHECK(values.move_x == -2 && values.move_y == 16);
+    CHECK(values.wheel == 1 && values.pan == -1);
+
+    CHECK(!extract_report_values(consumer_report, sizeof(consumer_report), &test_mouse, &values));
+
+    /* 16-bit AC pan usage in the gaming mouse descriptor must not be mistaken for the wheel (0x38) */
+    CHECK(parse_report_descriptor(&test_mouse, MAX_REPORTS, gaming_mouse_report_desc, gaming_mouse_report_desc_len)
+          == 1);
+    layout = find_report_layout(&test_mouse, 2);
+    CHECK(layout && layout->buttons.size == 16);
+    CHECK(layout && layout->move_x.offset == 16 && layout->move_x.size == 12);
+    CHECK(layout && layout->move_y.offset == 28);
+    CHECK(layout && layout->wheel.offset == 40);
+    CHECK(layout && layout->pan.offset == 48);
+}
+
+/* Most recent keyboard report queued for the computer */
+static bool last_queued_keys(hid_keyboard_report_t *report) {
+    bool found = false;
+
+    while (ring_try_remove(&global_state.kbd_queue, report))
+        found = true;
+
+    return found;
+}
+
+void test_multiple_devices(void) {
+    hid_keyboard_report_t shift     = {.modifier = KEYBOARD_MODIFIER_LEFTSHIFT};
+    hid_keyboard_report_t keys      = {.keycode = {HID_KEY_A, HID_KEY_B}};
+    hid_keyboard_report_t more_keys = {.keycode = {HID_KEY_B, HID_KEY_C}};
+    hid_keyboard_report_t sent;
+
+    uint8_t mouse_press[] = {0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
+    uint8_t gaming_move[] = {0x02, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00};
+    host_setup();
+
+    /* Two keyboards and two different mice, e.g. on a hub */
+    host_usb.itf_protocol = HID_ITF_PROTOCOL_KEYBOARD;
+    tuh_hid_mount_cb(1, 0, NULL, 0);
+    tuh_hid_mount_cb(2, 0, NULL, 0);
+
+    host_usb.itf_protocol = HID_ITF_PROTOCOL_MOUSE;
+    tuh_hid_mount_cb(1, 1, mouse_report_desc, mouse_report_desc_len);
+    tuh_hid_mount_cb(3, 0, gaming_mouse_report_desc, gaming_mouse_report_desc_len);
+
+    CHECK(global_state.keyboard_connected && global_state.mouse_connected);
+
+    /* The second mouse must not clobber the layout of the first */
+    hid_device_t *mouse = find_hid_device(&global_state, 1, 1);
+    CHECK(mouse && mouse->mouse.reports[0].move_x.size == 16);
+    CHECK(!mouse->mouse.uses_report_id);
+
+    /* Keys pressed on both keyboards are merged */
+    tuh_hid_report_received_cb(1, 0, (uint8_t *)&shift, sizeof(shift));
+    tuh_hid_report_received_cb(2, 0, (uint8_t *)&keys, sizeof(keys));
+    tuh_hid_report_received_cb(2, 0, (uint8_t *)&more_keys, sizeof(more_keys));
+
+    CHECK(last_queued_keys(&sent));
+    CHECK(sent.modifier == KEYBOARD_MODIFIER_LEFTSHIFT);
+    CHECK(sent.keycode[0] == HID_KEY_B && sent.keycode[1] == HID_KEY_C && sent.keycode[2] == 0);
+
+    /* LEDs go to every keyboard */
+    set_keyboard_leds(KEYBOARD_LED_NUMLOCK, &global_state);
+    CHECK(host_usb.led_report_count == 2);
+
+    /* Unplugging a keyboard releases whatever it was holding */
+    tuh_hid_umount_cb(1, 0);
+    CHECK(last_queued_keys(&sent));
+    CHECK(sent.modifier == 0 && sent.keycode[0] == HID_KEY_B);
+    CHECK(global_state.keyboard_connected);
+
+    /* Button held on one mouse stays held while the other one moves */
+    int16_t start_x = global_state.mouse_x;
+    tuh_hid_report_received_cb(1, 1, mouse_press, sizeof(mouse_press));
+    tuh_hid_report_received_cb(3, 0, gaming_move, sizeof(gaming_move));
+
+    CHECK(global_state.mouse_mailbox.buttons == 1);
+    CHECK(global_state.mouse_x > start_x);
+
+    /* Unplugging the mouse that held it lets the button go */
+    tuh_hid_umount_cb(1, 1);
+    CHECK(global_state.mouse_mailbox.buttons == 0);
+
+    tuh_hid_umount_cb(3, 0);
+    CHECK(!global_state.mouse_connected);
+}
+
+void test_descriptor_cache(void) {
+    static descriptor_cache_t cache;
+    static mouse_t parsed, cached;
+    memset(&cache, 0, sizeof(cache));
+
+    parse_report_descriptor_cached(&cache, &parsed, 0x046D, 0xC52B, combo_report_desc, combo_report_desc_len);
+    CHECK(cache.misses == 1 && cache.hits == 0);
+
+    /* Same device again, layouts come straight from the cache */
+    CHECK(parse_report_descriptor_cached(&cache, &cached, 0x046D, 0xC52B, combo_report_desc, combo_report_desc_len)
+          == 1);
+    CHECK(cache.hits == 1);
+    CHECK(memcmp(parsed.reports, cached.reports, sizeof(parsed.reports)) == 0);
+    CHECK(memcmp(parsed.report_lookup, cached.report_lookup, sizeof(parsed.report_lookup)) == 0);
+    CHECK(cached.uses_report_id && cached.report_count == 1);
+
+    /* Different product, or the same one with a different descriptor, must be parsed */
+    parse_report_descriptor_cached(&cache, &cached, 0x046D, 0xC52C, combo_report_desc, combo_report_desc_len);
+    parse_report_descriptor_cached(&cache, &cached, 0x046D, 0xC52B, mouse_report_desc, mouse_report_desc_len);
+    CHECK(cache.misses == 3);
+    CHECK(!cached.uses_report_id && find_report_layout(&cached, 0) != NULL);
+
+    /* Filling the cache pushes out the least recently used entry, which is the 0xC52C one */
+    parse_report_descriptor_cached(&cache, &cached, 0x046D, 0xC52B, combo_report_desc, combo_report_desc_len);
+    parse_report_descriptor_cached(&cache, &cached, 0x1234, 0x0001, mouse_report_desc, mouse_report_desc_len);
+    parse_report_descriptor_cached(&cache, &cached, 0x1234, 0x0002, mouse_report_desc, mouse_report_desc_len);
+    CHECK(cache.misses == 5 && cache.hits == 2);
+
+    parse_report_descriptor_cached(&cache, &cached, 0x046D, 0xC52C, combo_report_desc, combo_report_desc_len);
+    CHECK(cache.misses == 6);
+    parse_report_descriptor_cached(&cache, &cached, 0x046D, 0xC52B, combo_report_desc, combo_report_desc_len);
+    CHECK(cache.hits == 3);
+}
+
+void test_extraction_plan(void) {
+    uint8_t report[8];
+    srand(2);
+
+    /* Fast paths have to agree with the generic bit walker for every offset and size */
+    for (int offset = 0; offset < 32; offset++) {
+        for (int size = 0; size <= 16; size++) {
+            report_val_t val = {.offset = offset, .size = size};
+            compile_report_value(&val);
+
+            CHECK(val.kind == (size ? EXTRACT_GENERIC : EXTRACT_NONE) || offset % 8 == 0);
+
+            for (int round = 0; round < 100; round++) {
+                for (int i = 0; i < sizeof(report); i++)
+                    report[i] = rand();
+
+                int32_t expected = size ? get_report_value_generic(report, &val) : 0;
+                CHECK(get_report_value(report, &val) == expected);
+            }
+        }
+    }
+
+    report_val_t aligned = {.offset = 24, .size = 16};
+    compile_report_value(&aligned);
+    CHECK(aligned.kind == EXTRACT_16BIT && aligned.byte_offset == 3);
+}
+
+void test_hotkeys(void) {
+    hid_keyboard_report_t toggle = {.keycode = {HOTKEY_TOGGLE}};
+    hid_keyboard_report_t typing = {.keycode = {HID_KEY_A, HID_KEY_B}};
+    host_setup();
+
+    hotkey_combo_t *hotkey = check_all_hotkeys(&toggle, &global_state);
+    CHECK(hotkey && hotkey->action_handler == &output_toggle_hotkey_handler);
+    CHECK(check_all_hotkeys(&typing, &global_state) == NULL);
+}
+
+/* ==================================================
+ * Monitor layout
+ * ================================================== */
+
+void check_screen_switch(const mouse_values_t *, device_t *);
+
+static void move_across(int output, int x, int y, int move_x) {
+    mouse_values_t values = {.move_x = move_x};
+
+    global_state.active_output = output;
+    global_state.mouse_x       = x;
+    global_state.mouse_y       = y;
+    check_screen_switch(&values, &global_state);
+}
+
+void test_monitor_layout(void) {
+    host_setup();
+    config_t *config = &global_state.config;
+
+    /* B: a tall monitor and a short one to its right. A: two stacked monitors and a big one. */
+    output_t *a = &config->output[OUTPUT_A];
+    output_t *b = &config->output[OUTPUT_B];
+
+    a->screen_count = 3;
+    a->monitors[0]  = (monitor_t){.left = 0, .right = 10000, .top = 0, .bottom = 16383};
+    a->monitors[1]  = (monitor_t){.left = 0, .right = 10000, .top = 16384, .bottom = 32767};
+    a->monitors[2]  = (monitor_t){.left = 10001, .right = 32767, .top = 0, .bottom = 32767};
+    a->links[0]     = (edge_link_t){.side = EDGE_LEFT, .monitor = 0, .target_output = OUTPUT_B, .target_monitor = 1};
+    a->links[1]     = (edge_link_t){.side = EDGE_LEFT, .monitor = 1, .target_output = OUTPUT_B, .target_monitor = 0};
+    a->link_count   = 2;
+
+    b->screen_count = 2;
+    b->monitors[0]  = (monitor_t){.left = 0, .right = 16383, .top = 0, .bottom = 32767};
+    b->monitors[1]  = (monitor_t){.left = 16384, .right = 32767, .top = 8192, .bottom = 24575};
+    b->links[0]     = (edge_link_t){.side = EDGE_RIGHT, .monitor = 1, .target_output = OUTPUT_A, .target_monitor = 0};
+    b->links[1]     = (edge_link_t){.side = EDGE_LEFT, .monitor = 0, .target_output = OUTPUT_A, .target_monitor = 2};
+    b->link_count   = 2;
+
+    build_edge_tables(&global_state);
+
+    /* Upper left monitor of A leads to the short monitor on B, same height */
+    move_across(OUTPUT_A, MIN_SCREEN_COORD, 8000, -JUMP_THRESHOLD - 1);
+    CHECK(global_state.active_output == OUTPUT_B);
+    CHECK(global_state.mouse_x == 32767);
+    CHECK(global_state.mouse_y == 8192 + 8000);
+    CHECK(b->screen_index == 1);
+
+    /* Lower left monitor of A leads to the tall one, twice the height */
+    move_across(OUTPUT_A, MIN_SCREEN_COORD, 24000, -JUMP_THRESHOLD - 1);
+    CHECK(global_state.active_output == OUTPUT_B);
+    CHECK(global_state.mouse_x == 16383);
+    CHECK(abs(global_state.mouse_y - 2 * (24000 - 16384)) <= 2);
+    CHECK(b->screen_index == 0);
+
+    /* Right edge of B above the short monitor leads nowhere */
+    move_across(OUTPUT_B, MAX_SCREEN_COORD, 4000, JUMP_THRESHOLD + 1);
+    CHECK(global_state.active_output == OUTPUT_B);
+    CHECK(global_state.mouse_x == MAX_SCREEN_COORD);
+
+    /* ... but next to it, we land on the upper left monitor of A */
+    move_across(OUTPUT_B, MAX_SCREEN_COORD, 16384, JUMP_THRESHOLD + 1);
+    CHECK(global_state.active_output == OUTPUT_A);
+    CHECK(global_state.mouse_x == 0);
+    CHECK(global_state.mouse_y == 8192);
+    CHECK(a->screen_index == 0);
+
+    /* Wrapping around from the left of B to the big monitor on A */
+    move_across(OUTPUT_B, MIN_SCREEN_COORD, 100, -JUMP_THRESHOLD - 1);
+    CHECK(global_state.active_output == OUTPUT_A);
+    CHECK(global_state.mouse_x == 32767);
+    CHECK(a->screen_index == 2);
+
+    /* Small moves never switch */
+    move_across(OUTPUT_A, MIN_SCREEN_COORD, 8000, -JUMP_THRESHOLD);
+    CHECK(global_state.active_output == OUTPUT_A);
+
+    /* Default layout behaves like before: B on the left, A on the right */
+    host_setup();
+    move_across(OUTPUT_A, MIN_SCREEN_COORD, 1000, -JUMP_THRESHOLD - 1);
+    CHECK(global_state.active_output == OUTPUT_B);
+    CHECK(global_state.mouse_x == MAX_SCREEN_COORD);
+    CHECK(global_state.mouse_y == 1000);
+
+    move_across(OUTPUT_B, MIN_SCREEN_COORD, 1000, -JUMP_THRESHOLD - 1);
+    CHECK(global_state.active_output == OUTPUT_B);
+
+    move_across(OUTPUT_B, MAX_SCREEN_COORD, 1000, JUMP_THRESHOLD + 1);
+    CHECK(global_state.active_output == OUTPUT_A);
+    CHECK(global_state.mouse_x == MIN_SCREEN_COORD);
+
+    /* Layout changed on core0 leaves the tables alone, core1 rebuilds them when it gets to an edge */
+    config->output[OUTPUT_A].link_count = 0;
+    request_edge_tables_rebuild(&global_state);
+    CHECK(global_state.edges.table[OUTPUT_A][EDGE_LEFT][0] != 0);
+
+    move_across(OUTPUT_A, MIN_SCREEN_COORD, 1000, -JUMP_THRESHOLD - 1);
+    CHECK(!global_state.edges_stale);
+    CHECK(global_state.active_output == OUTPUT_A);
+}
+
+#if defined(INSTRUMENTATION) && !defined(PROTOCOL_V1)
+/* Pings get answered right away, pongs end up in the round trip histograms */
+void test_link_probe(void) {
+    link_probe_t *probe = &global_state.link_probe;
+    uint8_t frame[MAX_FRAME_LENGTH + 1];
+    bool pinged[NUM_SCREENS] = {false};
+    char text[STATS_TEXT_LENGTH];
+    uint32_t timestamp = 1234, sent, total;
+    int length;
+
+    host_setup();
+    host_uart_loopback = false;
+
+    /* B pings us, its timestamp goes back to B only */
+    sent   = host_uart_tx_bytes;
+    length = make_frame(PING_MSG, MAKE_ADDRESS(OUTPUT_B, BOARD_ROLE), &timestamp, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(host_uart_tx_bytes > sent);
+    CHECK(host_uart_tx_log[(sent + 1) & UART_TX_RING_MASK] == PONG_MSG);
+    CHECK(host_uart_tx_log[(sent + 2) & UART_TX_RING_MASK] == MAKE_ADDRESS(BOARD_ROLE, OUTPUT_B));
+
+    /* Our ping to B comes back 300 us later */
+    timestamp = time_us_32() - 300;
+    length    = make_frame(PONG_MSG, MAKE_ADDRESS(OUTPUT_B, BOARD_ROLE), &timestamp, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+
+    CHECK(probe->pong_count == 1);
+    CHECK(probe->rtt[OUTPUT_B].bucket[9] == 1);
+
+    total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += probe->hop_latency.bucket[i];
+    CHECK(total == 1);
+
+    /* The prober goes through all the other boards, never itself */
+    for (int i = 0; i < NUM_SCREENS - 1; i++) {
+        link_probe_task(&global_state);
+        pinged[probe->next_target] = true;
+    }
+
+    CHECK(probe->ping_count == NUM_SCREENS - 1);
+    CHECK(!pinged[BOARD_ROLE]);
+    for (int board = 0; board < NUM_SCREENS; board++)
+        CHECK(pinged[board] == (board != BOARD_ROLE));
+
+    char expected[32];
+    snprintf(expected, sizeof(expected), "link pings %d, pongs 1", NUM_SCREENS - 1);
+
+    format_stats(text, sizeof(text), &global_state);
+    CHECK(strstr(text, expected) != NULL);
+    CHECK(strstr(text, "- round trip to b: 256:1") != NULL);
+}
+#endif
+
+/* ==================================================
+ * Configuration
+ * ================================================== */
+
+void test_config_roundtrip(void) {
+    host_setup();
+    wipe_config();
+
+    global_state.config.output[1].speed_x = 42;
+    save_config(&global_state);
+
+    memset(&global_state.config, 0, sizeof(config_t));
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == 42);
+
+    wipe_config();
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == default_config.output[1].speed_x);
+}
+
+/* Saves append to the log and only erase a sector when moving into it, boot finds the newest */
+void test_config_log(void) {
+    config_record_t *record;
+    uint32_t erases;
+
+    host_setup();
+    wipe_config();
+    load_config(&global_state);
+
+    /* Filling up the freshly wiped log doesn't need any erases */
+    erases = host_flash_erase_count;
+    for (int i = 0; i < CONFIG_RECORD_SLOTS; i++) {
+        global_state.config.output[1].speed_x = i;
+        save_config(&global_state);
+    }
+    CHECK(host_flash_erase_count == erases);
+
+    /* From then on, each sector gets erased once per lap around the log */
+    erases = host_flash_erase_count;
+    for (int i = 0; i < 2 * CONFIG_RECORD_SLOTS; i++) {
+        global_state.config.output[1].speed_x = 100 + i;
+        save_config(&global_state);
+    }
+    CHECK(host_flash_erase_count == erases + 2 * CONFIG_STORAGE_SECTORS);
+
+    /* Rebooted, all we have is what's in flash. The queues are left alone, host_setup() owns them. */
+    memset(&global_state.config, 0, sizeof(config_t));
+    memset(&global_state.config_store, 0, sizeof(config_store_t));
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == 100 + 2 * CONFIG_RECORD_SLOTS - 1);
+
+    /* A torn write of the newest record, we get the one before it and don't write over it */
+    record = (config_record_t *)(ADDR_CONFIG + (global_state.config_store.next_slot + CONFIG_RECORD_SLOTS - 1) %
+                                                   CONFIG_RECORD_SLOTS * CONFIG_RECORD_LENGTH);
+    ((uint8_t *)(record + 1))[4] ^= 0x10;
+
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == 100 + 2 * CONFIG_RECORD_SLOTS - 2);
+
+    global_state.config.output[1].speed_x = 7;
+    save_config(&global_state);
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == 7);
+
+    /* Wiped, everything's back to defaults */
+    wipe_config();
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == default_config.output[1].speed_x);
+    CHECK(global_state.config_store.next_slot == 0);
+}
+
+/* Configs stored by older firmware come back upgraded, not replaced by defaults */
+void test_config_migration(void) {
+    uint8_t *legacy = ADDR_CONFIG + CONFIG_STORAGE_LEN - FLASH_SECTOR_SIZE;
+    uint8_t corrupted[sizeof(config_t)];
+    config_t config;
+
+    /* Version 2 in the pre-log location, as if just upgraded */
+    host_setup();
+    wipe_config();
+    memcpy(legacy, config_v2_blob, config_v2_blob_len);
+    load_config(&global_state);
+
+    CHECK(global_state.config.version == CURRENT_CONFIG_VERSION);
+    CHECK(global_state.config.force_mouse_boot_mode == 1);
+    CHECK(global_state.config.output[OUTPUT_A].speed_x == 23);
+    CHECK(global_state.config.output[OUTPUT_A].speed_y == 19);
+    CHECK(global_state.config.output[OUTPUT_A].border.top == 1200);
+    CHECK(global_state.config.output[OUTPUT_A].border.bottom == 28000);
+    CHECK(global_state.config.output[OUTPUT_A].accel_curve == ACCEL_CURVE_NONE);
+    CHECK(global_state.config.output[OUTPUT_B].speed_x == 11);
+    CHECK(global_state.config.output[OUTPUT_B].speed_y == 13);
+    CHECK(global_state.config.output[OUTPUT_B].link_count == default_config.output[OUTPUT_B].link_count);
+    CHECK(global_state.edges.table[OUTPUT_B][EDGE_RIGHT][0] != 0);
+#if NUM_SCREENS > 2
+    CHECK(global_state.config.output[OUTPUT_C].speed_x == default_config.output[OUTPUT_C].speed_x);
+#endif
+
+    /* It's written back in the current format, after that it loads without upgrading */
+    CHECK(global_state.config_store.save_pending);
+    config_store_task(&global_state);
+
+    /* Rebooted, all we have is what's in flash. The queues are left alone, host_setup() owns them. */
+    memset(&global_state.config, 0, sizeof(config_t));
+    memset(&global_state.config_store, 0, sizeof(config_store_t));
+    load_config(&global_state);
+    CHECK(!global_state.config_store.save_pending);
+    CHECK(global_state.config.output[OUTPUT_A].border.top == 1200);
+
+    /* Version 3 keeps the acceleration too */
+    CHECK(migrate_config(config_v3_blob, config_v3_blob_len, &config) > 0);
+    CHECK(config.output[OUTPUT_A].accel_curve == ACCEL_CURVE_MILD);
+    CHECK(config.output[OUTPUT_B].accel_curve == ACCEL_CURVE_STRONG);
+    CHECK(config.output[OUTPUT_B].speed_y == 13);
+    CHECK(config.checksum == calc_checksum((uint8_t *)&config, sizeof(config_t) - sizeof(uint32_t)));
+
+    /* The current version goes through untouched */
+    CHECK(migrate_config((uint8_t *)&config, sizeof(config_t), &config) == 0);
+
+    /* Damaged, truncated or from the future, we don't guess */
+    memcpy(corrupted, config_v3_blob, config_v3_blob_len);
+    corrupted[30] ^= 0x01;
+    CHECK(migrate_config(corrupted, config_v3_blob_len, &config) < 0);
+    CHECK(migrate_config(config_v3_blob, config_v3_blob_len - 4, &config) < 0);
+
+    memcpy(corrupted, config_v3_blob, config_v3_blob_len);
+    corrupted[4] = 99;
+    corrupted[config_v3_blob_len - 4] ^= 3 ^ 99;
+    CHECK(migrate_config(corrupted, config_v3_blob_len, &config) < 0);
+
+#if NUM_SCREENS > 2
+    /* Version 4 from a two-output build, where A only leads to B. Widened, A leads to C too. */
+    struct {
+        uint32_t magic_header;
+        uint32_t version;
+        uint8_t force_mouse_boot_mode;
+        output_t output[2];
+        uint8_t screensaver_enabled;
+        uint32_t checksum;
+    } two_outputs;
+
+    memset(&two_outputs, 0, sizeof(two_outputs));
+    two_outputs.magic_header = 0xB00B1E5;
+    two_outputs.version      = 4;
+    memcpy(two_outputs.output, default_config.output, sizeof(two_outputs.output));
+    two_outputs.output[OUTPUT_A].link_count = 1;
+    two_outputs.output[OUTPUT_A].speed_x    = 31;
+
+    two_outputs.checksum = calc_checksum((uint8_t *)&two_outputs, sizeof(two_outputs) - sizeof(uint32_t));
+
+    CHECK(migrate_config((uint8_t *)&two_outputs, sizeof(two_outputs), &config) == 1);
+    CHECK(config.output[OUTPUT_A].speed_x == 31);
+    CHECK(config.output[OUTPUT_A].link_count == default_config.output[OUTPUT_A].link_count);
+
+    memcpy(&global_state.config, &config, sizeof(config_t));
+    build_edge_tables(&global_state);
+    CHECK(global_state.edges.table[OUTPUT_A][EDGE_LEFT][0] != 0);
+    CHECK(global_state.edges.table[OUTPUT_A][EDGE_RIGHT][0] != 0);
+    CHECK(global_state.edges.table[OUTPUT_C][EDGE_LEFT][0] != 0);
+#endif
+
+    wipe_config();
+}
+
+#ifndef PROTOCOL_V1
+/* Block of a config, as another board would send it */
+static int make_config_block(const config_t *config, int index, uint8_t address, uint8_t *frame) {
+    uint8_t payload[PACKET_DATA_LENGTH] = {CONFIG_SYNC_TAG, index};
+    int length = CONFIG_SYNC_LENGTH - index * CONFIG_SYNC_BLOCK_SIZE;
+
+    memcpy(&payload[2], (uint8_t *)config + index * CONFIG_SYNC_BLOCK_SIZE,
+           length < CONFIG_SYNC_BLOCK_SIZE ? length : CONFIG_SYNC_BLOCK_SIZE);
+    return make_frame(CONFIG_BLOCK_MSG, address, payload, frame);
+}
+
+/* Hashes of a config, starting with block first */
+static int make_config_hashes(const config_t *config, int first, uint8_t flags, uint8_t address, uint8_t *frame) {
+    uint8_t payload[PACKET_DATA_LENGTH] = {CONFIG_SYNC_TAG, first | flags};
+
+    for (int i = 0; i < CONFIG_SYNC_HASHES_PER_MSG && first + i < CONFIG_SYNC_BLOCKS; i++) {
+        uint16_t hash = calc_config_block_hash(config, first + i);
+        memcpy(&payload[2 + i * sizeof(uint16_t)], &hash, sizeof(uint16_t));
+    }
+
+    return make_frame(CONFIG_HASH_MSG, address, payload, frame);
+}
+
+/* Boards exchange only the blocks that differ, after a reboot or a change */
+void test_config_sync(void) {
+    config_sync_t *sync = &global_state.config_sync;
+    uint8_t payload[PACKET_DATA_LENGTH], frame[MAX_FRAME_LENGTH + 1];
+    config_t peer;
+    uint32_t sent;
+    int length, block, first, last;
+
+    host_setup();
+    host_uart_loopback = false;
+    start_config_sync(&global_state);
+
+    /* Just booted, we send our hashes */
+    CHECK(config_sync_ready(&global_state));
+    config_sync_task(&global_state);
+    CHECK(host_uart_tx_bytes > 0);
+    CHECK(sync->hellos_left == CONFIG_SYNC_HELLO_COUNT - 1);
+    CHECK(!config_sync_ready(&global_state));
+
+    /* B rebooted with an older border for output B, we only send it that one block */
+    memcpy(&peer, &global_state.config, sizeof(config_t));
+    peer.output[OUTPUT_B].border.top = 777;
+    block = offsetof(config_t, output[OUTPUT_B].border.top) / CONFIG_SYNC_BLOCK_SIZE;
+
+    for (int first = 0; first < CONFIG_SYNC_BLOCKS; first += CONFIG_SYNC_HASHES_PER_MSG) {
+        length = make_config_hashes(&peer, first, 0, MAKE_ADDRESS(OUTPUT_B, ADDR_BROADCAST), frame);
+        host_uart_inject(frame, length);
+        pump_uart();
+
+        while (deferred_packets_pending(&global_state))
+            process_deferred_packets_task(&global_state);
+    }
+    CHECK(sync->blocks_sent == 1);
+
+    /* A block from B that changes our config gets applied, saved and not sent back */
+    length = make_config_block(&peer, block, MAKE_ADDRESS(OUTPUT_B, ADDR_BROADCAST), frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+    process_deferred_packets_task(&global_state);
+
+    CHECK(global_state.config.output[OUTPUT_B].border.top == 777);
+    CHECK(global_state.config_store.save_pending);
+    CHECK(sync->blocks_received == 1);
+
+    request_config_sync(&global_state);
+    config_sync_task(&global_state);
+    CHECK(sync->blocks_sent == 1);
+
+    /* Border set here goes to the others for that exact output, only the changed blocks.
+       Every byte of border.top changes, so that's each block it spans. */
+    global_state.config.output[OUTPUT_A].border.top = ~1234;
+    for (int i = 0; i < CONFIG_SYNC_BLOCKS; i++)
+        sync->synced_hash[i] = calc_config_block_hash(&global_state.config, i);
+
+    first = offsetof(config_t, output[OUTPUT_A].border.top) / CONFIG_SYNC_BLOCK_SIZE;
+    last  = (offsetof(config_t, output[OUTPUT_A].border.top) + sizeof(int) - 1) / CONFIG_SYNC_BLOCK_SIZE;
+
+    global_state.active_output = OUTPUT_A;
+    global_state.mouse_y       = 1234;
+    screen_border_hotkey_handler(&global_state);
+
+    CHECK(config_sync_ready(&global_state));
+    config_sync_task(&global_state);
+    CHECK(sync->blocks_sent == 1 + last - first + 1);
+
+    /* Nobody acknowledges blocks, so the change is announced a few times after */
+    sync->hellos_left = 0;
+    CHECK(sync->announces_left == CONFIG_SYNC_ANNOUNCE_COUNT);
+    CHECK(!config_sync_ready(&global_state));
+
+    host_advance_time_us(CONFIG_SYNC_ANNOUNCE_PERIOD_US);
+    pump_uart();
+    sent = host_uart_tx_bytes;
+    CHECK(config_sync_ready(&global_state));
+    config_sync_task(&global_state);
+    pump_uart();
+
+    CHECK(sync->announces_left == CONFIG_SYNC_ANNOUNCE_COUNT - 1);
+    CHECK(host_uart_tx_log[(sent + 1) & UART_TX_RING_MASK] == CONFIG_HASH_MSG);
+    CHECK(host_uart_tx_log[(sent + 4) & UART_TX_RING_MASK] == CONFIG_SYNC_ANNOUNCE);
+
+    /* B announces a block we don't have, we ask B for it */
+    peer.output[OUTPUT_B].border.top = 555;
+    pump_uart();
+    sent   = host_uart_tx_bytes;
+    length = make_config_hashes(&peer, 0, CONFIG_SYNC_ANNOUNCE, MAKE_ADDRESS(OUTPUT_B, ADDR_BROADCAST), frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+    process_deferred_packets_task(&global_state);
+    pump_uart();
+
+    CHECK(host_uart_tx_log[(sent + 1) & UART_TX_RING_MASK] == CONFIG_HASH_MSG);
+    CHECK(host_uart_tx_log[(sent + 2) & UART_TX_RING_MASK] == MAKE_ADDRESS(BOARD_ROLE, OUTPUT_B));
+    CHECK(!(host_uart_tx_log[(sent + 4) & UART_TX_RING_MASK] & CONFIG_SYNC_ANNOUNCE));
+
+    /* Packets were dropped on the way to core0, we ask everyone again */
+    global_state.uart_rx.deferred_overflow_count++;
+    sent = host_uart_tx_bytes;
+    CHECK(config_sync_ready(&global_state));
+    config_sync_task(&global_state);
+    pump_uart();
+
+    CHECK(host_uart_tx_log[(sent + 1) & UART_TX_RING_MASK] == CONFIG_HASH_MSG);
+    CHECK(host_uart_tx_log[(sent + 2) & UART_TX_RING_MASK] == MAKE_ADDRESS(BOARD_ROLE, ADDR_BROADCAST));
+    CHECK(!(host_uart_tx_log[(sent + 4) & UART_TX_RING_MASK] & CONFIG_SYNC_ANNOUNCE));
+    CHECK(!config_sync_ready(&global_state));
+
+    /* Built with a different config layout, we stay out of it */
+    memset(payload, 0x55, sizeof(payload));
+    payload[0] = CONFIG_SYNC_TAG + 1;
+    payload[1] = block;
+    length     = make_frame(CONFIG_BLOCK_MSG, MAKE_ADDRESS(OUTPUT_B, ADDR_BROADCAST), payload, frame);
+    host_uart_inject(frame, length);
+    pump_uart();
+    process_deferred_packets_task(&global_state);
+    CHECK(global_state.config.output[OUTPUT_B].border.top == 777);
+}
+#endif
+
+/* Saves wait for the changes to settle and the input to go quiet, but not forever */
+void test_config_deferred_save(void) {
+    config_store_t *store = &global_state.config_store;
+    hid_keyboard_report_t report = {0};
+
+    host_setup();
+    wipe_config();
+
+    global_state.config.output[1].speed_x = 42;
+    request_config_save(&global_state);
+    host_advance_time_us(CONFIG_SAVE_DEBOUNCE_US / 2);
+
+    /* Another change restarts the debounce */
+    global_state.config.output[1].speed_x = 43;
+    request_config_save(&global_state);
+    host_advance_time_us(CONFIG_SAVE_DEBOUNCE_US / 2);
+    CHECK(!config_store_ready(&global_state));
+
+    /* Settled, but a key press is still on its way out */
+    host_advance_time_us(CONFIG_SAVE_DEBOUNCE_US);
+    ring_try_add(&global_state.kbd_queue, &report);
+    CHECK(!config_store_ready(&global_state));
+
+    ring_try_remove(&global_state.kbd_queue, &report);
+    CHECK(config_store_ready(&global_state));
+
+    /* Busy for too long, it gets written anyway */
+    ring_try_add(&global_state.kbd_queue, &report);
+    host_advance_time_us(CONFIG_SAVE_MAX_DELAY_US);
+    CHECK(config_store_ready(&global_state));
+    ring_try_remove(&global_state.kbd_queue, &report);
+
+    config_store_task(&global_state);
+    CHECK(!config_store_ready(&global_state));
+    CHECK(store->write_count == 1);
+
+    memset(&global_state.config, 0, sizeof(config_t));
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == 43);
+
+    /* Wiping resets the RAM copy now and erases the flash later */
+    reset_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == default_config.output[1].speed_x);
+    CHECK(!config_store_ready(&global_state));
+
+    host_advance_time_us(CONFIG_SAVE_DEBOUNCE_US + 1);
+    CHECK(config_store_ready(&global_state));
+    config_store_task(&global_state);
+    CHECK(store->write_count == 2);
+
+    global_state.config.output[1].speed_x = 0;
+    load_config(&global_state);
+    CHECK(global_state.config.output[1].speed_x == default_config.output[1].speed_x);
+}
+
+/* ==================================================
+ * Runner
+ * ================================================== */
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} test_t;
+
+#define TEST(fn) {#fn, fn}
+
+const test_t tests[] = {
+    TEST(test_cobs_roundtrip),
+    TEST(test_crc8),
+    TEST(test_uart_keyboard_relay),
+    TEST(test_uart_short_message),
+    TEST(test_uart_resync_and_corruption),
+    TEST(test_deferred_handler),
+#if !defined(PROTOCOL_V1) && NUM_SCREENS > 2
+    TEST(test_uart_routing),
+    TEST(test_uart_hop_latency),
+#endif
+#ifndef PROTOCOL_V1
+    TEST(test_uart_probe_passthrough),
+#endif
+    TEST(test_output_cycling),
+    TEST(test_scheduler),
+#if defined(INSTRUMENTATION) && !defined(PROTOCOL_V1)
+    TEST(test_link_probe),
+#endif
+    TEST(test_spsc_stress),
+    TEST(test_mouse_coalescing),
+    TEST(test_subpixel_motion),
+    TEST(test_report_parser),
+    TEST(test_report_parser_multiple_ids),
+    TEST(test_multiple_devices),
+    TEST(test_descriptor_cache),
+    TEST(test_extraction_plan),
+    TEST(test_monitor_layout),
+    TEST(test_hotkeys),
+    TEST(test_config_roundtrip),
+    TEST(test_config_log),
+    TEST(test_config_migration),
+#ifndef PROTOCOL_V1
+    TEST(test_config_sync),
+#endif
+    TEST(test_config_deferred_save),
+};
+
+int main(void) {
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        int before = failures;
+        tests[i].run();
+        printf("%s %s\n", failures == before ? "ok  " : "FAIL", tests[i].name);
+    }
+
+    printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "main.h"
+
+#ifndef PROTOCOL_V1
+/**================================================== *
+ * ================  Config Sync  =================== *
+ * ================================================== *
+ *
+ * Every board keeps the whole config_t, split in blocks of CONFIG_SYNC_BLOCK_SIZE bytes.
+ *
+ * After boot, a board sends the hashes of its blocks a few times. Boards that have been up
+ * for a while (or board A, if everyone's just starting) answer with the blocks that differ,
+ * so a rebooted board picks up what changed while it was away.
+ *
+ * When the config is changed on a board, it sends the blocks that differ from what the
+ * others have to everyone, then announces its hashes a few times. A board that still has
+ * different blocks missed some, so it asks the announcing board for them directly.
+ *
+ * A board that dropped packets because its deferred queue was full asks everyone again.
+ */
+
+/* Fletcher-16, cheap and catches more than a CRC-8 over a block this size */
+uint16_t calc_block_hash(const uint8_t *data, int length) {
+    uint16_t sum1 = 0, sum2 = 0;
+
+    for (int i = 0; i < length; i++) {
+        sum1 = (sum1 + data[i]) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+
+    return (sum2 << 8) | sum1;
+}
+
+/* Last block is usually shorter */
+int config_block_length(int index) {
+    int remaining = CONFIG_SYNC_LENGTH - index * CONFIG_SYNC_BLOCK_SIZE;
+    return remaining < CONFIG_SYNC_BLOCK_SIZE ? remaining : CONFIG_SYNC_BLOCK_SIZE;
+}
+
+uint16_t calc_config_block_hash(const config_t *config, int index) {
+    const uint8_t *block = (const uint8_t *)config + index * CONFIG_SYNC_BLOCK_SIZE;
+    return calc_block_hash(block, config_block_length(index));
+}
+
+/* Board A has the final say if everyone's just starting up, otherwise the boards that weren't rebooted */
+bool config_sync_is_authoritative(void) {
+    return BOARD_ROLE == OUTPUT_A || time_us_64() > CONFIG_SYNC_SETTLE_US;
+}
+
+/* Called once the config is loaded, before the tasks start */
+void start_config_sync(device_t *state) {
+    config_sync_t *sync = &state->config_sync;
+
+    /* Until we hear otherwise, assume everyone has the same as we do */
+    for (int i = 0; i < CONFIG_SYNC_BLOCKS; i++)
+        sync->synced_hash[i] = calc_config_block_hash(&state->config, i);
+
+    sync->hellos_left    = CONFIG_SYNC_HELLO_COUNT;
+    sync->next_hello     = time_us_32();
+    sync->seen_overflows = state->uart_rx.deferred_overflow_count;
+}
+
+/* Config was changed here, either core can ask */
+void request_config_sync(device_t *state) {
+    /* Config changes must be in place before core0 sees the flag */
+    __dmb();
+    state->config_sync.push_pending = true;
+}
+
+void send_config_block(device_t *state, uint8_t destination, int index) {
+    uint8_t payload[PACKET_DATA_LENGTH] = {CONFIG_SYNC_TAG, index};
+
+    memcpy(&payload[2], (uint8_t *)&state->config + index * CONFIG_SYNC_BLOCK_SIZE, config_block_length(index));
+    send_packet_to(destination, payload, CONFIG_BLOCK_MSG, sizeof(payload));
+
+    state->config_sync.blocks_sent++;
+}
+
+/* Hashes of all our blocks, as many messages as it takes. Flags go in with the first index. */
+void send_config_hashes(device_t *state, uint8_t destination, uint8_t flags) {
+    for (int first = 0; first < CONFIG_SYNC_BLOCKS; first += CONFIG_SYNC_HASHES_PER_MSG) {
+        uint8_t payload[PACKET_DATA_LENGTH] = {CONFIG_SYNC_TAG, first | flags};
+
+        for (int i = 0; i < CONFIG_SYNC_HASHES_PER_MSG && first + i < CONFIG_SYNC_BLOCKS; i++) {
+            uint16_t hash = calc_config_block_hash(&state->config, first + i);
+            memcpy(&payload[2 + i * sizeof(uint16_t)], &hash, sizeof(uint16_t));
+        }
+
+        send_packet_to(destination, payload, CONFIG_HASH_MSG, sizeof(payload));
+    }
+}
+
+/* Some left to send and it's time */
+bool sync_is_due(uint8_t left, uint32_t when) {
+    return left && (int32_t)(time_us_32() - when) >= 0;
+}
+
+bool config_sync_ready(device_t *state) {
+    config_sync_t *sync = &state->config_sync;
+
+    if (sync->push_pending || sync->seen_overflows != state->uart_rx.deferred_overflow_count)
+        return true;
+
+    return sync_is_due(sync->hellos_left, sync->next_hello) || sync_is_due(sync->announces_left, sync->next_announce);
+}
+
+/* Runs on core0, sends the hashes after boot and our changes to everyone */
+void config_sync_task(device_t *state) {
+    config_sync_t *sync = &state->config_sync;
+    bool changed        = false;
+
+    if (sync_is_due(sync->hellos_left, sync->next_hello)) {
+        send_config_hashes(state, ADDR_BROADCAST, 0);
+        sync->hellos_left--;
+        sync->next_hello += CONFIG_SYNC_HELLO_PERIOD_US;
+    }
+
+    /* Whatever got dropped might have been a config block, ask again */
+    if (sync->seen_overflows != state->uart_rx.deferred_overflow_count) {
+        sync->seen_overflows = state->uart_rx.deferred_overflow_count;
+        send_config_hashes(state, ADDR_BROADCAST, 0);
+    }
+
+    if (sync_is_due(sync->announces_left, sync->next_announce)) {
+        send_config_hashes(state, ADDR_BROADCAST, CONFIG_SYNC_ANNOUNCE);
+        sync->announces_left--;
+        sync->next_announce += CONFIG_SYNC_ANNOUNCE_PERIOD_US;
+    }
+
+    if (!sync->push_pending)
+        return;
+
+    sync->push_pending = false;
+
+    for (int i = 0; i < CONFIG_SYNC_BLOCKS; i++) {
+        uint16_t hash = calc_config_block_hash(&state->config, i);
+
+        if (hash == sync->synced_hash[i])
+            continue;
+
+        send_config_block(state, ADDR_BROADCAST, i);
+        sync->synced_hash[i] = hash;
+        changed              = true;
+    }
+
+    /* Nobody acknowledges the blocks, so tell everyone what they should have ended up with */
+    if (changed) {
+        sync->announces_left = CONFIG_SYNC_ANNOUNCE_COUNT;
+        sync->next_announce  = time_us_32() + CONFIG_SYNC_ANNOUNCE_PERIOD_US;
+    }
+}
+
+/* Someone's asking, reply with our blocks that are different from theirs. If they are
+   announcing a change instead, ask them for the blocks we don't have. */
+void handle_config_hash_msg(uart_packet_t *packet, device_t *state) {
+    uint8_t first = packet->data[1] & ~CONFIG_SYNC_ANNOUNCE;
+    bool announce = packet->data[1] & CONFIG_SYNC_ANNOUNCE;
+
+    if (packet->data[0] != CONFIG_SYNC_TAG)
+        return;
+
+    /* Broadcasts are answered by whoever has the final say, requests to us always */
+    if (!announce && ADDRESS_DST(packet->address) != BOARD_ROLE && !config_sync_is_authoritative())
+        return;
+
+    for (int i = 0; i < CONFIG_SYNC_HASHES_PER_MSG && first + i < CONFIG_SYNC_BLOCKS; i++) {
+        uint16_t hash;
+        memcpy(&hash, &packet->data[2 + i * sizeof(uint16_t)], sizeof(uint16_t));
+
+        if (hash == calc_config_block_hash(&state->config, first + i))
+            continue;
+
+        if (announce) {
+            send_config_hashes(state, ADDRESS_SRC(packet->address), 0);
+            return;
+        }
+
+        send_config_block(state, ADDRESS_SRC(packet->address), first + i);
+    }
+}
+
+/* Take the block over, whether we asked for it or someone changed their config */
+void handle_config_block_msg(uart_packet_t *packet, device_t *state) {
+    config_sync_t *sync = &state->config_sync;
+    uint8_t index       = packet->data[1];
+
+    if (packet->data[0] != CONFIG_SYNC_TAG || index >= CONFIG_SYNC_BLOCKS)
+        return;
+
+    uint8_t *block = (uint8_t *)&state->config + index * CONFIG_SYNC_BLOCK_SIZE;
+    int length     = config_block_length(index);
+
+    sync->blocks_received++;
+    sync->synced_hash[index] = calc_block_hash(&packet->data[2], length);
+
+    if (!memcmp(block, &packet->data[2], length))
+        return;
+
+    memcpy(block, &packet->data[2], length);
+
+    /* Borders and layout might have changed, core1 rebuilds its edge tables */
+    request_edge_tables_rebuild(state);
+    request_config_save(state);
+}
+#endif
@@ -9,24 +9,91 @@ const config_t default_config = {
             .number = OUTPUT_A,
             .speed_x = MOUSE_SPEED_A_FACTOR_X,
             .speed_y = MOUSE_SPEED_A_FACTOR_Y,
+            .accel_curve = MOUSE_ACCEL_A,
             .border = {
                 .top = 0,
                 .bottom = MAX_SCREEN_COORD,
             },
             .screen_count = 1,
             .screen_index = 0,
-        },        
+            .monitors = {
+                {.left = 0, .right = MAX_SCREEN_COORD, .top = 0, .bottom = MAX_SCREEN_COORD},
+            },
+            /* Output B is to the left of A, any further outputs continue to the right */
+            .links = {
+                {.side = EDGE_LEFT, .monitor = 0, .target_output = OUTPUT_B, .target_monitor = 0},
+#if NUM_SCREENS > 2
+                {.side = EDGE_RIGHT, .monitor = 0, .target_output = OUTPUT_C, .target_monitor = 0},
+#endif
+            },
+            .link_count = NUM_SCREENS > 2 ? 2 : 1,
+        },
     .output[OUTPUT_B] =
         {
             .number = OUTPUT_B,
             .speed_x = MOUSE_SPEED_B_FACTOR_X,
             .speed_y = MOUSE_SPEED_B_FACTOR_Y,
+            .accel_curve = MOUSE_ACCEL_B,
+            .border = {
+                .top = 0,
+                .bottom = MAX_SCREEN_COORD,
+            },
+            .screen_count = 1,
+            .screen_index = 0,
+            .monitors = {
+                {.left = 0, .right = MAX_SCREEN_COORD, .top = 0, .bottom = MAX_SCREEN_COORD},
+            },
+            .links = {
+                {.side = EDGE_RIGHT, .monitor = 0, .target_output = OUTPUT_A, .target_monitor = 0},
+            },
+            .link_count = 1,
+        },
+#if NUM_SCREENS > 2
+    .output[OUTPUT_C] =
+        {
+            .number = OUTPUT_C,
+            .speed_x = MOUSE_SPEED_A_FACTOR_X,
+            .speed_y = MOUSE_SPEED_A_FACTOR_Y,
+            .accel_curve = MOUSE_ACCEL_A,
             .border = {
                 .top = 0,
                 .bottom = MAX_SCREEN_COORD,
             },
             .screen_count = 1,
             .screen_index = 0,
+            .monitors = {
+                {.left = 0, .right = MAX_SCREEN_COORD, .top = 0, .bottom = MAX_SCREEN_COORD},
+            },
+            .links = {
+                {.side = EDGE_LEFT, .monitor = 0, .target_output = OUTPUT_A, .target_monitor = 0},
+#if NUM_SCREENS > 3
+                {.side = EDGE_RIGHT, .monitor = 0, .target_output = OUTPUT_D, .target_monitor = 0},
+#endif
+            },
+            .link_count = NUM_SCREENS > 3 ? 2 : 1,
+        },
+#endif
+#if NUM_SCREENS > 3
+    .output[OUTPUT_D] =
+        {
+            .number = OUTPUT_D,
+            .speed_x = MOUSE_SPEED_A_FACTOR_X,
+            .speed_y = MOUSE_SPEED_A_FACTOR_Y,
+            .accel_curve = MOUSE_ACCEL_A,
+            .border = {
+                .top = 0,
+                .bottom = MAX_SCREEN_COORD,
+            },
+            .screen_count = 1,
+            .screen_index = 0,
+            .monitors = {
+                {.left = 0, .right = MAX_SCREEN_COORD, .top = 0, .bottom = MAX_SCREEN_COORD},
+            },
+            .links = {
+                {.side = EDGE_LEFT, .monitor = 0, .target_output = OUTPUT_C, .target_monitor = 0},
+            },
+            .link_count = 1,
         },
+#endif
     .screensaver_enabled = SCREENSAVER_ENABLED,
 };
\ No newline at end of file
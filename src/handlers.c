@@ -27,8 +27,8 @@ void output_toggle_hotkey_handler(device_t *state) {
     if (state->switch_lock)
         return;
 
-    state->active_output ^= 1;
-    switch_output(state, state->active_output);
+    /* Cycle through all outputs, in order */
+    switch_output(state, (state->active_output + 1) % NUM_SCREENS);
 };
 
 /* This key combo records switch y top coordinate for different-size monitors  */
@@ -41,20 +41,43 @@ void screen_border_hotkey_handler(device_t *state) {
     else
         border->top = state->mouse_y;
 
+#ifdef PROTOCOL_V1
     send_packet((uint8_t *)border, SYNC_BORDERS_MSG, sizeof(border_size_t));
-    save_config(state);
+#else
+    /* The block carries the border of this exact output, whichever the others think is active */
+    request_config_sync(state);
+#endif
+    request_config_save(state);
 };
 
 /* This key combo puts board A in firmware upgrade mode */
 void fw_upgrade_hotkey_handler_A(device_t *state) {
+    /* Don't lose anything still queued for the other board when we reboot */
+    uart_tx_flush();
     reset_usb_boot(1 << PICO_DEFAULT_LED_PIN, 0);
 };
 
 /* This key combo puts board B in firmware upgrade mode */
 void fw_upgrade_hotkey_handler_B(device_t *state) {
-    send_value(ENABLE, FIRMWARE_UPGRADE_MSG);
+    const uint8_t enable = ENABLE;
+    send_packet_to(OUTPUT_B, &enable, FIRMWARE_UPGRADE_MSG, sizeof(uint8_t));
+
+    /* Make sure board B actually got the message before we carry on */
+    uart_tx_flush();
 };
 
+#ifdef INSTRUMENTATION
+/* Stats get typed out by the board of the active output, since that's where the keys go */
+void stats_dump_hotkey_handler(device_t *state) {
+    const uint8_t enable = ENABLE;
+
+    if (CURRENT_BOARD_IS_ACTIVE_OUTPUT)
+        request_stats_dump(state);
+    else
+        send_packet_to(state->active_output, &enable, DUMP_STATS_MSG, sizeof(uint8_t));
+}
+#endif
+
 /* This key combo prevents mouse from switching outputs */
 void switchlock_hotkey_handler(device_t *state) {
     state->switch_lock ^= 1;
@@ -63,8 +86,7 @@ void switchlock_hotkey_handler(device_t *state) {
 
 /* When pressed, erases stored config in flash and loads defaults on both boards */
 void wipe_config_hotkey_handler(device_t *state) {
-    wipe_config();
-    load_config(state);
+    reset_config(state);
     send_value(ENABLE, WIPE_CONFIG_MSG);
 }
 
@@ -102,6 +124,9 @@ void handle_mouse_abs_uart_msg(uart_packet_t *packet, device_t *state) {
 
 /* Function handles request to switch output  */
 void handle_output_select_msg(uart_packet_t *packet, device_t *state) {
+    if (packet->data[0] >= NUM_SCREENS)
+        return;
+
     state->active_output = packet->data[0];
     if (state->tud_connected)
         release_all_keys(state);
@@ -134,7 +159,7 @@ void handle_switch_lock_msg(uart_packet_t *packet, device_t *state) {
 void handle_sync_borders_msg(uart_packet_t *packet, device_t *state) {
     border_size_t *border = &state->config.output[state->active_output].border;
     memcpy(border, packet->data, sizeof(border_size_t));
-    save_config(state);
+    request_config_save(state);
 }
 
 /* When this message is received, flash the locally attached LED to verify serial comms */
@@ -144,14 +169,20 @@ void handle_flash_led_msg(uart_packet_t *packet, device_t *state) {
 
 /* When this message is received, wipe the local flash config */
 void handle_wipe_config_msg(uart_packet_t *packet, device_t *state) {
-    wipe_config();
-    load_config(state);
+    reset_config(state);
 }
 
 void handle_screensaver_msg(uart_packet_t *packet, device_t *state) {
     state->config.screensaver_enabled = packet->data[0];
 }
 
+#ifdef INSTRUMENTATION
+/* Keyboard is on the other board, but we're the active output, so we do the typing */
+void handle_dump_stats_msg(uart_packet_t *packet, device_t *state) {
+    request_stats_dump(state);
+}
+#endif
+
 /**==================================================== *
  * ==============  Output Switch Routines  ============ *
  * ==================================================== */
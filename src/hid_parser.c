@@ -20,9 +20,6 @@
 
 #include "main.h"
 
-#define IS_BLOCK_END (collection.start == collection.end)
-#define MAX_BUTTONS  16
-
 enum { SIZE_0_BIT = 0, SIZE_8_BIT = 1, SIZE_16_BIT = 2, SIZE_32_BIT = 3 };
 
 /* Size is 0, 1, 2, or 3, describing cases of no data, 8-bit, 16-bit,
@@ -40,37 +37,35 @@ uint32_t get_descriptor_value(uint8_t const *report, int size) {
     }
 }
 
-/* We store all globals as unsigned to avoid countless switch/cases.
-In case of e.g. min/max, we need to treat some data as signed retroactively. */
-int32_t to_signed(globals_t *data) {
-    switch (data->hdr.size) {
+/* We read all item data as unsigned. In case of e.g. min/max, we need to treat
+   some data as signed retroactively, based on how many bytes it had. */
+int32_t to_signed(uint32_t data, int size) {
+    switch (size) {
         case SIZE_8_BIT:
-            return (int8_t)data->val;
+            return (int8_t)data;
         case SIZE_16_BIT:
-            return (int16_t)data->val;
+            return (int16_t)data;
         default:
-            return data->val;
+            return data;
     }
 }
 
 /* Given a value struct with size and offset in bits,
-   find and return a value from the HID report */
-
-int32_t get_report_value(uint8_t *report, report_val_t *val) {
-    /* Calculate the bit offset within the byte */
-    uint8_t offset_in_bits = val->offset % 8;
+   find and return a value from the HID report. This is the slow path
+   that works for any field, see get_report_value() for the fast ones. */
 
+int32_t get_report_value_generic(uint8_t *report, report_val_t *val) {
     /* Calculate the remaining bits in the first byte */
-    uint8_t remaining_bits = 8 - offset_in_bits;
+    uint8_t remaining_bits = 8 - val->shift;
 
-    /* Calculate the byte offset in the array */
-    uint8_t byte_offset = val->offset >> 3;
+    /* Byte offset in the array */
+    uint8_t byte_offset = val->byte_offset;
 
     /* Create a mask for the specified number of bits */
     uint32_t mask = (1u << val->size) - 1;
 
     /* Initialize the result value with the bits from the first byte */
-    int32_t result = report[byte_offset] >> offset_in_bits;
+    int32_t result = report[byte_offset] >> val->shift;
 
     /* Move to the next byte and continue fetching bits until the desired length is reached */
     while (val->size > remaining_bits) {
@@ -91,122 +86,348 @@ int32_t get_report_value(uint8_t *report, report_val_t *val) {
     return result;
 }
 
-void update_usage(parser_state_t *parser, int i) {
-    /* If we don't have as many usages as elements, the usage for the previous element applies */
-    if (i && i >= parser->usage_count) {
-        *(parser->p_usage + i) = *(parser->p_usage + parser->usage_count - 1);
+/* Pick the cheapest way to extract this field. Must be called once the offset and size are final. */
+void compile_report_value(report_val_t *val) {
+    val->byte_offset = val->offset >> 3;
+    val->shift       = val->offset % 8;
+
+    if (!val->size)
+        val->kind = EXTRACT_NONE;
+    else if (val->shift == 0 && val->size == 8)
+        val->kind = EXTRACT_8BIT;
+    else if (val->shift == 0 && val->size == 16)
+        val->kind = EXTRACT_16BIT;
+    else
+        val->kind = EXTRACT_GENERIC;
+}
+
+/* Return a (sign-extended) value from the HID report, using the plan made by compile_report_value() */
+int32_t get_report_value(uint8_t *report, report_val_t *val) {
+    switch (val->kind) {
+        case EXTRACT_8BIT:
+            return (int8_t)report[val->byte_offset];
+
+        case EXTRACT_16BIT:
+            return (int16_t)tu_u16(report[val->byte_offset + 1], report[val->byte_offset]);
+
+        case EXTRACT_GENERIC:
+            return get_report_value_generic(report, val);
+
+        default:
+            return 0;
     }
 }
 
-void find_and_store_element(parser_state_t *parser, int map_len, int i) {
-    usage_map_t *map = &parser->map[0];
+/* ==================================================
+ * Report layouts
+ * ================================================== */
 
-    for (int j = 0; j < map_len; j++, map++) {
-        /* Filter based on usage criteria */
-        if (map->report_usage == parser->global_usage
-            && map->usage_page == parser->globals[RI_GLOBAL_USAGE_PAGE].val
-            && map->usage == *(parser->p_usage + i)) {
+/* Look up where the values are in a mouse report with this ID, NULL if it's not a mouse report.
+   Devices not using report IDs have everything under ID 0. */
+report_layout_t *find_report_layout(mouse_t *mouse, uint8_t report_id) {
+    uint8_t index = mouse->report_lookup[report_id];
+    return index ? &mouse->reports[index - 1] : NULL;
+}
 
-            /* Buttons are the ones that appear multiple times, aggregate for now */
-            if (map->element->size) {
-                map->element->size++;
-                continue;
-            }
+/* Find the layout for this report ID, or start a new one. NULL if we're out of room. */
+report_layout_t *add_report_layout(mouse_t *mouse, uint8_t report_id, int max_reports) {
+    report_layout_t *layout = find_report_layout(mouse, report_id);
 
-            /* Store the found element's attributes */
-            map->element->offset = parser->offset_in_bits;
-            map->element->size   = parser->globals[RI_GLOBAL_REPORT_SIZE].val;
-            map->element->min    = to_signed(&parser->globals[RI_GLOBAL_LOGICAL_MIN]);
-            map->element->max    = to_signed(&parser->globals[RI_GLOBAL_LOGICAL_MAX]);
+    if (layout || mouse->report_count >= max_reports)
+        return layout;
+
+    layout            = &mouse->reports[mouse->report_count++];
+    layout->report_id = report_id;
+
+    mouse->report_lookup[report_id] = mouse->report_count;
+    return layout;
+}
+
+/* Each report ID has its own running input offset. NULL if we're out of room to track it. */
+report_offset_t *get_report_offset(parser_state_t *parser, uint8_t report_id) {
+    for (int i = 0; i < parser->offset_count; i++)
+        if (parser->offsets[i].report_id == report_id)
+            return &parser->offsets[i];
+
+    if (parser->offset_count >= MAX_REPORT_IDS)
+        return NULL;
+
+    report_offset_t *offset = &parser->offsets[parser->offset_count++];
+    offset->report_id       = report_id;
+    return offset;
+}
+
+/* ==================================================
+ * Item handlers
+ * ================================================== */
+
+/* Return the usage that applies to the i-th element of the current main item. If there are
+   fewer usages than elements, the last one applies to the rest. Usages that came without
+   a page get the one that's current now, at the main item. */
+uint32_t get_usage(parser_state_t *parser, int i) {
+    uint32_t usage = 0;
+
+    for (int j = 0; j < parser->usage_count; j++) {
+        usage_range_t *range = &parser->usages[j];
+        int count            = (range->max >= range->min) ? range->max - range->min + 1 : 1;
+
+        if (i < count) {
+            usage = range->min + i;
+            break;
         }
+
+        i -= count;
+        usage = range->min + count - 1;
     }
+
+    if (usage >> 16 == 0)
+        usage |= HID_FULL_USAGE(parser->globals.usage_page, 0);
+
+    return usage;
 }
 
-void handle_global_item(parser_state_t *parser, header_t *header, uint32_t data, mouse_t *mouse) {
-    /* There are just 16 possible tags, store any one that comes along to an array
-        instead of doing switch and 16 cases */
-    parser->globals[header->tag].val = data;
-    parser->globals[header->tag].hdr = *header;
+/* Globals come in any order, so the maximum is resolved only once the field is stored.
+   If the minimum isn't negative, the maximum is meant to be unsigned (e.g. 0..255 in 1 byte) */
+int32_t resolve_logical_max(hid_globals_t *globals) {
+    if (globals->logical_min >= 0)
+        return globals->logical_max;
 
-    if (header->tag == RI_GLOBAL_REPORT_ID) {
-        /* Important to track, if report IDs are used reports are preceded/offset by a 1-byte ID value */
-        if (parser->global_usage == HID_USAGE_DESKTOP_MOUSE)
-            mouse->report_id = data;
+    return to_signed(globals->logical_max, globals->logical_max_size);
+}
+
+void store_field(report_val_t *field, parser_state_t *parser, uint32_t offset) {
+    field->offset = offset;
+    field->size   = parser->globals.report_size;
+    field->min    = parser->globals.logical_min;
+    field->max    = resolve_logical_max(&parser->globals);
+}
+
+/* Buttons are 1-bit fields, we take them as one value as long as they are numbered and
+   laid out one after another, starting from button 1 */
+void store_button(report_val_t *buttons, uint32_t usage, uint32_t offset) {
+    uint16_t button = usage & 0xFFFF;
 
-        mouse->uses_report_id = true;
+    if (!buttons->size && button == 1) {
+        buttons->offset = offset;
+        buttons->size   = 1;
+        buttons->max    = 1;
+    }
+
+    else if (buttons->size && buttons->size < MAX_BUTTONS && button == buttons->size + 1
+             && offset == buttons->offset + buttons->size) {
+        buttons->size++;
     }
 }
 
-void handle_local_item(parser_state_t *parser, header_t *header, uint32_t data) {
-    if (header->tag == RI_LOCAL_USAGE) {
-        /* If we are not within a collection, the usage tag applies to the entire section */
-        if (parser->collection.start == parser->collection.end) {
-            parser->global_usage = data;
-        } else {
-            *(parser->p_usage + parser->usage_count++) = data;
-        }
+/* See if this report element is one of the values we need, remember where it is if so */
+void map_input_field(report_layout_t *layout, parser_state_t *parser, uint32_t usage, uint32_t offset) {
+    uint32_t end = offset + parser->globals.report_size;
+
+    /* Can't describe fields past this point in report_val_t */
+    if (end > 255 * 8)
+        return;
+
+    switch (usage) {
+        case HID_FULL_USAGE(HID_USAGE_PAGE_DESKTOP, HID_USAGE_DESKTOP_X):
+            if (!layout->move_x.size)
+                store_field(&layout->move_x, parser, offset);
+            break;
+
+        case HID_FULL_USAGE(HID_USAGE_PAGE_DESKTOP, HID_USAGE_DESKTOP_Y):
+            if (!layout->move_y.size)
+                store_field(&layout->move_y, parser, offset);
+            break;
+
+        case HID_FULL_USAGE(HID_USAGE_PAGE_DESKTOP, HID_USAGE_DESKTOP_WHEEL):
+            if (!layout->wheel.size)
+                store_field(&layout->wheel, parser, offset);
+            break;
+
+        case HID_FULL_USAGE(HID_USAGE_PAGE_CONSUMER, HID_USAGE_CONSUMER_AC_PAN):
+            if (!layout->pan.size)
+                store_field(&layout->pan, parser, offset);
+            break;
+
+        default:
+            if (usage >> 16 == HID_USAGE_PAGE_BUTTON && parser->globals.report_size == 1)
+                store_button(&layout->buttons, usage, offset);
+            else
+                return;
     }
+
+    if (layout->length < (end + 7) / 8)
+        layout->length = (end + 7) / 8;
 }
 
-void handle_main_item(parser_state_t *parser, header_t *header, int map_len) {
-    /* Update Collection */
-    parser->collection.start += (header->tag == RI_MAIN_COLLECTION);
-    parser->collection.end += (header->tag == RI_MAIN_COLLECTION_END);
+void handle_input_item(parser_state_t *parser, uint32_t flags, mouse_t *mouse, int max_reports) {
+    hid_globals_t *globals  = &parser->globals;
+    report_offset_t *offset = get_report_offset(parser, globals->report_id);
+    report_layout_t *layout = NULL;
 
-    if (header->tag == RI_MAIN_INPUT) {
-        for (int i = 0; i < parser->globals[RI_GLOBAL_REPORT_COUNT].val; i++) {
-            update_usage(parser, i);
-            find_and_store_element(parser, map_len, i);
+    if (!offset)
+        return;
 
-            /* Iterate <count> times and increase offset by <size> amount, moving by <count> x <size> bits */
-            parser->offset_in_bits += parser->globals[RI_GLOBAL_REPORT_SIZE].val;
-        }
+    /* Only variable, non-constant fields in a mouse collection are of any interest */
+    if (parser->application_usage == HID_FULL_USAGE(HID_USAGE_PAGE_DESKTOP, HID_USAGE_DESKTOP_MOUSE)
+        && !(flags & HID_MAIN_CONSTANT) && (flags & HID_MAIN_VARIABLE))
+        layout = add_report_layout(mouse, globals->report_id, max_reports);
 
-        /* Advance the usage array pointer by global report count and reset the count variable */
-        parser->p_usage += parser->globals[RI_GLOBAL_REPORT_COUNT].val;
-        parser->usage_count = 0;
+    if (!layout) {
+        offset->offset_in_bits += globals->report_size * globals->report_count;
+        return;
     }
+
+    for (int i = 0; i < globals->report_count; i++) {
+        map_input_field(layout, parser, get_usage(parser, i), offset->offset_in_bits);
+        offset->offset_in_bits += globals->report_size;
+    }
+}
+
+void handle_main_item(parser_state_t *parser, header_t *header, uint32_t data, mouse_t *mouse, int max_reports) {
+    switch (header->tag) {
+        case RI_MAIN_COLLECTION:
+            /* Top level collection tells us what kind of device this part of the descriptor is about */
+            if (parser->collection_depth++ == 0)
+                parser->application_usage = get_usage(parser, 0);
+            break;
+
+        case RI_MAIN_COLLECTION_END:
+            if (parser->collection_depth)
+                parser->collection_depth--;
+            break;
+
+        case RI_MAIN_INPUT:
+            handle_input_item(parser, data, mouse, max_reports);
+            break;
+    }
+
+    /* Local items only apply to the next main item */
+    parser->usage_count      = 0;
+    parser->delimiter_depth  = 0;
+    parser->delimiter_branch = 0;
 }
 
+void handle_global_item(parser_state_t *parser, header_t *header, uint32_t data, mouse_t *mouse) {
+    hid_globals_t *globals = &parser->globals;
 
-/* This method is sub-optimal and far from a generalized HID descriptor parsing, but should
- * hopefully work well enough to find the basic values we care about to move the mouse around.
- * Your descriptor for a mouse with 2 wheels and 264 buttons might not parse correctly.
+    switch (header->tag) {
+        case RI_GLOBAL_USAGE_PAGE:
+            globals->usage_page = data;
+            break;
+
+        case RI_GLOBAL_LOGICAL_MIN:
+            globals->logical_min = to_signed(data, header->size);
+            break;
+
+        case RI_GLOBAL_LOGICAL_MAX:
+            globals->logical_max      = data;
+            globals->logical_max_size = header->size;
+            break;
+
+        case RI_GLOBAL_REPORT_SIZE:
+            globals->report_size = data;
+            break;
+
+        case RI_GLOBAL_REPORT_COUNT:
+            globals->report_count = data;
+            break;
+
+        /* Important to track, if report IDs are used reports are preceded/offset by a 1-byte ID value */
+        case RI_GLOBAL_REPORT_ID:
+            globals->report_id    = data;
+            mouse->uses_report_id = true;
+            break;
+
+        case RI_GLOBAL_PUSH:
+            if (parser->global_stack_depth < MAX_GLOBAL_STACK)
+                parser->global_stack[parser->global_stack_depth++] = *globals;
+            break;
+
+        case RI_GLOBAL_POP:
+            if (parser->global_stack_depth)
+                *globals = parser->global_stack[--parser->global_stack_depth];
+            break;
+    }
+}
+
+void handle_local_item(parser_state_t *parser, header_t *header, uint32_t data) {
+    /* Usages without a page are only 16 bits, the page is added once we reach the main item */
+    if (header->size != SIZE_32_BIT)
+        data &= 0xFFFF;
+
+    switch (header->tag) {
+        case RI_LOCAL_USAGE:
+            /* Out of a delimited set of alternative usages, we only take the first one */
+            if (parser->delimiter_branch > 1 || parser->usage_count >= MAX_USAGES)
+                break;
+
+            parser->usages[parser->usage_count++] = (usage_range_t){.min = data, .max = data};
+            break;
+
+        case RI_LOCAL_USAGE_MIN:
+            parser->usage_min = data;
+            break;
+
+        case RI_LOCAL_USAGE_MAX:
+            if (parser->delimiter_branch > 1 || parser->usage_count >= MAX_USAGES)
+                break;
+
+            parser->usages[parser->usage_count++] = (usage_range_t){.min = parser->usage_min, .max = data};
+            break;
+
+        case RI_LOCAL_DELIMITER:
+            if (data) {
+                parser->delimiter_depth++;
+                parser->delimiter_branch++;
+            } else if (parser->delimiter_depth) {
+                parser->delimiter_depth--;
+            }
+            break;
+    }
+}
+
+/* Walks the whole report descriptor and builds a layout for every mouse report in it, so
+ * each incoming report can be looked up by its ID and read without any further parsing.
+ * Handles report IDs, usage ranges, extended usages, push/pop and long items. Nothing is
+ * allocated and the parser state is of fixed size. Returns the number of mouse reports found.
  **/
 uint8_t parse_report_descriptor(mouse_t *mouse, uint8_t arr_count, uint8_t const *report, uint16_t desc_len) {
-    usage_map_t usage_map[] = {
-        {.report_usage = HID_USAGE_DESKTOP_MOUSE,
-         .usage_page   = HID_USAGE_PAGE_BUTTON,
-         .usage        = HID_USAGE_DESKTOP_POINTER,
-         .element      = &mouse->buttons},
-
-        {.report_usage = HID_USAGE_DESKTOP_MOUSE,
-         .usage_page   = HID_USAGE_PAGE_DESKTOP,
-         .usage        = HID_USAGE_DESKTOP_X,
-         .element      = &mouse->move_x},
-
-        {.report_usage = HID_USAGE_DESKTOP_MOUSE,
-         .usage_page   = HID_USAGE_PAGE_DESKTOP,
-         .usage        = HID_USAGE_DESKTOP_Y,
-         .element      = &mouse->move_y},
-
-        {.report_usage = HID_USAGE_DESKTOP_MOUSE,
-         .usage_page   = HID_USAGE_PAGE_DESKTOP,
-         .usage        = HID_USAGE_DESKTOP_WHEEL,
-         .element      = &mouse->wheel},
-    };
-
     parser_state_t parser = {0};
-    parser.p_usage        = parser.usages;
-    parser.map            = usage_map;
+    int max_reports       = (arr_count < MAX_REPORTS) ? arr_count : MAX_REPORTS;
+    int remaining         = desc_len;
+
+    /* Start over, in case we've seen this device before */
+    memset(mouse->reports, 0, sizeof(mouse->reports));
+    memset(mouse->report_lookup, 0, sizeof(mouse->report_lookup));
+    mouse->report_count   = 0;
+    mouse->uses_report_id = false;
+
+    while (remaining > 0) {
+        uint8_t prefix = *report++;
+        remaining--;
+
+        /* Long items have their data size in the next byte, skip over them */
+        if (prefix == HID_LONG_ITEM_PREFIX) {
+            if (remaining < 2 || remaining < 2 + report[0])
+                break;
+
+            remaining -= 2 + report[0];
+            report += 2 + report[0];
+            continue;
+        }
+
+        header_t header = *(header_t *)&prefix;
+        int data_length = (header.size == SIZE_32_BIT) ? 4 : header.size;
+
+        /* Truncated descriptor */
+        if (data_length > remaining)
+            break;
 
-    while (desc_len > 0) {
-        header_t header = *(header_t *)report++;
-        uint32_t data   = get_descriptor_value(report, header.size);
+        uint32_t data = get_descriptor_value(report, header.size);
 
         switch (header.type) {
             case RI_TYPE_MAIN:
-                handle_main_item(&parser, &header, ARRAY_SIZE(usage_map));
+                handle_main_item(&parser, &header, data, mouse, max_reports);
                 break;
 
             case RI_TYPE_GLOBAL:
@@ -217,9 +438,104 @@ uint8_t parse_report_descriptor(mouse_t *mouse, uint8_t arr_count, uint8_t const
                 handle_local_item(&parser, &header, data);
                 break;
         }
-        /* Move to the next position and decrement size by header length + data length */
-        report += header.size;
-        desc_len -= header.size + 1;
+        /* Move to the next position and decrement size by data length */
+        report += data_length;
+        remaining -= data_length;
     }
-    return 0;
+
+    /* Offsets and sizes are final now, plan how each field will be extracted */
+    for (int i = 0; i < mouse->report_count; i++) {
+        report_layout_t *layout = &mouse->reports[i];
+
+        compile_report_value(&layout->buttons);
+        compile_report_value(&layout->move_x);
+        compile_report_value(&layout->move_y);
+        compile_report_value(&layout->wheel);
+        compile_report_value(&layout->pan);
+    }
+
+    return mouse->report_count;
+}
+
+/* ==================================================
+ * Parsed descriptor cache
+ * ================================================== */
+
+/* FNV-1a, cheap and good enough to tell descriptors apart */
+uint32_t hash_descriptor(uint8_t const *desc, uint16_t desc_len) {
+    uint32_t hash = 0x811C9DC5;
+
+    for (int i = 0; i < desc_len; i++) {
+        hash ^= desc[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+descriptor_cache_entry_t *
+find_cache_entry(descriptor_cache_t *cache, uint16_t vid, uint16_t pid, uint32_t hash, uint16_t desc_len) {
+    for (int i = 0; i < DESCRIPTOR_CACHE_SIZE; i++) {
+        descriptor_cache_entry_t *entry = &cache->entries[i];
+
+        if (entry->last_used && entry->vid == vid && entry->pid == pid && entry->hash == hash
+            && entry->desc_len == desc_len)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Empty entry if there is one, otherwise the one we haven't used for the longest */
+descriptor_cache_entry_t *get_free_cache_entry(descriptor_cache_t *cache) {
+    descriptor_cache_entry_t *oldest = &cache->entries[0];
+
+    for (int i = 1; i < DESCRIPTOR_CACHE_SIZE; i++)
+        if (cache->entries[i].last_used < oldest->last_used)
+            oldest = &cache->entries[i];
+
+    return oldest;
+}
+
+/* Same as parse_report_descriptor(), but a device we've seen before with the same descriptor gets
+ * its layouts copied from the cache instead. The report ID lookup is rebuilt, it's not worth keeping. */
+uint8_t parse_report_descriptor_cached(descriptor_cache_t *cache,
+                                       mouse_t *mouse,
+                                       uint16_t vid,
+                                       uint16_t pid,
+                                       uint8_t const *desc_report,
+                                       uint16_t desc_len) {
+    uint32_t hash                   = hash_descriptor(desc_report, desc_len);
+    descriptor_cache_entry_t *entry = find_cache_entry(cache, vid, pid, hash, desc_len);
+
+    if (entry) {
+        memcpy(mouse->reports, entry->reports, sizeof(mouse->reports));
+        memset(mouse->report_lookup, 0, sizeof(mouse->report_lookup));
+
+        mouse->report_count   = entry->report_count;
+        mouse->uses_report_id = entry->uses_report_id;
+
+        for (int i = 0; i < mouse->report_count; i++)
+            mouse->report_lookup[mouse->reports[i].report_id] = i + 1;
+
+        entry->last_used = ++cache->use_counter;
+        cache->hits++;
+        return mouse->report_count;
+    }
+
+    parse_report_descriptor(mouse, MAX_REPORTS, desc_report, desc_len);
+    cache->misses++;
+
+    entry = get_free_cache_entry(cache);
+
+    entry->vid            = vid;
+    entry->pid            = pid;
+    entry->hash           = hash;
+    entry->desc_len       = desc_len;
+    entry->last_used      = ++cache->use_counter;
+    entry->report_count   = mouse->report_count;
+    entry->uses_report_id = mouse->uses_report_id;
+    memcpy(entry->reports, mouse->reports, sizeof(entry->reports));
+
+    return mouse->report_count;
 }
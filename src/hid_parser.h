@@ -21,14 +21,22 @@
 
 #include "main.h"
 
-#define MAX_REPORTS 32
+/* Parser limits, everything is statically sized so parsing never allocates */
+#define MAX_REPORTS      8  // Mouse reports (report IDs) we keep a layout for
+#define MAX_REPORT_IDS   16 // Report IDs of any kind we can track offsets for
+#define MAX_USAGES       16 // Usage or Usage Min/Max items preceding a single main item
+#define MAX_GLOBAL_STACK 4  // How deep Push/Pop can nest
+#define MAX_BUTTONS      16
 
-/* Counts how many collection starts and ends we've seen, when they equalize
-   (and not zero), we are at the end of a block */
-typedef struct {
-    uint8_t start;
-    uint8_t end;
-} collection_t;
+/* Long items are never used by any real device, but we must know how to skip them */
+#define HID_LONG_ITEM_PREFIX 0xFE
+
+/* Input/Output/Feature item flags */
+#define HID_MAIN_CONSTANT 0x01
+#define HID_MAIN_VARIABLE 0x02
+
+/* Usages are stored as usage page in the upper 16 bits and usage ID in the lower 16 */
+#define HID_FULL_USAGE(page, usage) (((uint32_t)(page) << 16) | (usage))
 
 /* Header byte is unpacked to size/type/tag using this struct */
 typedef struct TU_ATTR_PACKED {
@@ -37,14 +45,7 @@ typedef struct TU_ATTR_PACKED {
     uint8_t tag : 4;
 } header_t;
 
-/* We store a header block and corresponding data in an array of these
-   to avoid having to use numerous switch-case checks */
-typedef struct {
-    header_t hdr;
-    uint32_t val;
-} globals_t;
-
-// Extended precision mouse movement information
+/* Extended precision mouse movement information */
 typedef struct {
     int32_t move_x;
     int32_t move_y;
@@ -53,46 +54,112 @@ typedef struct {
     uint32_t buttons;
 } mouse_values_t;
 
+/* How get_report_value() pulls a field out of the report, picked once at mount time */
+enum extract_kind_e {
+    EXTRACT_NONE    = 0, // Field not present, always reads as 0
+    EXTRACT_GENERIC = 1, // Arbitrary bit offset/size, walk the bytes
+    EXTRACT_8BIT    = 2, // Byte aligned, 8 bits
+    EXTRACT_16BIT   = 3, // Byte aligned, 16 bits little endian
+};
+
 /* Describes where can we find a value in a HID report */
 typedef struct {
     uint16_t offset; // In bits
     uint8_t size;    // In bits
     int32_t min;
     int32_t max;
+
+    /* Extraction plan, filled in by compile_report_value() */
+    uint8_t kind;        // One of extract_kind_e
+    uint8_t byte_offset; // offset / 8
+    uint8_t shift;       // offset % 8
 } report_val_t;
 
-/* Defines information about HID report format for the mouse. */
+/* Where each value we care about sits within one particular mouse report */
 typedef struct {
     report_val_t buttons;
     report_val_t move_x;
     report_val_t move_y;
     report_val_t wheel;
+    report_val_t pan;
 
     uint8_t report_id;
-    uint8_t protocol;
+    uint8_t length; // Bytes needed to read all of the above, not counting the report ID
+} report_layout_t;
 
+/* Defines information about HID report format for the mouse. */
+typedef struct {
+    report_layout_t reports[MAX_REPORTS];
+    uint8_t report_count;
+
+    /* Report ID -> index into reports + 1, or 0 if that ID is not a mouse report */
+    uint8_t report_lookup[256];
+
+    uint8_t protocol;
     bool uses_report_id;
 } mouse_t;
 
-/* For each element type we're interested in there is an entry
-in an array of these, defining its usage and in case matched, where to
-store the data. */
+/* Parsed descriptors of recently seen devices, so a reconnect doesn't have to parse again */
+#define DESCRIPTOR_CACHE_SIZE 4
+
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t hash;      // Of the whole report descriptor, devices can change it with firmware updates
+    uint16_t desc_len;
+    uint32_t last_used; // For picking the least recently used entry to replace, 0 if entry is empty
+
+    report_layout_t reports[MAX_REPORTS];
+    uint8_t report_count;
+    bool uses_report_id;
+} descriptor_cache_entry_t;
+
+typedef struct {
+    descriptor_cache_entry_t entries[DESCRIPTOR_CACHE_SIZE];
+    uint32_t use_counter;
+    uint32_t hits;
+    uint32_t misses;
+} descriptor_cache_t;
+
+/* Global items we need to keep track of, these persist across main items and can be pushed/popped */
 typedef struct {
-    uint8_t report_usage;
-    uint8_t usage_page;
-    uint8_t usage;
-    report_val_t *element;
-} usage_map_t;
+    uint16_t usage_page;
+    uint8_t report_id;
+    uint16_t report_size;
+    uint16_t report_count;
+    int32_t logical_min;
+    uint32_t logical_max;     // As given, its sign depends on logical_min, see store_field()
+    uint8_t logical_max_size; // Size of the item it came in, for to_signed()
+} hid_globals_t;
+
+/* A single Usage is stored as a range of one */
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+} usage_range_t;
 
+/* Input reports with different IDs are laid out independently, each has its own running offset */
 typedef struct {
+    uint8_t report_id;
+    uint16_t offset_in_bits;
+} report_offset_t;
+
+typedef struct {
+    hid_globals_t globals;
+    hid_globals_t global_stack[MAX_GLOBAL_STACK];
+    uint8_t global_stack_depth;
+
+    /* Local items, cleared after every main item */
+    usage_range_t usages[MAX_USAGES];
     uint8_t usage_count;
-    uint8_t global_usage;
-    uint32_t offset_in_bits;
-    uint8_t usages[64];
-    uint8_t *p_usage;
+    uint32_t usage_min;
+    uint8_t delimiter_depth;
+    uint8_t delimiter_branch;
 
-    collection_t collection;
-    usage_map_t *map;
+    /* Usage of the top-level (application) collection we're in */
+    uint32_t application_usage;
+    uint8_t collection_depth;
 
-    globals_t globals[16]; /* as tag is 4 bits, there can be 16 different tags in global header type */
-} parser_state_t;
\ No newline at end of file
+    report_offset_t offsets[MAX_REPORT_IDS];
+    uint8_t offset_count;
+} parser_state_t;
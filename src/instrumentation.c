@@ -0,0 +1,261 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "main.h"
+
+#ifdef INSTRUMENTATION
+
+/**================================================== *
+ * ===============  Instrumentation  ================ *
+ * ================================================== *
+ *
+ * Timing histograms are filled in by the scheduler (per task and per loop pass), the
+ * UART receive path (backlog) and the link probe (round trips to the other boards).
+ * There's no console to print them to, so on request core0 turns them into text and
+ * core1 types it out on the keyboard, like a very fast user.
+ */
+
+/* Bucket n counts values in [2^(n-1), 2^n), bucket 0 is for zeros */
+void histogram_add(histogram_t *histogram, uint32_t value) {
+    int bucket = value ? 32 - __builtin_clz(value) : 0;
+
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+
+    histogram->bucket[bucket]++;
+}
+
+/* Formatted append that never goes past the end, returns the new length */
+int append_text(char *buffer, int size, int length, const char *format, ...) {
+    va_list args;
+
+    if (length >= size - 1)
+        return length;
+
+    va_start(args, format);
+    int written = vsnprintf(&buffer[length], size - length, format, args);
+    va_end(args);
+
+    if (written < 0)
+        return length;
+
+    return (length + written < size - 1) ? length + written : size - 1;
+}
+
+/* Only the buckets that have anything in them, as "lower bound:count" */
+int append_histogram(char *buffer, int size, int length, histogram_t *histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (!histogram->bucket[i])
+            continue;
+
+        unsigned long lower_bound = i ? 1UL << (i - 1) : 0;
+        length = append_text(buffer, size, length, " %lu:%lu", lower_bound, (unsigned long)histogram->bucket[i]);
+    }
+
+    return append_text(buffer, size, length, "\n");
+}
+
+int format_stats(char *buffer, int size, device_t *state) {
+    int length = 0;
+
+    length = append_text(buffer, size, length, "\nboard %c, times in us, histograms are start:count\n",
+                         'a' + BOARD_ROLE);
+
+    for (int core = 0; core < NUM_CORES; core++) {
+        scheduler_t *scheduler = schedulers[core];
+
+        if (!scheduler)
+            continue;
+
+        length = append_text(buffer, size, length, "core%d loop, passes %lu max %lu:", core,
+                             (unsigned long)scheduler->loop_count, (unsigned long)scheduler->max_loop_us);
+        length = append_histogram(buffer, size, length, &scheduler->loop_time);
+
+        for (int i = 0; i < scheduler->count; i++) {
+            task_t *task        = &scheduler->tasks[i];
+            task_stats_t *stats = &task->stats;
+
+            length = append_text(buffer, size, length, "- %s, runs %lu total %lu max %lu late %lu missed %lu:",
+                                 task->name, (unsigned long)stats->run_count, (unsigned long)stats->total_us,
+                                 (unsigned long)stats->max_us, (unsigned long)stats->max_lateness_us,
+                                 (unsigned long)stats->missed_deadlines);
+            length = append_histogram(buffer, size, length, &stats->run_time);
+        }
+    }
+
+    config_store_t *store = &state->config_store;
+    length = append_text(buffer, size, length, "config writes %lu, blackout last %lu max %lu\n",
+                         (unsigned long)store->write_count, (unsigned long)store->last_blackout_us,
+                         (unsigned long)store->max_blackout_us);
+
+#ifndef PROTOCOL_V1
+    length = append_text(buffer, size, length, "config sync blocks sent %lu, received %lu\n",
+                         (unsigned long)state->config_sync.blocks_sent,
+                         (unsigned long)state->config_sync.blocks_received);
+#endif
+
+    link_probe_t *probe = &state->link_probe;
+    length = append_text(buffer, size, length, "link pings %lu, pongs %lu\n", (unsigned long)probe->ping_count,
+                         (unsigned long)probe->pong_count);
+
+    for (int board = 0; board < NUM_SCREENS; board++) {
+        if (board == BOARD_ROLE)
+            continue;
+
+        length = append_text(buffer, size, length, "- round trip to %c:", 'a' + board);
+        length = append_histogram(buffer, size, length, &probe->rtt[board]);
+    }
+
+    length = append_text(buffer, size, length, "- one way per link:");
+    length = append_histogram(buffer, size, length, &probe->hop_latency);
+
+    length = append_text(buffer, size, length, "uart rx backlog in bytes:");
+    return append_histogram(buffer, size, length, &state->uart_rx.backlog);
+}
+
+/* Can be called from either core, core0 picks it up */
+void request_stats_dump(device_t *state) {
+    state->stats_dump_requested = true;
+    __sev();
+}
+
+/* Wait until the previous dump is typed out before starting another one */
+bool stats_dump_ready(device_t *state) {
+    return state->stats_dump_requested && state->typewriter.length == 0;
+}
+
+void stats_dump_task(device_t *state) {
+    typewriter_t *typewriter = &state->typewriter;
+
+    state->stats_dump_requested = false;
+    typewriter->position        = 0;
+    int length                  = format_stats(typewriter->text, STATS_TEXT_LENGTH, state);
+
+    /* Text must be in place before core1 sees there is something to type */
+    __dmb();
+    typewriter->length = length;
+}
+
+/**================================================== *
+ * =================  Link Probe  =================== *
+ * ================================================== */
+
+/* Runs on core0 every LINK_PROBE_PERIOD_US, pings the next board in turn */
+void link_probe_task(device_t *state) {
+    link_probe_t *probe = &state->link_probe;
+    uint32_t now        = time_us_32();
+
+    probe->next_target = (probe->next_target + 1) % NUM_SCREENS;
+
+    if (probe->next_target == BOARD_ROLE)
+        probe->next_target = (probe->next_target + 1) % NUM_SCREENS;
+
+    send_packet_to(probe->next_target, (uint8_t *)&now, PING_MSG, sizeof(uint32_t));
+    probe->ping_count++;
+}
+
+/* Answered right away on core1, our timestamp goes straight back to the sender */
+void handle_ping_msg(uart_packet_t *packet, device_t *state) {
+    send_packet_to(ADDRESS_SRC(packet->address), packet->data, PONG_MSG, sizeof(uint32_t));
+}
+
+void handle_pong_msg(uart_packet_t *packet, device_t *state) {
+    link_probe_t *probe = &state->link_probe;
+    uint8_t source      = ADDRESS_SRC(packet->address);
+    uint32_t sent_at;
+
+    if (source >= NUM_SCREENS)
+        return;
+
+    memcpy(&sent_at, packet->data, sizeof(uint32_t));
+    uint32_t rtt = time_us_32() - sent_at;
+
+    probe->pong_count++;
+    histogram_add(&probe->rtt[source], rtt);
+    histogram_add(&probe->hop_latency, rtt / NUM_SCREENS);
+}
+
+/**================================================== *
+ * =================  Typewriter  =================== *
+ * ================================================== */
+
+/* Keys for the few characters the stats use, assuming US layout. 0 if we can't type it. */
+uint8_t char_to_key(char c, uint8_t *modifier) {
+    *modifier = 0;
+
+    if (c >= 'a' && c <= 'z')
+        return HID_KEY_A + (c - 'a');
+
+    if (c >= '1' && c <= '9')
+        return HID_KEY_1 + (c - '1');
+
+    switch (c) {
+        case '0':
+            return HID_KEY_0;
+        case ' ':
+            return HID_KEY_SPACE;
+        case '\n':
+            return HID_KEY_ENTER;
+        case ',':
+            return HID_KEY_COMMA;
+        case '.':
+            return HID_KEY_PERIOD;
+        case '-':
+            return HID_KEY_MINUS;
+        case ':':
+            *modifier = KEYBOARD_MODIFIER_LEFTSHIFT;
+            return HID_KEY_SEMICOLON;
+    }
+
+    return 0;
+}
+
+/* There's text and room in the keyboard queue for at least one key press and release */
+bool typewriter_ready(device_t *state) {
+    return state->typewriter.length != 0 && ring_free_space(&state->kbd_queue) >= 2;
+}
+
+/* Runs on core1, it's the producer side of the keyboard queue */
+void typewriter_task(device_t *state) {
+    typewriter_t *typewriter = &state->typewriter;
+
+    /* Switched away, this computer isn't getting our keys anymore */
+    if (!CURRENT_BOARD_IS_ACTIVE_OUTPUT)
+        typewriter->position = typewriter->length;
+
+    while (typewriter->position < typewriter->length && ring_free_space(&state->kbd_queue) >= 2) {
+        hid_keyboard_report_t press = {0}, release = {0};
+        press.keycode[0] = char_to_key(typewriter->text[typewriter->position++], &press.modifier);
+
+        if (!press.keycode[0])
+            continue;
+
+        /* Release after every key, or double letters would come out as one */
+        queue_kbd_report(&press, state);
+        queue_kbd_report(&release, state);
+    }
+
+    if (typewriter->position < typewriter->length)
+        return;
+
+    /* All done, core0 can use the buffer again */
+    __dmb();
+    typewriter->length = 0;
+}
+
+#endif
@@ -77,7 +77,17 @@ hotkey_combo_t hotkeys[] = {
      .keys           = {HID_KEY_F12, HID_KEY_B},
      .key_count      = 2,
      .acknowledge    = true,
-     .action_handler = &fw_upgrade_hotkey_handler_B}};
+     .action_handler = &fw_upgrade_hotkey_handler_B},
+
+#ifdef INSTRUMENTATION
+    /* Type out the loop and task timing stats of the active output's board */
+    {.modifier       = KEYBOARD_MODIFIER_RIGHTSHIFT,
+     .keys           = {HID_KEY_F12, HID_KEY_I},
+     .key_count      = 2,
+     .acknowledge    = true,
+     .action_handler = &stats_dump_hotkey_handler},
+#endif
+};
 
 /* ============================================================ *
  * Detect if any hotkeys were pressed
@@ -126,22 +136,32 @@ hotkey_combo_t *check_all_hotkeys(hid_keyboard_report_t *report, device_t *state
  * ==================================================== */
 
 void process_kbd_queue_task(device_t *state) {
-    hid_keyboard_report_t report;
+    hid_keyboard_report_t *report;
 
     /* If we're not connected, we have nowhere to send reports to. */
     if (!state->tud_connected)
         return;
 
+    /* Previous report is still on its way, we'll be called again when it's done */
+    if (!tud_hid_n_ready(ITF_NUM_KEYBOARD))
+        return;
+
     /* Peek first, if there is anything there... */
-    if (!queue_try_peek(&state->kbd_queue, &report))
+    if ((report = ring_peek(&state->kbd_queue)) == NULL)
         return;
 
     /* ... try sending it to the host, if it's successful */
-    bool succeeded = tud_hid_keyboard_report(REPORT_ID_KEYBOARD, report.modifier, report.keycode);
+    bool succeeded
+        = tud_hid_n_keyboard_report(ITF_NUM_KEYBOARD, REPORT_ID_KEYBOARD, report->modifier, report->keycode);
 
-    /* ... then we can remove it from the queue. Race conditions shouldn't happen [tm] */
+    /* ... then we can remove it from the queue. Only core0 consumes, so nobody else could have. */
     if (succeeded)
-        queue_try_remove(&state->kbd_queue, &report);
+        ring_commit(&state->kbd_queue);
+}
+
+/* True if there is a report waiting and the endpoint is free to take it */
+bool kbd_report_pending(device_t *state) {
+    return tud_hid_n_ready(ITF_NUM_KEYBOARD) && ring_peek(&state->kbd_queue) != NULL;
 }
 
 void queue_kbd_report(hid_keyboard_report_t *report, device_t *state) {
@@ -149,12 +169,12 @@ void queue_kbd_report(hid_keyboard_report_t *report, device_t *state) {
     if (!state->tud_connected)
         return;
 
-    queue_try_add(&state->kbd_queue, report);
+    ring_try_add(&state->kbd_queue, report);
 }
 
 void release_all_keys(device_t *state) {
     static hid_keyboard_report_t no_keys_pressed_report = {0, 0, {0}};
-    queue_try_add(&state->kbd_queue, &no_keys_pressed_report);
+    ring_try_add(&state->kbd_queue, &no_keys_pressed_report);
 }
 
 /* If keys need to go locally, queue packet to kbd queue, else send them through UART */
@@ -163,7 +183,7 @@ void send_key(hid_keyboard_report_t *report, device_t *state) {
         queue_kbd_report(report, state);
         state->last_activity[BOARD_ROLE] = time_us_64();
     } else {
-        send_packet((uint8_t *)report, KEYBOARD_REPORT_MSG, KBD_REPORT_LENGTH);
+        send_packet_to(state->active_output, (uint8_t *)report, KEYBOARD_REPORT_MSG, KBD_REPORT_LENGTH);
     }
 }
 
@@ -171,15 +191,50 @@ void send_key(hid_keyboard_report_t *report, device_t *state) {
  * Parse and interpret the keys pressed on the keyboard
  * ==================================================== */
 
-void process_keyboard_report(uint8_t *raw_report, int length, device_t *state) {
-    hid_keyboard_report_t *keyboard_report = (hid_keyboard_report_t *)raw_report;
-    hotkey_combo_t *hotkey                 = NULL;
+/* Add a key to the report, unless it's already there or there's no more room */
+void add_key_to_report(uint8_t key, hid_keyboard_report_t *report) {
+    for (int n = 0; n < KEYS_IN_USB_REPORT; n++) {
+        if (report->keycode[n] == key)
+            return;
+
+        if (report->keycode[n] == 0) {
+            report->keycode[n] = key;
+            return;
+        }
+    }
+}
+
+/* With several keyboards attached, what the computer sees is all of them pressed together */
+void combine_keyboard_reports(device_t *state, hid_keyboard_report_t *combined) {
+    memset(combined, 0, sizeof(hid_keyboard_report_t));
+
+    for (int i = 0; i < MAX_HID_DEVICES; i++) {
+        hid_device_t *device = &state->hid_devices[i];
+
+        if (device->itf_protocol != HID_ITF_PROTOCOL_KEYBOARD)
+            continue;
+
+        combined->modifier |= device->kbd_report.modifier;
+
+        for (int n = 0; n < KEYS_IN_USB_REPORT; n++)
+            if (device->kbd_report.keycode[n])
+                add_key_to_report(device->kbd_report.keycode[n], combined);
+    }
+}
+
+void process_keyboard_report(uint8_t *raw_report, int length, hid_device_t *device, device_t *state) {
+    hid_keyboard_report_t keyboard_report;
+    hotkey_combo_t *hotkey = NULL;
 
     if (length < KBD_REPORT_LENGTH)
         return;
 
+    /* Remember what this keyboard has pressed, and merge it with the others */
+    memcpy(&device->kbd_report, raw_report, sizeof(hid_keyboard_report_t));
+    combine_keyboard_reports(state, &keyboard_report);
+
     /* Check if any hotkey was pressed */
-    hotkey = check_all_hotkeys(keyboard_report, state);
+    hotkey = check_all_hotkeys(&keyboard_report, state);
 
     /* ... and take appropriate action */
     if (hotkey != NULL) {
@@ -196,5 +251,5 @@ void process_keyboard_report(uint8_t *raw_report, int length, device_t *state) {
     }
 
     /* This method will decide if the key gets queued locally or sent through UART */
-    send_key(keyboard_report, state);
+    send_key(&keyboard_report, state);
 }
@@ -0,0 +1,121 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "main.h"
+
+/**================================================== *
+ * ===============  Monitor Layout  ================= *
+ * ================================================== *
+ *
+ * Every output has one or more monitors, each covering a rectangle of that output's
+ * 0..MAX_SCREEN_COORD coordinate space. Outer left and right edges of the monitors are
+ * linked to monitors on other outputs.
+ *
+ * All the work happens when the config is loaded: each link is turned into an edge_map_t
+ * and the height range of its monitor is marked in a per-side bucket table. When the
+ * pointer hits an edge, it takes a single table lookup to know where it goes.
+ */
+
+/* Make sure nothing in the config can send us out of bounds */
+bool link_is_valid(output_t *output, edge_link_t *link, config_t *config) {
+    if (link->side > EDGE_RIGHT || link->monitor >= output->screen_count || link->target_output >= NUM_SCREENS)
+        return false;
+
+    output_t *target = &config->output[link->target_output];
+    return link->target_monitor < target->screen_count;
+}
+
+void build_edge_map(edge_map_t *map, edge_link_t *link, monitor_t *from, monitor_t *to) {
+    int from_height = from->bottom - from->top;
+    int to_height   = to->bottom - to->top;
+
+    map->target_output  = link->target_output;
+    map->target_monitor = link->target_monitor;
+    map->top            = from->top;
+    map->bottom         = from->bottom;
+    map->target_top     = to->top;
+
+    /* Leaving through the left means entering the target from its right side, and vice versa */
+    map->target_x = (link->side == EDGE_LEFT) ? to->right : to->left;
+    map->y_scale  = from_height > 0 ? ((int64_t)to_height << 16) / from_height : 0;
+}
+
+void build_edge_tables(device_t *state) {
+    edge_tables_t *edges = &state->edges;
+    memset(edges, 0, sizeof(edge_tables_t));
+
+    for (int out = 0; out < NUM_SCREENS; out++) {
+        output_t *output = &state->config.output[out];
+
+        if (output->screen_count > MAX_MONITORS)
+            output->screen_count = MAX_MONITORS;
+
+        for (int i = 0; i < output->link_count && i < MAX_EDGE_LINKS; i++) {
+            edge_link_t *link = &output->links[i];
+
+            if (!link_is_valid(output, link, &state->config))
+                continue;
+
+            monitor_t *from = &output->monitors[link->monitor];
+            monitor_t *to   = &state->config.output[link->target_output].monitors[link->target_monitor];
+
+            build_edge_map(&edges->maps[out][i], link, from, to);
+
+            /* Mark every bucket this monitor's edge touches, first link wins where they overlap */
+            for (int bucket = from->top >> EDGE_BUCKET_BITS; bucket <= from->bottom >> EDGE_BUCKET_BITS; bucket++)
+                if (bucket >= 0 && bucket < EDGE_TABLE_SIZE && !edges->table[out][link->side][bucket])
+                    edges->table[out][link->side][bucket] = i + 1;
+        }
+    }
+}
+
+/* Core1 reads the tables without any locking, so core0 can't rebuild them in place. It asks
+   core1 to do it instead, next time it's about to use them. */
+void request_edge_tables_rebuild(device_t *state) {
+    /* Config changes must be in place before core1 sees the flag */
+    __dmb();
+    state->edges_stale = true;
+}
+
+/* Where does leaving the active output through this side, at this height, take us? NULL if nowhere. */
+edge_map_t *find_edge(device_t *state, int side, int y) {
+    int out             = state->active_output;
+    edge_tables_t *edge = &state->edges;
+    uint8_t index       = edge->table[out][side][(y >> EDGE_BUCKET_BITS) & (EDGE_TABLE_SIZE - 1)];
+
+    if (!index)
+        return NULL;
+
+    edge_map_t *map = &edge->maps[out][index - 1];
+
+    /* Bucket is shared by two monitors, so take a closer look (rare, only near their boundary) */
+    if (y < map->top || y > map->bottom) {
+        map = NULL;
+
+        for (int i = 0; i < MAX_EDGE_LINKS; i++) {
+            edge_map_t *candidate = &edge->maps[out][i];
+            edge_link_t *link     = &state->config.output[out].links[i];
+
+            if (i < state->config.output[out].link_count && link->side == side && candidate->bottom > candidate->top
+                && y >= candidate->top && y <= candidate->bottom)
+                return candidate;
+        }
+    }
+
+    return map;
+}
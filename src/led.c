@@ -25,13 +25,16 @@ void set_keyboard_leds(uint8_t requested_led_state, device_t *state) {
     static uint8_t new_led_value;
 
     new_led_value = requested_led_state;
-    if (state->keyboard_connected) {
-        tuh_hid_set_report(state->kbd_dev_addr,
-                           state->kbd_instance,
-                           0,
-                           HID_REPORT_TYPE_OUTPUT,
-                           &new_led_value,
-                           sizeof(uint8_t));
+
+    /* Every keyboard gets the same LEDs */
+    for (int i = 0; i < MAX_HID_DEVICES; i++) {
+        hid_device_t *device = &state->hid_devices[i];
+
+        if (device->itf_protocol != HID_ITF_PROTOCOL_KEYBOARD)
+            continue;
+
+        tuh_hid_set_report(
+            device->dev_addr, device->instance, 0, HID_REPORT_TYPE_OUTPUT, &new_led_value, sizeof(uint8_t));
     }
 }
 
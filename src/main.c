@@ -21,6 +21,68 @@
 device_t global_state = {0};
 device_t *device      = &global_state;
 
+/**================================================== *
+ * ===============  Task Tables  ==================== *
+ * ================================================== *
+ *
+ * Order matters, on every pass tasks get their turn from the top down.
+ */
+
+task_t core0_tasks[] = {
+    /* USB device stack, runs whenever its interrupt queued an event */
+    {.name = "usb device", .exec = usb_device_task, .ready = usb_device_event_ready},
+
+    /* Verify core1 is still running and if so, reset watchdog timer */
+    {.name = "watchdog", .exec = kick_watchdog, .period_us = WATCHDOG_KICK_PERIOD_US, .deadline_us = 50000},
+
+    /* Keypresses or mouse movements waiting to be sent */
+    {.name = "reports", .exec = send_pending_reports, .ready = reports_pending},
+
+    /* Packets core1 received, but left for us to do */
+    {.name = "deferred", .exec = process_deferred_packets_task, .ready = deferred_packets_pending},
+
+    /* Config changed a while ago and things are quiet, write it to flash */
+    {.name = "config store", .exec = config_store_task, .ready = config_store_ready},
+
+#ifndef PROTOCOL_V1
+    /* Config changed here or we just started, let the other boards know */
+    {.name = "config sync", .exec = config_sync_task, .ready = config_sync_ready},
+#endif
+
+#ifdef INSTRUMENTATION
+    /* Someone asked for the stats, turn them into text */
+    {.name = "stats dump", .exec = stats_dump_task, .ready = stats_dump_ready},
+
+    /* Measure how long it takes to get to the other boards and back */
+    {.name = "link probe", .exec = link_probe_task, .period_us = LINK_PROBE_PERIOD_US},
+#endif
+};
+
+task_t core1_tasks[] = {
+    /* USB host task, needs to run as often as possible */
+    {.name = "usb host", .exec = usb_host_task},
+
+    /* Processes all data received over serial from the other board */
+    {.name = "uart rx", .exec = receive_packets_task},
+
+    /* Let core0 know we're alive */
+    {.name = "heartbeat", .exec = core1_heartbeat_task, .period_us = CORE1_HEARTBEAT_PERIOD_US, .deadline_us = 10000},
+
+    /* Check if LED needs blinking */
+    {.name = "led", .exec = led_blinking_task, .period_us = LED_TASK_PERIOD_US, .deadline_us = 20000},
+
+    /* Mouse screensaver task */
+    {.name = "screensaver", .exec = screensaver_task, .period_us = SCREENSAVER_TASK_PERIOD_US, .deadline_us = 5000},
+
+#ifdef INSTRUMENTATION
+    /* Type out the stats core0 prepared */
+    {.name = "typewriter", .exec = typewriter_task, .ready = typewriter_ready},
+#endif
+};
+
+scheduler_t core0_scheduler = {.core = 0, .tasks = core0_tasks, .count = ARRAY_SIZE(core0_tasks)};
+scheduler_t core1_scheduler = {.core = 1, .tasks = core1_tasks, .count = ARRAY_SIZE(core1_tasks)};
+
 /**================================================== *
  * ==============  Main Program Loops  ============== *
  * ================================================== */
@@ -31,45 +93,25 @@ int main(void) {
 
     // Initial board setup
     initial_setup(device);
-
-    // Initial state, A is the default output
-    switch_output(device, OUTPUT_A);
+    start_tasks(&core0_scheduler);
 
     while (true) {
-        // USB device task, needs to run as often as possible
-        tud_task();
-
-        // Verify core1 is still running and if so, reset watchdog timer
-        kick_watchdog(device);
-
-        // Check if there were any keypresses and send them
-        process_kbd_queue_task(device);
-
-        // Check if there were any mouse movements and send them
-        process_mouse_queue_task(device);
+        // Run whatever is due, then sleep until an interrupt, core1 or a timer gives us something to do
+        run_tasks(&core0_scheduler, device);
+        idle_until_next_task(&core0_scheduler, device);
     }
 }
 
 void core1_main() {
-    uart_packet_t in_packet = {0};
-
-    while (true) {
-        // Update the timestamp, so core0 can figure out if we're dead
-        device->core1_last_loop_pass = time_us_64();
+    // Core0 parks us while it writes to flash
+    multicore_lockout_victim_init();
 
-        // USB host task, needs to run as often as possible
-        if (tuh_inited())
-            tuh_task();
+    // USB host and UART have to be polled, so core1 never sleeps
+    core1_heartbeat_task(device);
+    start_tasks(&core1_scheduler);
 
-        // Receives data over serial from the other board
-        receive_char(&in_packet, device);
-
-        // Check if LED needs blinking
-        led_blinking_task(device);
-
-        // Mouse screensaver task
-        screensaver_task(device);
-    }
+    while (true)
+        run_tasks(&core1_scheduler, device);
 }
 
 /* =======  End of Main Program Loops  ======= */
@@ -19,6 +19,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,13 +30,16 @@
 #include "tusb.h"
 #include "usb_descriptors.h"
 #include "user_config.h"
+#include <hardware/dma.h>
 #include <hardware/flash.h>
+#include <hardware/irq.h>
+#include <hardware/structs/scb.h>
 #include <hardware/sync.h>
 #include <hardware/watchdog.h>
 #include <pico/bootrom.h>
+#include <pico/critical_section.h>
 #include <pico/multicore.h>
 #include <pico/stdlib.h>
-#include <pico/util/queue.h>
 
 /*********  Misc definitions for better readability **********/
 #define PICO_A 0
@@ -43,6 +47,8 @@
 
 #define OUTPUT_A 0
 #define OUTPUT_B 1
+#define OUTPUT_C 2
+#define OUTPUT_D 3
 
 #define ENABLE  1
 #define DISABLE 0
@@ -50,9 +56,36 @@
 #define MAX_REPORT_ITEMS      16
 #define MOUSE_BOOT_REPORT_LEN 4
 
-#define NUM_SCREENS               2 // Will be more in the future
+/* Every output has its own board, connected in a ring over UART (see Protocol definitions).
+   Set at build time with -DDESKHOP_NUM_OUTPUTS=N */
+#ifndef NUM_SCREENS
+#define NUM_SCREENS 2
+#endif
+
+#define MAX_OUTPUTS 4
+
+#if NUM_SCREENS < 2 || NUM_SCREENS > MAX_OUTPUTS
+#error "NUM_SCREENS must be between 2 and MAX_OUTPUTS"
+#endif
+
 #define MOUSE_ZOOM_SCALING_FACTOR 2
 
+/* Mouse motion is accumulated in fixed point with this many fractional bits, so slow movement
+   (or zoom mode) moves the pointer by fractions of a pixel instead of not at all */
+#define MOUSE_FRACTION_BITS 8
+#define MOUSE_FRACTION_MASK ((1 << MOUSE_FRACTION_BITS) - 1)
+#define MAX_MOUSE_DELTA     8191 // Larger deltas per report are clamped, keeps the math in 32 bits
+
+/* Acceleration curves, see accel_curves[] in mouse.c */
+enum accel_curve_e {
+    ACCEL_CURVE_NONE   = 0,
+    ACCEL_CURVE_MILD   = 1,
+    ACCEL_CURVE_STRONG = 2,
+    ACCEL_CURVE_COUNT,
+};
+
+#define ACCEL_LUT_SIZE 32
+
 #define ARRAY_SIZE(arr)                (sizeof(arr) / sizeof((arr)[0]))
 #define CURRENT_BOARD_IS_ACTIVE_OUTPUT (global_state.active_output == BOARD_ROLE)
 
@@ -60,12 +93,12 @@
 #define PIO_USB_DP_PIN 14 // D+ is pin 14, D- is pin 15
 #define GPIO_LED_PIN   25 // LED is connected to pin 25 on a PICO
 
-#if BOARD_ROLE == PICO_B
-#define SERIAL_TX_PIN 16
-#define SERIAL_RX_PIN 17
-#elif BOARD_ROLE == PICO_A
+#if BOARD_ROLE == PICO_A
 #define SERIAL_TX_PIN 12
 #define SERIAL_RX_PIN 13
+#else
+#define SERIAL_TX_PIN 16 // Board B, and any boards after it
+#define SERIAL_RX_PIN 17
 #endif
 
 /*********  Serial port definitions  **********/
@@ -76,6 +109,47 @@
 #define SERIAL_STOP_BITS 1
 #define SERIAL_PARITY    UART_PARITY_NONE
 
+/* DMA channel 0 is claimed by PIO USB, so we use fixed channels above it */
+#define SERIAL_TX_DMA_CHANNEL      1
+#define SERIAL_RX_DMA_CHANNEL      2
+#define SERIAL_RX_DMA_CTRL_CHANNEL 3 // Re-arms the RX channel when its transfer count runs out
+
+/* Outgoing packets are queued in a ring buffer that the DMA drains into the UART.
+   Must be a power of 2, the buffer is aligned to its size so the DMA can wrap around it. */
+#define UART_TX_RING_BITS 10
+#define UART_TX_RING_SIZE (1 << UART_TX_RING_BITS)
+#define UART_TX_RING_MASK (UART_TX_RING_SIZE - 1)
+
+/* Incoming bytes are written by DMA into this ring, same alignment rules apply. 2 KB buys us
+   ~5 ms at full line rate before core1 needs to catch up, the hardware FIFO has just 32 bytes. */
+#define UART_RX_RING_BITS 11
+#define UART_RX_RING_SIZE (1 << UART_RX_RING_BITS)
+#define UART_RX_RING_MASK (UART_RX_RING_SIZE - 1)
+#define UART_RX_DMA_COUNT 0x10000000 // Arbitrary large count, control channel restarts it when it's done
+
+/*********  Scheduler definitions  **********/
+#define WATCHDOG_KICK_PERIOD_US    100000 // Also the longest core0 ever sleeps
+#define CORE1_HEARTBEAT_PERIOD_US  10000  // Core1 tells core0 it's alive this often
+#define LED_TASK_PERIOD_US         10000  // Blinks are 80 ms, this is plenty
+#define SCREENSAVER_TASK_PERIOD_US 5000   // How often the screensaver moves the pointer
+
+/*********  Instrumentation definitions  **********
+ *
+ * Build with -DDESKHOP_INSTRUMENTATION=ON to keep log2 histograms of how long every task
+ * and every pass of the main loops take. Dump them with the hotkey, the board that is the
+ * active output types them out as text (US layout, open an editor first). Without the
+ * option none of this is compiled in.
+ */
+#define HISTOGRAM_BUCKETS    16      // Bucket n counts values in [2^(n-1), 2^n), the last one everything above
+#define STATS_TEXT_LENGTH    4096    // Room for the typed out stats of one board
+#define LINK_PROBE_PERIOD_US 1000000 // How often we ping one of the other boards
+
+#ifdef INSTRUMENTATION
+#define STATS_RECORD(histogram, value) histogram_add(histogram, value)
+#else
+#define STATS_RECORD(histogram, value)
+#endif
+
 /*********  Watchdog definitions  **********/
 #define WATCHDOG_TIMEOUT        1000                    // In milliseconds => needs to be reset every second
 #define WATCHDOG_PAUSE_ON_DEBUG 1                       // When using a debugger, disable watchdog
@@ -83,6 +157,21 @@
 
 /*********  Protocol definitions  *********
  *
+ * v2 (default):
+ * - a packet is a 1 byte type, 1 byte address, payload and 1 checksum byte
+ * - address has the source board in the upper and destination board in the lower nibble,
+ *   destination ADDR_BROADCAST means everyone
+ * - checksum is a CRC-8 (polynomial 0x07) over type, address and payload
+ * - payload length depends on the packet type, see packet_payload_length[]
+ * - the packet is COBS encoded, so it contains no zero bytes at all
+ * - a single 0x00 byte ends the frame, so re-syncing is just waiting for the next zero
+ *
+ * Boards are wired in a ring, each one's TX goes to the next one's RX (with two boards,
+ * that's simply A <-> B). A frame that isn't for us is passed on to the next board
+ * as-is, straight from the receive path, unless that would take it back to its source.
+ * Every hop costs one frame time on the wire plus one core1 loop pass.
+ *
+ * v1 (build with -DPROTOCOL_V1=ON, to talk to a board running older firmware, two boards only):
  * - every packet starts with 0xAA 0x55 for easy re-sync
  * - then a 1 byte packet type is transmitted
  * - 8 bytes of packet data follows, fixed length for simplicity
@@ -103,9 +192,23 @@ enum packet_type_e {
     FLASH_LED_MSG        = 9,
     SCREENSAVER_MSG      = 10,
     WIPE_CONFIG_MSG      = 11,
+    DUMP_STATS_MSG       = 12,
+    CONFIG_HASH_MSG      = 13,
+    CONFIG_BLOCK_MSG     = 14,
+    PING_MSG             = 15,
+    PONG_MSG             = 16,
+    PACKET_TYPE_COUNT, // Keep last, sizes the handler table
 };
 
 /*
+v2 frame, before COBS encoding:
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+| Type | Src/Dst |        Packet data        | Checksum | (0x00) |
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+|  1   |    1    |   0 - PACKET_DATA_LENGTH  |     1    |    1   |
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+v1 frame:
 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 | Start1 | Start2 | Type |             Packet data           | Checksum |
 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
@@ -113,28 +216,51 @@ enum packet_type_e {
 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 */
 
-/* Data structure defining packets of information transferred */
-typedef struct {
-    uint8_t type;     // Enum field describing the type of packet
-    uint8_t data[8];  // Data goes here (type + payload + checksum)
-    uint8_t checksum; // Checksum, a simple XOR-based one
-} uart_packet_t;
-
 /*********  Packet parameters  **********/
 
+#define TYPE_LENGTH     1
+#define CHECKSUM_LENGTH 1
+
+#ifdef PROTOCOL_V1
 #define START1       0xAA
 #define START2       0x55
 #define START_LENGTH 2
 
-#define TYPE_LENGTH        1
 #define PACKET_DATA_LENGTH 8 // For simplicity, all packet types are the same length
-#define CHECKSUM_LENGTH    1
+#define RAW_PACKET_LENGTH  (START_LENGTH + PACKET_LENGTH)
+#define ADDRESS_LENGTH     0
+#define ADDRESS_SRC(address) (1 - BOARD_ROLE) // There's only the other board
 
-#define PACKET_LENGTH     (TYPE_LENGTH + PACKET_DATA_LENGTH + CHECKSUM_LENGTH)
-#define RAW_PACKET_LENGTH (START_LENGTH + PACKET_LENGTH)
+#if NUM_SCREENS != 2
+#error "Protocol v1 can't address more than two boards"
+#endif
+#else
+#define ADDRESS_LENGTH     1
+#define ADDR_BROADCAST     0x0F
+#define MAKE_ADDRESS(src, dst) (((src) << 4) | (dst))
+#define ADDRESS_SRC(address)   ((address) >> 4)
+#define ADDRESS_DST(address)   ((address) & 0x0F)
+#define NEXT_HOP               ((BOARD_ROLE + 1) % NUM_SCREENS) // Where our TX is wired to
+
+#define FRAME_DELIMITER    0x00
+#define COBS_OVERHEAD      1  // Packets are shorter than 254 bytes, so COBS adds exactly one byte
+#define PACKET_DATA_LENGTH 32 // Maximum payload, actual length depends on packet type
+#define MAX_FRAME_LENGTH   (PACKET_LENGTH + COBS_OVERHEAD)
+#endif
+
+#define PACKET_LENGTH (TYPE_LENGTH + ADDRESS_LENGTH + PACKET_DATA_LENGTH + CHECKSUM_LENGTH)
+
+/* Data structure defining packets of information transferred */
+typedef struct {
+    uint8_t type;                     // Enum field describing the type of packet
+    uint8_t data[PACKET_DATA_LENGTH]; // Data goes here (type + payload + checksum)
+    uint8_t checksum;                 // CRC-8 in v2, a simple XOR-based one in v1
+    uint8_t address;                  // Source and destination board, v2 only (not part of v1 raw packet)
+} uart_packet_t;
 
-#define KBD_QUEUE_LENGTH   128
-#define MOUSE_QUEUE_LENGTH 2048
+#define KBD_QUEUE_LENGTH      128
+#define DEFERRED_QUEUE_LENGTH (NUM_SCREENS > 2 ? 64 : 16) // Power of 2, holds a whole config sync reply
+#define MOUSE_QUEUE_LENGTH    32 // Only button transitions are queued, motion is coalesced
 
 #define KEYS_IN_USB_REPORT  6
 #define KBD_REPORT_LENGTH   8
@@ -146,7 +272,12 @@ typedef struct {
 
 /*********  Configuration storage definitions  **********/
 
-#define CURRENT_CONFIG_VERSION 2
+/* Flash writes stall everything, so they are deferred and done when nobody is typing or moving */
+#define CONFIG_SAVE_DEBOUNCE_US  500000  // Wait this long after the last change, more changes restart it
+#define CONFIG_SAVE_QUIET_US     100000  // No local input for this long counts as quiet
+#define CONFIG_SAVE_MAX_DELAY_US 5000000 // Don't wait for a quiet moment any longer than this
+
+#define CURRENT_CONFIG_VERSION 4
 
 typedef struct {
     int top;    // When jumping from a smaller to a bigger screen, go to THIS top height
@@ -154,6 +285,31 @@ typedef struct {
                 // height
 } border_size_t;
 
+/* Each output can have several monitors side by side. The computer maps our absolute
+   0..MAX_SCREEN_COORD coordinates over all of them, so each monitor covers a part of that space. */
+#define MAX_MONITORS   4 // Per output
+#define MAX_EDGE_LINKS 4 // Per output
+
+enum edge_side_e {
+    EDGE_LEFT  = 0,
+    EDGE_RIGHT = 1,
+};
+
+typedef struct {
+    int16_t left; // Part of the output's coordinate space this monitor covers
+    int16_t right;
+    int16_t top;
+    int16_t bottom;
+} monitor_t;
+
+/* Leaving through this side of this monitor takes you to the target monitor on the target output */
+typedef struct {
+    uint8_t side; // EDGE_LEFT or EDGE_RIGHT, we enter the target monitor from the opposite side
+    uint8_t monitor;
+    uint8_t target_output;
+    uint8_t target_monitor;
+} edge_link_t;
+
 /* Define output parameters */
 typedef struct {
     int number;           // Number of this output (e.g. OUTPUT_A = 0 etc)
@@ -161,7 +317,12 @@ typedef struct {
     int screen_index;     // Current active screen
     int speed_x;          // Mouse speed per output, in direction X
     int speed_y;          // Mouse speed per output, in direction Y
+    int accel_curve;      // Mouse acceleration curve per output, one of accel_curve_e
     border_size_t border; // Screen border size/offset to keep cursor at same height when switching
+
+    monitor_t monitors[MAX_MONITORS]; // First screen_count are in use
+    edge_link_t links[MAX_EDGE_LINKS]; // Where the outer edges of our monitors lead to
+    uint8_t link_count;
 } output_t;
 
 /* Data structure defining how configuration is stored */
@@ -177,16 +338,63 @@ typedef struct {
 
 extern const config_t default_config;
 
-extern config_t ADDR_CONFIG[];
+/* Config storage at the end of flash is a log of records, each save appends one. Must match
+   __CONFIG_STORAGE_LEN in memory_map.ld. */
+#define CONFIG_STORAGE_SECTORS 4
+#define CONFIG_STORAGE_LEN     (CONFIG_STORAGE_SECTORS * FLASH_SECTOR_SIZE)
+#define CONFIG_STORAGE_OFFSET  (PICO_FLASH_SIZE_BYTES - CONFIG_STORAGE_LEN)
+#define CONFIG_RECORD_MAGIC    0xDE5C0F16
+
+/* Record header, followed by the config itself */
+typedef struct {
+    uint32_t magic;    // CONFIG_RECORD_MAGIC, erased flash reads as all ones
+    uint32_t sequence; // Goes up with every save, the highest valid one is the current config
+    uint16_t length;   // Of the config that follows
+    uint8_t reserved;
+    uint8_t crc;       // CRC-8 over the header up to here, then the config
+} config_record_t;
+
+/* Records take a whole number of pages (one, unless built for more than two outputs)
+   and never span a sector, so a sector is only erased when the log moves into it. */
+#define CONFIG_RECORD_LENGTH \
+    ((sizeof(config_record_t) + sizeof(config_t) + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1))
+#define CONFIG_RECORDS_PER_SECTOR (FLASH_SECTOR_SIZE / CONFIG_RECORD_LENGTH)
+#define CONFIG_RECORD_SLOTS       (CONFIG_STORAGE_SECTORS * CONFIG_RECORDS_PER_SECTOR)
+_Static_assert(CONFIG_RECORD_LENGTH <= FLASH_SECTOR_SIZE, "config record must fit in a flash sector");
+
+/* Edge tables, built from the layout in the config. For each output and side, a bucket
+   per EDGE_BUCKET_SIZE of height tells which link (if any) leaves from there. */
+#define EDGE_TABLE_BITS  6
+#define EDGE_TABLE_SIZE  (1 << EDGE_TABLE_BITS)
+#define EDGE_BUCKET_BITS (15 - EDGE_TABLE_BITS)
+
+/* Everything needed to cross an edge, worked out in advance */
+typedef struct {
+    uint8_t target_output;
+    uint8_t target_monitor;
+    int16_t top;        // Height range of the monitor we're leaving from
+    int16_t bottom;
+    int16_t target_x;   // Where we land
+    int16_t target_top;
+    int32_t y_scale;    // Target height / source height, 16.16 fixed point
+} edge_map_t;
+
+typedef struct {
+    uint8_t table[NUM_SCREENS][2][EDGE_TABLE_SIZE]; // Index into maps + 1, 0 if nothing there
+    edge_map_t maps[NUM_SCREENS][MAX_EDGE_LINKS];
+} edge_tables_t;
+
+extern uint8_t ADDR_CONFIG[];
 #define ADDR_CONFIG_BASE_ADDR (ADDR_CONFIG)
 
 // -------------------------------------------------------+
 
 typedef void (*action_handler_t)();
 
-typedef struct { // Maps message type -> message handler function
-    enum packet_type_e type;
+typedef struct { // Maps message type (used as index) -> message handler function
     action_handler_t handler;
+    uint8_t length; // Payload length for this packet type
+    bool deferred;  // Too slow for the core1 receive path, hand it over to core0
 } uart_handler_t;
 
 typedef struct {
@@ -206,30 +414,184 @@ typedef struct TU_ATTR_PACKED {
     int8_t pan;
 } mouse_abs_report_t;
 
-typedef enum { IDLE, READING_PACKET, PROCESSING_PACKET } receiver_state_t;
+/* Button transitions are kept in order as events. Sequence is the mailbox sequence
+   right after the event was recorded, so we know if any motion came after it. */
+typedef struct {
+    mouse_abs_report_t report;
+    uint32_t sequence;
+} mouse_event_t;
+
+/* Latest mouse state, written by core1 and read by core0. Motion overwrites the position,
+   wheel is accumulated. Sequence is odd while core1 is in the middle of an update. */
+typedef struct {
+    volatile uint32_t sequence;
+    int16_t x;
+    int16_t y;
+    uint8_t buttons;
+    int32_t wheel_total; // Running sum of all wheel movement, never reset
+    int32_t pan_total;   // Same, for horizontal scroll
+
+    /* Only touched by core0 - what we already sent to the host */
+    uint32_t sent_sequence;
+    int32_t wheel_sent;
+    int32_t pan_sent;
+} mouse_mailbox_t;
+
+typedef enum { IDLE, READING_PACKET } receiver_state_t;
+
+/* Lock-free ring for passing items from exactly one producer core to one consumer core */
+typedef struct {
+    uint8_t *items;         // Storage for capacity x item_size bytes
+    uint32_t item_size;     // Size of a single item, in bytes
+    uint32_t mask;          // Capacity - 1, capacity is a power of 2
+    volatile uint32_t head; // Free-running, written only by the producer
+    volatile uint32_t tail; // Free-running, written only by the consumer
+} spsc_ring_t;
+
+typedef struct {
+    uint32_t bucket[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/* Text for core1 to type out on the keyboard, written by core0 only while length is 0 */
+typedef struct {
+    char text[STATS_TEXT_LENGTH];
+    volatile uint32_t length;
+    uint32_t position;
+} typewriter_t;
 
+/* Pings go around the ring to the target board and its pong continues around back to us,
+   so every round trip crosses all NUM_SCREENS links, whichever board we ping */
 typedef struct {
-    uint8_t kbd_dev_addr; // Address of the keyboard device
-    uint8_t kbd_instance; // Keyboard instance (d'uh - isn't this a useless comment)
+    uint8_t next_target;          // Boards are pinged in turn
+    uint32_t ping_count;          // Sent
+    uint32_t pong_count;          // Came back, the rest got lost somewhere
+    histogram_t rtt[NUM_SCREENS]; // Round trip times, per target board
+    histogram_t hop_latency;      // Round trip divided by the number of links, one-way estimate
+} link_probe_t;
+
+/* Transmit ring state. Head and tail are free-running, their difference is the fill level. */
+typedef struct {
+    volatile uint32_t head;      // Where send_packet() appends the next byte
+    volatile uint32_t tail;      // Oldest byte not yet confirmed sent by the DMA
+    volatile uint32_t in_flight; // How many bytes from tail on the DMA is currently sending
+    critical_section_t lock;     // Both cores and the DMA IRQ touch the ring
+
+    uint32_t overflow_count; // Packets dropped because the ring was full
+    uint32_t high_watermark; // Highest fill level seen, in bytes
+} uart_tx_t;
 
-    uint8_t keyboard_leds[NUM_SCREENS];  // State of keyboard LEDs (index 0 = A, index 1 = B)
+/* Receive ring state. DMA owns the write position, we only keep track of how far we've read. */
+typedef struct {
+    uint32_t tail;         // Index of the next byte to parse
+    uint32_t reload_count; // Read by the control DMA channel to restart the RX channel
+
+    uint32_t packet_count[PACKET_TYPE_COUNT]; // Valid packets received, per type
+    uint32_t unknown_type_count;              // Packets with a type we don't have a handler for
+    uint32_t checksum_fail_count;             // Packets dropped because of a bad checksum
+    uint32_t deferred_overflow_count;         // Deferred packets dropped because core0 fell behind
+    uint32_t forwarded_count;                 // Frames passed on to the next board in the ring
+#ifdef INSTRUMENTATION
+    histogram_t backlog; // Bytes waiting in the ring whenever we get to them, large = starved
+#endif
+} uart_rx_t;
+
+/* Pending flash writes of the config, requested from either core and done by core0 */
+typedef struct {
+    volatile bool save_pending;    // Running config needs to be written
+    volatile bool wipe_pending;    // Stored config needs to be erased
+    volatile uint32_t due;         // End of the debounce period, in time_us_32() terms
+    uint32_t first_request;        // When we started waiting, we don't wait for quiet forever
+
+    uint32_t sequence;             // Of the newest record in the log
+    int next_slot;                 // Where the next record goes
+
+    uint32_t write_count;          // Flash writes (saves or wipes) done
+    uint32_t last_blackout_us;     // How long core1 was locked out and interrupts were off
+    uint32_t max_blackout_us;
+} config_store_t;
+
+#ifndef PROTOCOL_V1
+/* Boards keep the same config_t by exchanging it in blocks, see config_sync.c. Everything up
+   to the checksum is synced. Messages start with a tag, so boards built with a different
+   config layout ignore each other. */
+#define CONFIG_SYNC_LENGTH         offsetof(config_t, checksum)
+#define CONFIG_SYNC_TAG            ((CURRENT_CONFIG_VERSION << 4) | NUM_SCREENS)
+#define CONFIG_SYNC_BLOCK_SIZE     (PACKET_DATA_LENGTH - 2) // After the tag and block index
+#define CONFIG_SYNC_BLOCKS         ((CONFIG_SYNC_LENGTH + CONFIG_SYNC_BLOCK_SIZE - 1) / CONFIG_SYNC_BLOCK_SIZE)
+#define CONFIG_SYNC_HASHES_PER_MSG ((PACKET_DATA_LENGTH - 2) / sizeof(uint16_t)) // After the tag and first index
+
+#define CONFIG_SYNC_ANNOUNCE       0x80 // In the first index of hashes sent after a change, see config_sync.c
+
+#define CONFIG_SYNC_HELLO_COUNT        4       // Hashes sent after boot, in case the others weren't listening yet
+#define CONFIG_SYNC_HELLO_PERIOD_US    500000
+#define CONFIG_SYNC_ANNOUNCE_COUNT     3       // Hashes sent after a change, so missed blocks get asked for
+#define CONFIG_SYNC_ANNOUNCE_PERIOD_US 1000000
+#define CONFIG_SYNC_SETTLE_US          2500000 // Up for longer than that, other boards can take our config
+
+/* A board that just booted can get every block from every other board at once */
+_Static_assert(DEFERRED_QUEUE_LENGTH >= CONFIG_SYNC_BLOCKS * (NUM_SCREENS - 1),
+               "deferred queue must hold a whole config sync reply");
+
+typedef struct {
+    uint16_t synced_hash[CONFIG_SYNC_BLOCKS]; // What the other boards have, as far as we know
+    volatile bool push_pending;               // Changed here, send what differs from synced_hash
+    uint8_t hellos_left;                      // Hashes still to be sent after boot
+    uint32_t next_hello;                      // When, in time_us_32() terms
+    uint8_t announces_left;                   // Hashes still to be sent after a change
+    uint32_t next_announce;                   // -||-
+    uint32_t seen_overflows;                  // Deferred queue overflows we already asked again for
+
+    uint32_t blocks_sent;
+    uint32_t blocks_received;
+} config_sync_t;
+#endif
+
+/* Keyboards and mice can be attached through a hub, we keep track of each HID interface separately */
+#define MAX_HID_DEVICES 8
+
+typedef struct {
+    uint8_t dev_addr;     // Address of the device
+    uint8_t instance;     // HID interface instance within the device
+    uint8_t itf_protocol; // HID_ITF_PROTOCOL_KEYBOARD or _MOUSE, HID_ITF_PROTOCOL_NONE when slot is free
+
+    hid_keyboard_report_t kbd_report; // Last report from this keyboard, merged with others before sending
+    uint32_t mouse_buttons;           // Buttons held on this mouse, merged with others before sending
+    mouse_t mouse;                    // Mouse report layout, e.g. stores locations of buttons and axes
+} hid_device_t;
+
+typedef struct {
+    hid_device_t hid_devices[MAX_HID_DEVICES]; // Keyboards and mice connected locally
+    descriptor_cache_t descriptor_cache;       // Mouse layouts of recently seen devices
+
+    uint8_t keyboard_leds[NUM_SCREENS];  // State of keyboard LEDs (index 0 = A, index 1 = B, ...)
     uint64_t last_activity[NUM_SCREENS]; // Timestamp of the last input activity (-||-)
     receiver_state_t receiver_state;     // Storing the state for the simple receiver state machine
     uint64_t core1_last_loop_pass;       // Timestamp of last core1 loop execution
-    uint8_t active_output;               // Currently selected output (0 = A, 1 = B)
+    uint8_t active_output;               // Currently selected output (0 = A, 1 = B, ...)
 
     int16_t mouse_x; // Store and update the location of our mouse pointer
     int16_t mouse_y;
-
-    config_t config;     // Device configuration, loaded from flash or defaults used
-    mouse_t mouse_dev;   // Mouse device specifics, e.g. stores locations for keys in report
-    queue_t kbd_queue;   // Queue that stores keyboard reports
-    queue_t mouse_queue; // Queue that stores mouse reports
+    int32_t mouse_remainder_x; // Fraction of a pixel not moved yet, in MOUSE_FRACTION_BITS fixed point
+    int32_t mouse_remainder_y;
+    edge_tables_t edges;       // Precomputed from the monitor layout, for quick screen switching
+    volatile bool edges_stale; // Layout changed on core0, core1 rebuilds the tables before using them
+
+    config_t config;               // Device configuration, loaded from flash or defaults used
+    config_store_t config_store;   // Config flash writes waiting for a quiet moment
+#ifndef PROTOCOL_V1
+    config_sync_t config_sync;     // Keeping the config the same as on the other boards
+#endif
+    spsc_ring_t kbd_queue;         // Queue that stores keyboard reports (core1 -> core0)
+    spsc_ring_t mouse_queue;       // Queue that stores mouse button events (core1 -> core0)
+    mouse_mailbox_t mouse_mailbox; // Latest mouse position, coalesced while the host is busy
+    spsc_ring_t deferred_queue;    // Packets received on core1, waiting to be handled on core0
+    uart_tx_t uart_tx;             // Outgoing serial data waiting for the DMA
+    uart_rx_t uart_rx;             // Incoming serial data deposited by the DMA
 
     /* Connection status flags */
     bool tud_connected;      // True when TinyUSB device successfully connects
-    bool keyboard_connected; // True when our keyboard is connected locally
-    bool mouse_connected;    // True when a mouse is connected locally
+    bool keyboard_connected; // True when at least one keyboard is connected locally
+    bool mouse_connected;    // True when at least one mouse is connected locally
 
     /* Feature flags */
     bool mouse_zoom;        // True when "mouse zoom" is enabled
@@ -240,37 +602,147 @@ typedef struct {
     int32_t blinks_left;     // How many blink transitions are left
     int32_t last_led_change; // Timestamp of the last time led state transitioned
 
+#ifdef INSTRUMENTATION
+    volatile bool stats_dump_requested; // Set by the hotkey or message, core0 formats the text
+    typewriter_t typewriter;            // ... and core1 types it out
+    link_probe_t link_probe;            // Latency of the links between boards
+#endif
 } device_t;
 
+/* Run-time accounting, kept for every task */
+typedef struct {
+    uint32_t run_count;
+    uint32_t total_us;         // Time spent running, wraps around after ~71 minutes
+    uint32_t max_us;           // Longest single run
+    uint32_t missed_deadlines; // Timed task started later than its deadline allows
+    uint32_t max_lateness_us;  // Worst delay between being due and actually starting
+#ifdef INSTRUMENTATION
+    histogram_t run_time;
+#endif
+} task_stats_t;
+
+/* A task runs on every pass of its core's loop, unless it has:
+   - ready() - an event task, runs only when this says there is work waiting
+   - period_us - a timed task, runs every period_us */
+typedef struct {
+    const char *name;
+    void (*exec)(device_t *);
+    bool (*ready)(device_t *);
+    uint32_t period_us;
+    uint32_t deadline_us; // Timed tasks only, how late it may start before it counts as a miss
+
+    uint32_t next_run; // When a timed task is due next, in time_us_32() terms
+    task_stats_t stats;
+} task_t;
+
+/* Task table of a core */
+typedef struct {
+    uint8_t core;
+    task_t *tasks;
+    int count;
+
+#ifdef INSTRUMENTATION
+    uint32_t loop_count;
+    uint32_t max_loop_us;
+    histogram_t loop_time; // One pass through the table, only the passes where anything ran
+#endif
+} scheduler_t;
+
 /*********  Setup  **********/
 void initial_setup(device_t *);
 void serial_init(void);
+void serial_dma_init(device_t *);
+void serial_rx_dma_init(device_t *);
 void core1_main(void);
 
+/*********  Scheduler  **********/
+void start_tasks(scheduler_t *);
+void run_tasks(scheduler_t *, device_t *);
+uint32_t time_until_next_task(scheduler_t *, device_t *);
+void idle_until_next_task(scheduler_t *, device_t *);
+
+/*********  Instrumentation  **********/
+void histogram_add(histogram_t *, uint32_t);
+int format_stats(char *, int, device_t *);
+void request_stats_dump(device_t *);
+void stats_dump_task(device_t *);
+bool stats_dump_ready(device_t *);
+void typewriter_task(device_t *);
+bool typewriter_ready(device_t *);
+void link_probe_task(device_t *);
+
 /*********  Keyboard  **********/
 bool check_specific_hotkey(hotkey_combo_t, const hid_keyboard_report_t *);
-void process_keyboard_report(uint8_t *, int, device_t *);
+void process_keyboard_report(uint8_t *, int, hid_device_t *, device_t *);
+void combine_keyboard_reports(device_t *, hid_keyboard_report_t *);
 void release_all_keys(device_t *);
 void queue_kbd_report(hid_keyboard_report_t *, device_t *);
 void process_kbd_queue_task(device_t *);
 void send_key(hid_keyboard_report_t *, device_t *);
+bool kbd_report_pending(device_t *);
 
 /*********  Mouse  **********/
 bool tud_hid_abs_mouse_report(
     uint8_t report_id, uint8_t buttons, int16_t x, int16_t y, int8_t vertical, int8_t horizontal);
 
-void process_mouse_report(uint8_t *, int, device_t *);
+void process_mouse_report(uint8_t *, int, hid_device_t *, device_t *);
 uint8_t
 parse_report_descriptor(mouse_t *mouse, uint8_t arr_count, uint8_t const *desc_report, uint16_t desc_len);
 int32_t get_report_value(uint8_t *report, report_val_t *val);
+int32_t get_report_value_generic(uint8_t *report, report_val_t *val);
+void compile_report_value(report_val_t *val);
+report_layout_t *find_report_layout(mouse_t *mouse, uint8_t report_id);
+uint8_t parse_report_descriptor_cached(descriptor_cache_t *cache,
+                                       mouse_t *mouse,
+                                       uint16_t vid,
+                                       uint16_t pid,
+                                       uint8_t const *desc_report,
+                                       uint16_t desc_len);
 void process_mouse_queue_task(device_t *);
+void build_edge_tables(device_t *);
+void request_edge_tables_rebuild(device_t *);
+edge_map_t *find_edge(device_t *, int, int);
 void queue_mouse_report(mouse_abs_report_t *, device_t *);
 void output_mouse_report(mouse_abs_report_t *, device_t *);
+bool mouse_report_pending(device_t *);
+void release_mouse_buttons(device_t *);
+
+/*********  USB  **********/
+void send_pending_reports(device_t *);
+hid_device_t *find_hid_device(device_t *, uint8_t, uint8_t);
+hid_device_t *add_hid_device(device_t *, uint8_t, uint8_t, uint8_t);
+void update_connected_devices(device_t *);
+void usb_device_task(device_t *);
+bool usb_device_event_ready(device_t *);
+void usb_host_task(device_t *);
+bool reports_pending(device_t *);
 
 /*********  UART  **********/
-void receive_char(uart_packet_t *, device_t *);
+void receive_packets(uart_packet_t *, device_t *);
+void receive_packets_task(device_t *);
+bool deferred_packets_pending(device_t *);
 void send_packet(const uint8_t *, enum packet_type_e, int);
+void send_packet_to(uint8_t, const uint8_t *, enum packet_type_e, int);
 void send_value(const uint8_t, enum packet_type_e);
+int cobs_encode(const uint8_t *, int, uint8_t *);
+int cobs_decode(const uint8_t *, int, uint8_t *);
+int get_payload_length(uint8_t);
+void process_deferred_packets_task(device_t *);
+bool uart_tx_enqueue(const uint8_t *, int);
+void uart_tx_dma_handler(void);
+void uart_tx_flush(void);
+
+extern const uart_handler_t uart_handler[];
+extern uint8_t uart_tx_ring[];
+extern uint8_t uart_rx_ring[];
+
+/*********  Ring buffer  **********/
+void ring_init(spsc_ring_t *, uint32_t, uint32_t);
+bool ring_try_add(spsc_ring_t *, const void *);
+void *ring_peek(spsc_ring_t *);
+void ring_commit(spsc_ring_t *);
+bool ring_try_remove(spsc_ring_t *, void *);
+uint32_t ring_free_space(spsc_ring_t *);
 
 /*********  LEDs  **********/
 void restore_leds(device_t *);
@@ -279,15 +751,32 @@ void led_blinking_task(device_t *);
 
 /*********  Checksum  **********/
 uint8_t calc_checksum(const uint8_t *, int);
+uint8_t calc_crc8(const uint8_t *, int, uint8_t);
+uint8_t calc_packet_crc(uint8_t, uint8_t, const uint8_t *, int);
 bool verify_checksum(const uart_packet_t *);
 
 /*********  Watchdog  **********/
 void kick_watchdog(device_t *);
+void core1_heartbeat_task(device_t *);
 
 /*********  Configuration  **********/
 void load_config(device_t *);
-void save_config(device_t *);
-void wipe_config(void);
+int migrate_config(const uint8_t *, int, config_t *);
+int migrate_legacy_config(const uint8_t *, config_t *);
+uint32_t save_config(device_t *);
+void reset_config(device_t *);
+void request_config_save(device_t *);
+void request_config_wipe(device_t *);
+bool config_store_ready(device_t *);
+void config_store_task(device_t *);
+uint32_t wipe_config(void);
+
+/*********  Config sync  **********/
+uint16_t calc_config_block_hash(const config_t *, int);
+void start_config_sync(device_t *);
+void request_config_sync(device_t *);
+bool config_sync_ready(device_t *);
+void config_sync_task(device_t *);
 
 /*********  Misc  **********/
 void screensaver_task(device_t *);
@@ -302,6 +791,7 @@ void all_keys_released_handler(device_t *);
 void switchlock_hotkey_handler(device_t *);
 void wipe_config_hotkey_handler(device_t *);
 void screensaver_hotkey_handler(device_t *);
+void stats_dump_hotkey_handler(device_t *);
 
 void handle_keyboard_uart_msg(uart_packet_t *, device_t *);
 void handle_mouse_abs_uart_msg(uart_packet_t *, device_t *);
@@ -314,8 +804,14 @@ void handle_flash_led_msg(uart_packet_t *, device_t *);
 void handle_fw_upgrade_msg(uart_packet_t *, device_t *);
 void handle_wipe_config_msg(uart_packet_t *, device_t *);
 void handle_screensaver_msg(uart_packet_t *, device_t *);
+void handle_dump_stats_msg(uart_packet_t *, device_t *);
+void handle_config_hash_msg(uart_packet_t *, device_t *);
+void handle_config_block_msg(uart_packet_t *, device_t *);
+void handle_ping_msg(uart_packet_t *, device_t *);
+void handle_pong_msg(uart_packet_t *, device_t *);
 
 void switch_output(device_t *, uint8_t);
 
 /*********  Global variables (don't judge)  **********/
 extern device_t global_state;
+extern scheduler_t *schedulers[NUM_CORES];
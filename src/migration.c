@@ -0,0 +1,244 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "main.h"
+
+/**================================================== *
+ * ==============  Config Migration  ================ *
+ * ================================================== *
+ *
+ * Stored configs of older versions are upgraded one version at a time, until they reach
+ * the current one, instead of being thrown away. Each version's layout is kept here
+ * exactly as it was stored in flash. All of them were written by two-output firmware.
+ *
+ * Changing config_t means bumping CURRENT_CONFIG_VERSION, freezing the previous layout
+ * here and adding a step that upgrades it.
+ */
+
+#define LEGACY_NUM_OUTPUTS 2
+
+/* Version 2, the first one with a version number we know of */
+typedef struct {
+    int number;
+    int screen_count;
+    int screen_index;
+    int speed_x;
+    int speed_y;
+    border_size_t border;
+} output_v2_t;
+
+typedef struct {
+    uint32_t magic_header;
+    uint32_t version;
+    uint8_t force_mouse_boot_mode;
+    output_v2_t output[LEGACY_NUM_OUTPUTS];
+    uint8_t screensaver_enabled;
+    uint32_t checksum;
+} config_v2_t;
+
+/* Version 3 adds mouse acceleration */
+typedef struct {
+    int number;
+    int screen_count;
+    int screen_index;
+    int speed_x;
+    int speed_y;
+    int accel_curve;
+    border_size_t border;
+} output_v3_t;
+
+typedef struct {
+    uint32_t magic_header;
+    uint32_t version;
+    uint8_t force_mouse_boot_mode;
+    output_v3_t output[LEGACY_NUM_OUTPUTS];
+    uint8_t screensaver_enabled;
+    uint32_t checksum;
+} config_v3_t;
+
+/* Version 4 adds the monitor layout. Output count became a build option later on, without
+   changing the version, so this is what a two-output build stores. */
+typedef struct {
+    uint32_t magic_header;
+    uint32_t version;
+    uint8_t force_mouse_boot_mode;
+    output_t output[LEGACY_NUM_OUTPUTS];
+    uint8_t screensaver_enabled;
+    uint32_t checksum;
+} config_v4_t;
+
+_Static_assert(sizeof(config_v2_t) == 76, "config v2 layout must match what's stored in flash");
+_Static_assert(sizeof(config_v3_t) == 84, "config v3 layout must match what's stored in flash");
+_Static_assert(sizeof(config_v4_t) <= sizeof(config_t), "upgrades are done in config_t sized buffers");
+
+/* Pre-v3 firmware had no acceleration, so keep the pointer feeling the same */
+void upgrade_config_v2(const void *stored, void *upgraded) {
+    const config_v2_t *from = stored;
+    config_v3_t *to         = upgraded;
+
+    to->magic_header          = from->magic_header;
+    to->version               = 3;
+    to->force_mouse_boot_mode = from->force_mouse_boot_mode;
+    to->screensaver_enabled   = from->screensaver_enabled;
+
+    for (int i = 0; i < LEGACY_NUM_OUTPUTS; i++) {
+        to->output[i].number       = from->output[i].number;
+        to->output[i].screen_count = from->output[i].screen_count;
+        to->output[i].screen_index = from->output[i].screen_index;
+        to->output[i].speed_x      = from->output[i].speed_x;
+        to->output[i].speed_y      = from->output[i].speed_y;
+        to->output[i].accel_curve  = ACCEL_CURVE_NONE;
+        to->output[i].border       = from->output[i].border;
+    }
+}
+
+/* Before v4, every output was one big screen, so the default layout is what it had */
+void upgrade_config_v3(const void *stored, void *upgraded) {
+    const config_v3_t *from = stored;
+    config_v4_t *to         = upgraded;
+
+    to->magic_header          = from->magic_header;
+    to->version               = 4;
+    to->force_mouse_boot_mode = from->force_mouse_boot_mode;
+    to->screensaver_enabled   = from->screensaver_enabled;
+
+    for (int i = 0; i < LEGACY_NUM_OUTPUTS; i++) {
+        output_t *output = &to->output[i];
+
+        memcpy(output, &default_config.output[i], sizeof(output_t));
+
+        output->number       = from->output[i].number;
+        output->screen_index = 0;
+        output->speed_x      = from->output[i].speed_x;
+        output->speed_y      = from->output[i].speed_y;
+        output->accel_curve  = from->output[i].accel_curve;
+        output->border       = from->output[i].border;
+    }
+}
+
+bool edge_is_linked(const output_t *output, const edge_link_t *link) {
+    for (int i = 0; i < output->link_count; i++)
+        if (output->links[i].side == link->side && output->links[i].monitor == link->monitor)
+            return true;
+
+    return false;
+}
+
+/* Built for more outputs than the stored config has, the rest get defaults. The stored outputs
+   only lead to each other, so they also get the default links to the new ones, on edges that
+   don't lead anywhere yet. */
+void widen_config_v4(const void *stored, void *upgraded) {
+    const config_v4_t *from = stored;
+    config_t *to            = upgraded;
+
+    memcpy(to, &default_config, sizeof(config_t));
+
+    to->force_mouse_boot_mode = from->force_mouse_boot_mode;
+    to->screensaver_enabled   = from->screensaver_enabled;
+
+    memcpy(to->output, from->output, sizeof(from->output));
+
+    for (int i = 0; i < LEGACY_NUM_OUTPUTS; i++) {
+        const output_t *defaults = &default_config.output[i];
+        output_t *output         = &to->output[i];
+
+        for (int j = 0; j < defaults->link_count; j++) {
+            const edge_link_t *link = &defaults->links[j];
+
+            if (link->target_output < LEGACY_NUM_OUTPUTS || link->monitor >= output->screen_count)
+                continue;
+
+            if (edge_is_linked(output, link) || output->link_count >= MAX_EDGE_LINKS)
+                continue;
+
+            output->links[output->link_count++] = *link;
+        }
+    }
+}
+
+typedef struct {
+    int length;          // Of a stored config of this version
+    int upgraded_length; // Of what upgrade() makes of it
+    void (*upgrade)(const void *, void *);
+} config_migration_t;
+
+/* Indexed by the stored version */
+const config_migration_t config_migrations[] = {
+    [2] = {sizeof(config_v2_t), sizeof(config_v3_t), upgrade_config_v2},
+    [3] = {sizeof(config_v3_t), sizeof(config_v4_t), upgrade_config_v3},
+#if NUM_SCREENS != LEGACY_NUM_OUTPUTS
+    [4] = {sizeof(config_v4_t), sizeof(config_t), widen_config_v4},
+#endif
+};
+
+/* Brings a stored config of any known version up to date. Returns how many upgrades that took,
+   or -1 if it's not a config we know how to read. */
+int migrate_config(const uint8_t *stored, int length, config_t *config) {
+    uint8_t buffer[2][sizeof(config_t)];
+    const uint8_t *from = stored;
+    uint32_t magic_header, version, checksum;
+    int upgrades = 0;
+
+    if (length < 3 * sizeof(uint32_t) || length > sizeof(config_t))
+        return -1;
+
+    /* Every version so far starts with the magic and version, and ends with the checksum */
+    memcpy(&magic_header, stored, sizeof(uint32_t));
+    memcpy(&version, stored + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&checksum, stored + length - sizeof(uint32_t), sizeof(uint32_t));
+
+    if (magic_header != 0xB00B1E5 || checksum != calc_checksum(stored, length - sizeof(uint32_t)))
+        return -1;
+
+    while (version != CURRENT_CONFIG_VERSION || length != sizeof(config_t)) {
+        if (version >= ARRAY_SIZE(config_migrations))
+            return -1;
+
+        const config_migration_t *migration = &config_migrations[version];
+
+        if (!migration->upgrade || migration->length != length)
+            return -1;
+
+        uint8_t *to = buffer[upgrades++ & 1];
+        memset(to, 0, sizeof(config_t));
+        migration->upgrade(from, to);
+
+        from   = to;
+        length = migration->upgraded_length;
+        memcpy(&version, to + sizeof(uint32_t), sizeof(uint32_t));
+    }
+
+    memcpy(config, from, sizeof(config_t));
+    config->checksum = calc_checksum((uint8_t *)config, sizeof(config_t) - sizeof(uint32_t));
+
+    return upgrades;
+}
+
+/* Before the log, the config was kept as is at the start of the last sector. We don't
+   know how long it is, but its version tells us. */
+int migrate_legacy_config(const uint8_t *stored, config_t *config) {
+    int upgrades = migrate_config(stored, sizeof(config_t), config);
+    uint32_t version;
+
+    memcpy(&version, stored + sizeof(uint32_t), sizeof(uint32_t));
+
+    if (upgrades < 0 && version < ARRAY_SIZE(config_migrations) && config_migrations[version].upgrade)
+        upgrades = migrate_config(stored, config_migrations[version].length, config);
+
+    return upgrades;
+}
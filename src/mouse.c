@@ -31,6 +31,46 @@ int32_t move_and_keep_on_screen(int position, int offset) {
     return position + offset;
 }
 
+/* Pointer gain in 8.8 fixed point, indexed by how far the mouse moved in one report (|x| + |y|).
+ * Precomputed so there is no float math on the M0+: mild goes from 1x to 2x between 3 and 28 counts,
+ * strong from 1x to 3x between 2 and 22. Anything faster uses the last entry. */
+const uint16_t __not_in_flash("accel") accel_curves[ACCEL_CURVE_COUNT][ACCEL_LUT_SIZE] = {
+    [ACCEL_CURVE_NONE] = {256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256,
+                          256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256},
+    [ACCEL_CURVE_MILD] = {256, 256, 256, 256, 266, 276, 287, 297, 307, 317, 328, 338, 348, 358, 369, 379,
+                          389, 399, 410, 420, 430, 440, 451, 461, 471, 481, 492, 502, 512, 512, 512, 512},
+    [ACCEL_CURVE_STRONG] = {256, 256, 256, 282, 307, 333, 358, 384, 410, 435, 461, 486, 512, 538, 563, 589,
+                            614, 640, 666, 691, 717, 742, 768, 768, 768, 768, 768, 768, 768, 768, 768, 768},
+};
+
+uint16_t get_acceleration(int curve, int distance) {
+    if (curve < 0 || curve >= ACCEL_CURVE_COUNT)
+        curve = ACCEL_CURVE_NONE;
+
+    if (distance >= ACCEL_LUT_SIZE)
+        distance = ACCEL_LUT_SIZE - 1;
+
+    return accel_curves[curve][distance];
+}
+
+int32_t clamp_mouse_delta(int32_t delta) {
+    if (delta > MAX_MOUSE_DELTA)
+        return MAX_MOUSE_DELTA;
+
+    if (delta < -MAX_MOUSE_DELTA)
+        return -MAX_MOUSE_DELTA;
+
+    return delta;
+}
+
+/* Add fixed point offset to what's left over from before, return whole pixels and keep the rest */
+int32_t accumulate_motion(int32_t *remainder, int32_t offset) {
+    int32_t total = *remainder + offset;
+
+    *remainder = total & MOUSE_FRACTION_MASK;
+    return total >> MOUSE_FRACTION_BITS;
+}
+
 void update_mouse_position(device_t *state, mouse_values_t *values) {
     output_t *current    = &state->config.output[state->active_output];
     uint8_t reduce_speed = 0;
@@ -39,9 +79,17 @@ void update_mouse_position(device_t *state, mouse_values_t *values) {
     if (state->mouse_zoom)
         reduce_speed = MOUSE_ZOOM_SCALING_FACTOR;
 
+    int32_t move_x = clamp_mouse_delta(values->move_x);
+    int32_t move_y = clamp_mouse_delta(values->move_y);
+
+    /* Gain per count in fixed point. Zoom only drops fractions of a pixel, those are carried over. */
+    uint16_t accel = get_acceleration(current->accel_curve, abs(move_x) + abs(move_y));
+    int32_t gain_x = (current->speed_x * accel) >> reduce_speed;
+    int32_t gain_y = (current->speed_y * accel) >> reduce_speed;
+
     /* Calculate movement */
-    int offset_x = values->move_x * (current->speed_x >> reduce_speed);
-    int offset_y = values->move_y * (current->speed_y >> reduce_speed);
+    int offset_x = accumulate_motion(&state->mouse_remainder_x, move_x * gain_x);
+    int offset_y = accumulate_motion(&state->mouse_remainder_y, move_y * gain_y);
 
     /* Update movement */
     state->mouse_x = move_and_keep_on_screen(state->mouse_x, offset_x);
@@ -54,7 +102,7 @@ void output_mouse_report(mouse_abs_report_t *report, device_t *state) {
         queue_mouse_report(report, state);
         state->last_activity[BOARD_ROLE] = time_us_64();
     } else {
-        send_packet((uint8_t *)report, MOUSE_REPORT_MSG, MOUSE_REPORT_LENGTH);
+        send_packet_to(state->active_output, (uint8_t *)report, MOUSE_REPORT_MSG, MOUSE_REPORT_LENGTH);
     }
 }
 
@@ -89,53 +137,90 @@ int16_t scale_y_coordinate(int screen_from, int screen_to, device_t *state) {
     return ((state->mouse_y - from->border.top) * MAX_SCREEN_COORD) / size_from;
 }
 
-void switch_screen(device_t *state, int new_x, int output_from, int output_to) {
+void switch_screen(device_t *state, edge_map_t *edge) {
     mouse_abs_report_t hidden_pointer = {.y = MIN_SCREEN_COORD, .x = MAX_SCREEN_COORD};
+    int output_from                   = state->active_output;
+    output_t *from                    = &state->config.output[output_from];
+    output_t *to                      = &state->config.output[edge->target_output];
 
     output_mouse_report(&hidden_pointer, state);
-    switch_output(state, output_to);
-    state->mouse_x = (output_to == OUTPUT_A) ? MIN_SCREEN_COORD : MAX_SCREEN_COORD;
-    state->mouse_y = scale_y_coordinate(output_from, output_to, state);
+    switch_output(state, edge->target_output);
+    to->screen_index = edge->target_monitor;
+    state->mouse_x   = edge->target_x;
+
+    /* One monitor on each side, keep using the borders set up with the hotkey */
+    if (from->screen_count == 1 && to->screen_count == 1) {
+        state->mouse_y = scale_y_coordinate(output_from, edge->target_output, state);
+        return;
+    }
+
+    /* Otherwise land at the same relative height on the target monitor */
+    int y = state->mouse_y < edge->top ? edge->top : (state->mouse_y > edge->bottom ? edge->bottom : state->mouse_y);
+    state->mouse_y = edge->target_top + (((y - edge->top) * edge->y_scale) >> 16);
 }
 
 void check_screen_switch(const mouse_values_t *values, device_t *state) {
     int new_x = state->mouse_x + values->move_x;
+    int side;
 
     /* No switching allowed if explicitly disabled */
     if (state->switch_lock)
         return;
 
-    /* End of screen left switches screen A->B  TODO: make configurable */
-    if (new_x < MIN_SCREEN_COORD - JUMP_THRESHOLD && state->active_output == OUTPUT_A) {
-        switch_screen(state, new_x, OUTPUT_A, OUTPUT_B);
-    }
+    /* Only going past the outer left or right end of our coordinate space can take us elsewhere */
+    if (new_x < MIN_SCREEN_COORD - JUMP_THRESHOLD)
+        side = EDGE_LEFT;
+    else if (new_x > MAX_SCREEN_COORD + JUMP_THRESHOLD)
+        side = EDGE_RIGHT;
+    else
+        return;
 
-    /* End of screen right switches screen B->A  TODO: make configurable */
-    else if (new_x > MAX_SCREEN_COORD + JUMP_THRESHOLD && state->active_output == OUTPUT_B) {
-        switch_screen(state, new_x, OUTPUT_B, OUTPUT_A);
+    /* Cleared first, so a change that comes in while we rebuild isn't missed */
+    if (state->edges_stale) {
+        state->edges_stale = false;
+        build_edge_tables(state);
     }
+
+    /* The layout decides where (and if) this edge leads to */
+    edge_map_t *edge = find_edge(state, side, state->mouse_y);
+
+    if (edge)
+        switch_screen(state, edge);
 }
 
-void extract_report_values(uint8_t *raw_report, device_t *state, mouse_values_t *values) {
+/* Returns false if this is not a report we can get mouse movement from */
+bool extract_report_values(uint8_t *raw_report, int len, mouse_t *mouse, mouse_values_t *values) {
+    uint8_t report_id = 0;
+
     /* Interpret values depending on the current protocol used. */
-    if (state->mouse_dev.protocol == HID_PROTOCOL_BOOT) {
+    if (mouse->protocol == HID_PROTOCOL_BOOT) {
         hid_mouse_report_t *mouse_report = (hid_mouse_report_t *)raw_report;
 
         values->move_x  = mouse_report->x;
         values->move_y  = mouse_report->y;
         values->wheel   = mouse_report->wheel;
         values->buttons = mouse_report->buttons;
-        return;
+        return true;
     }
 
     /* If HID Report ID is used, the report is prefixed by the report ID so we have to move by 1 byte */
-    if (state->mouse_dev.uses_report_id)
-        raw_report++;
+    if (mouse->uses_report_id && len > 0) {
+        report_id = *raw_report++;
+        len--;
+    }
+
+    /* Other reports from the same interface (e.g. consumer control keys) are not for us */
+    report_layout_t *layout = find_report_layout(mouse, report_id);
+
+    if (!layout || len < layout->length)
+        return false;
 
-    values->move_x  = get_report_value(raw_report, &state->mouse_dev.move_x);
-    values->move_y  = get_report_value(raw_report, &state->mouse_dev.move_y);
-    values->wheel   = get_report_value(raw_report, &state->mouse_dev.wheel);
-    values->buttons = get_report_value(raw_report, &state->mouse_dev.buttons);
+    values->move_x  = get_report_value(raw_report, &layout->move_x);
+    values->move_y  = get_report_value(raw_report, &layout->move_y);
+    values->wheel   = get_report_value(raw_report, &layout->wheel);
+    values->pan     = get_report_value(raw_report, &layout->pan);
+    values->buttons = get_report_value(raw_report, &layout->buttons);
+    return true;
 }
 
 mouse_abs_report_t create_mouse_report(device_t *state, mouse_values_t *values) {
@@ -143,15 +228,31 @@ mouse_abs_report_t create_mouse_report(device_t *state, mouse_values_t *values)
                                            .x       = state->mouse_x,
                                            .y       = state->mouse_y,
                                            .wheel   = values->wheel,
-                                           .pan     = 0};
+                                           .pan     = values->pan};
     return abs_mouse_report;
 }
 
-void process_mouse_report(uint8_t *raw_report, int len, device_t *state) {
+/* Buttons held on any of the mice count as pressed */
+uint32_t combine_mouse_buttons(device_t *state) {
+    uint32_t buttons = 0;
+
+    for (int i = 0; i < MAX_HID_DEVICES; i++)
+        if (state->hid_devices[i].itf_protocol == HID_ITF_PROTOCOL_MOUSE)
+            buttons |= state->hid_devices[i].mouse_buttons;
+
+    return buttons;
+}
+
+void process_mouse_report(uint8_t *raw_report, int len, hid_device_t *device, device_t *state) {
     mouse_values_t values = {0};
 
     /* Interpret the mouse HID report, extract and save values we need. */
-    extract_report_values(raw_report, state, &values);
+    if (!extract_report_values(raw_report, len, &device->mouse, &values))
+        return;
+
+    /* Movement from all mice simply adds up, but buttons held on one must not be released by another */
+    device->mouse_buttons = values.buttons;
+    values.buttons        = combine_mouse_buttons(state);
 
     /* Calculate and update mouse pointer movement. */
     update_mouse_position(state, &values);
@@ -166,38 +267,142 @@ void process_mouse_report(uint8_t *raw_report, int len, device_t *state) {
     check_screen_switch(&values, state);
 }
 
+/* A mouse went away, buttons it was holding must not stay pressed. The pointer stays put. */
+void release_mouse_buttons(device_t *state) {
+    mouse_values_t values     = {.buttons = combine_mouse_buttons(state)};
+    mouse_abs_report_t report = create_mouse_report(state, &values);
+
+    output_mouse_report(&report, state);
+}
+
 /* ==================================================== *
  * Mouse Queue Section
  * ==================================================== */
 
+/* Keep the accumulated wheel movement within what fits in a single report */
+int8_t take_wheel_delta(int32_t total, int32_t sent) {
+    int32_t delta = total - sent;
+
+    if (delta > 127)
+        return 127;
+
+    if (delta < -127)
+        return -127;
+
+    return delta;
+}
+
+/* Take a consistent snapshot of the latest mouse state. Returns false if there
+   is nothing new since the last report we sent. */
+bool read_mouse_mailbox(mouse_mailbox_t *mailbox, mouse_abs_report_t *report, uint32_t *sequence) {
+    int32_t wheel_total, pan_total;
+    uint32_t seq;
+
+    /* If core1 was updating while we read, just try again */
+    do {
+        seq = mailbox->sequence;
+        __dmb();
+
+        report->x       = mailbox->x;
+        report->y       = mailbox->y;
+        report->buttons = mailbox->buttons;
+        wheel_total     = mailbox->wheel_total;
+        pan_total       = mailbox->pan_total;
+
+        __dmb();
+    } while ((seq & 1) || seq != mailbox->sequence);
+
+    report->wheel = take_wheel_delta(wheel_total, mailbox->wheel_sent);
+    report->pan   = take_wheel_delta(pan_total, mailbox->pan_sent);
+    *sequence     = seq;
+
+    return seq != mailbox->sent_sequence || report->wheel || report->pan;
+}
+
+/* Button transitions go first and in order, after that we send just the freshest position.
+   With absolute coordinates, replaying stale positions would only add lag. */
 void process_mouse_queue_task(device_t *state) {
-    mouse_abs_report_t report = {0};
+    mouse_mailbox_t *mailbox = &state->mouse_mailbox;
+    mouse_abs_report_t report;
+    mouse_event_t *event;
+    uint32_t sequence;
 
     /* We need to be connected to the host to send messages */
     if (!state->tud_connected)
         return;
 
-    /* Peek first, if there is anything there... */
-    if (!queue_try_peek(&state->mouse_queue, &report))
+    /* Previous report is still on its way, we'll be called again when it's done */
+    if (!tud_hid_n_ready(ITF_NUM_MOUSE))
+        return;
+
+    /* Peek first, if there is a button event there, that's what we send... */
+    if ((event = ring_peek(&state->mouse_queue)) != NULL) {
+        report   = event->report;
+        sequence = event->sequence;
+    }
+    /* ... otherwise check if anything changed since the last report */
+    else if (!read_mouse_mailbox(mailbox, &report, &sequence))
         return;
 
     /* If we are suspended, let's wake the host up */
     if (tud_suspended())
         tud_remote_wakeup();
 
-    /* ... try sending it to the host, if it's successful */
-    bool succeeded = tud_hid_abs_mouse_report(
-        REPORT_ID_MOUSE, report.buttons, report.x, report.y, report.wheel, report.pan);
+    /* ... try sending it to the host, if it's not successful, we'll try again next time */
+    if (!tud_hid_abs_mouse_report(REPORT_ID_MOUSE, report.buttons, report.x, report.y, report.wheel, report.pan))
+        return;
+
+    if (event)
+        ring_commit(&state->mouse_queue);
+
+    mailbox->sent_sequence = sequence;
+    mailbox->wheel_sent += report.wheel;
+    mailbox->pan_sent += report.pan;
+}
+
+/* True if there is something new to send and the endpoint is free to take it */
+bool mouse_report_pending(device_t *state) {
+    mouse_mailbox_t *mailbox = &state->mouse_mailbox;
+
+    if (!tud_hid_n_ready(ITF_NUM_MOUSE))
+        return false;
 
-    /* ... then we can remove it from the queue */
-    if (succeeded)
-        queue_try_remove(&state->mouse_queue, &report);
+    return ring_peek(&state->mouse_queue) != NULL || mailbox->sequence != mailbox->sent_sequence
+           || mailbox->wheel_total != mailbox->wheel_sent || mailbox->pan_total != mailbox->pan_sent;
 }
 
 void queue_mouse_report(mouse_abs_report_t *report, device_t *state) {
+    mouse_mailbox_t *mailbox = &state->mouse_mailbox;
+
     /* It wouldn't be fun to queue up a bunch of messages and then dump them all on host */
     if (!state->tud_connected)
         return;
 
-    queue_try_add(&state->mouse_queue, report);
+    bool buttons_changed = (report->buttons != mailbox->buttons);
+
+    /* Update the latest state, odd sequence tells core0 we're in the middle of it */
+    mailbox->sequence++;
+    __dmb();
+
+    mailbox->x       = report->x;
+    mailbox->y       = report->y;
+    mailbox->buttons = report->buttons;
+    mailbox->wheel_total += report->wheel;
+    mailbox->pan_total += report->pan;
+
+    __dmb();
+    mailbox->sequence++;
+
+    /* Button presses and releases can't be coalesced, so they are queued in order.
+       Wheel movement is already accounted for in the mailbox. */
+    if (buttons_changed) {
+        mouse_event_t event = {.report = *report, .sequence = mailbox->sequence};
+        event.report.wheel  = 0;
+        event.report.pan    = 0;
+
+        ring_try_add(&state->mouse_queue, &event);
+    }
+
+    /* Core0 might be sleeping in WFE, wake it up */
+    __sev();
 }
@@ -0,0 +1,96 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "main.h"
+
+/**================================================== *
+ * ============  Lock-free SPSC Ring Buffer  ========= *
+ * ================================================== *
+ *
+ * Reports flow from core1 (USB host, UART) to core0 (USB device), always one
+ * producer and one consumer. Each side only ever writes its own index, so no
+ * spinlocks or disabling interrupts are needed, just memory barriers to make
+ * sure the item is in place before the index says so.
+ */
+
+/* Capacity must be a power of 2 */
+void ring_init(spsc_ring_t *ring, uint32_t item_size, uint32_t capacity) {
+    ring->items     = calloc(capacity, item_size);
+    ring->item_size = item_size;
+    ring->mask      = capacity - 1;
+    ring->head      = 0;
+    ring->tail      = 0;
+}
+
+/* Producer side. Copies the item into the ring, returns false if it's full. */
+bool ring_try_add(spsc_ring_t *ring, const void *item) {
+    uint32_t head = ring->head;
+
+    if (head - ring->tail > ring->mask)
+        return false;
+
+    /* Don't touch the slot until we're sure the consumer is done with it */
+    __dmb();
+    memcpy(&ring->items[(head & ring->mask) * ring->item_size], item, ring->item_size);
+
+    /* Item must be completely written before we publish it */
+    __dmb();
+    ring->head = head + 1;
+
+    /* Consumer might be sleeping in WFE, wake it up */
+    __sev();
+
+    return true;
+}
+
+/* Producer side. How many items can be added before the ring is full. */
+uint32_t ring_free_space(spsc_ring_t *ring) {
+    return ring->mask + 1 - (ring->head - ring->tail);
+}
+
+/* Consumer side. Returns a pointer to the oldest item, in place, or NULL if the ring is empty.
+   The item stays valid until ring_commit() is called. */
+void *ring_peek(spsc_ring_t *ring) {
+    uint32_t tail = ring->tail;
+
+    if (tail == ring->head)
+        return NULL;
+
+    /* Make sure we read the item only after seeing the index that published it */
+    __dmb();
+    return &ring->items[(tail & ring->mask) * ring->item_size];
+}
+
+/* Consumer side. Releases the item returned by ring_peek(), making room for the producer. */
+void ring_commit(spsc_ring_t *ring) {
+    /* We need to be done reading before handing the slot back */
+    __dmb();
+    ring->tail = ring->tail + 1;
+}
+
+/* Consumer side. Copies the oldest item out and releases it, returns false if the ring is empty. */
+bool ring_try_remove(spsc_ring_t *ring, void *item) {
+    void *slot = ring_peek(ring);
+
+    if (slot == NULL)
+        return false;
+
+    memcpy(item, slot, ring->item_size);
+    ring_commit(ring);
+
+    return true;
+}
@@ -0,0 +1,162 @@
+/*
+ * This file is part of DeskHop (https://github.com/hrvach/deskhop).
+ * Copyright (c) 2024 Hrvoje Cavrak
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "main.h"
+
+/**================================================== *
+ * ================  Task Scheduler  ================ *
+ * ================================================== *
+ *
+ * Each core goes through its own table of tasks (see main.c), over and over. Tasks with nothing
+ * to do are skipped without calling them, and if no task can run, the core sleeps until the next
+ * timed one is due or an interrupt (or the other core, with SEV) wakes it up.
+ *
+ * All times are time_us_32(), compared as differences so wrapping around is not a problem.
+ */
+
+/* Core's scheduler, so the stats can be found */
+scheduler_t *schedulers[NUM_CORES];
+
+/* Timed tasks are first due one period from now */
+void start_tasks(scheduler_t *scheduler) {
+    uint32_t now = time_us_32();
+
+    for (int i = 0; i < scheduler->count; i++) {
+        task_t *task = &scheduler->tasks[i];
+
+        task->next_run = now + task->period_us;
+        memset(&task->stats, 0, sizeof(task_stats_t));
+    }
+
+    schedulers[scheduler->core] = scheduler;
+}
+
+bool task_is_due(task_t *task, device_t *state, uint32_t now) {
+    if (task->ready)
+        return task->ready(state);
+
+    if (task->period_us)
+        return (int32_t)(now - task->next_run) >= 0;
+
+    return true;
+}
+
+/* Run the task and keep the books. Returns the time it finished, so the next task
+   can use it as its start time and we read the timer only once per task. */
+uint32_t run_task(task_t *task, device_t *state, uint32_t now) {
+    task_stats_t *stats = &task->stats;
+
+    if (task->period_us) {
+        uint32_t lateness = now - task->next_run;
+
+        if (lateness > stats->max_lateness_us)
+            stats->max_lateness_us = lateness;
+
+        if (lateness > task->deadline_us)
+            stats->missed_deadlines++;
+
+        /* Keep the rhythm, but if we fell more than a period behind, don't try to catch up */
+        task->next_run += task->period_us;
+
+        if ((int32_t)(now - task->next_run) >= 0)
+            task->next_run = now + task->period_us;
+    }
+
+    task->exec(state);
+
+    uint32_t end     = time_us_32();
+    uint32_t elapsed = end - now;
+
+    stats->run_count++;
+    stats->total_us += elapsed;
+
+    if (elapsed > stats->max_us)
+        stats->max_us = elapsed;
+
+    STATS_RECORD(&stats->run_time, elapsed);
+    return end;
+}
+
+/* One pass through the table, in order, running everything that is due */
+void run_tasks(scheduler_t *scheduler, device_t *state) {
+    uint32_t start = time_us_32();
+    uint32_t now   = start;
+    int ran        = 0;
+
+    for (int i = 0; i < scheduler->count; i++) {
+        if (!task_is_due(&scheduler->tasks[i], state, now))
+            continue;
+
+        now = run_task(&scheduler->tasks[i], state, now);
+        ran++;
+    }
+
+#ifdef INSTRUMENTATION
+    /* Passes where nothing ran would only drown out the interesting ones */
+    if (!ran)
+        return;
+
+    uint32_t elapsed = now - start;
+
+    scheduler->loop_count++;
+    STATS_RECORD(&scheduler->loop_time, elapsed);
+
+    if (elapsed > scheduler->max_loop_us)
+        scheduler->max_loop_us = elapsed;
+#endif
+}
+
+/* Returns 0 if something can run right away, otherwise how long until the first timed task is due */
+uint32_t time_until_next_task(scheduler_t *scheduler, device_t *state) {
+    uint32_t now  = time_us_32();
+    uint32_t wait = WATCHDOG_KICK_PERIOD_US;
+
+    for (int i = 0; i < scheduler->count; i++) {
+        task_t *task = &scheduler->tasks[i];
+
+        if (task->ready) {
+            if (task->ready(state))
+                return 0;
+
+            continue;
+        }
+
+        /* Runs every pass, so there's never time to sleep */
+        if (!task->period_us)
+            return 0;
+
+        int32_t until = task->next_run - now;
+
+        if (until <= 0)
+            return 0;
+
+        if ((uint32_t)until < wait)
+            wait = until;
+    }
+
+    return wait;
+}
+
+/* Sleep until there's something to do. An interrupt or SEV from the other core
+   that comes in after we checked still wakes us up, WFE doesn't miss it. */
+void idle_until_next_task(scheduler_t *scheduler, device_t *state) {
+    uint32_t wait = time_until_next_task(scheduler, state);
+
+    if (wait)
+        best_effort_wfe_or_timeout(make_timeout_time_us(wait));
+}
@@ -46,6 +46,81 @@ void serial_init() {
     gpio_set_function(SERIAL_RX_PIN, GPIO_FUNC_UART);
 }
 
+/* ================================================== *
+ * Set up DMA to drain the UART transmit ring buffer
+ * ================================================== */
+
+void serial_dma_init(device_t *state) {
+    critical_section_init(&state->uart_tx.lock);
+
+    /* Claim our channel explicitly, so nobody else grabs it later */
+    dma_channel_claim(SERIAL_TX_DMA_CHANNEL);
+
+    dma_channel_config config = dma_channel_get_default_config(SERIAL_TX_DMA_CHANNEL);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+
+    /* Read from the ring (wrapping around it), always write to the UART data register */
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_ring(&config, false, UART_TX_RING_BITS);
+
+    /* Pace the transfer by the UART TX FIFO having room */
+    channel_config_set_dreq(&config, uart_get_dreq(SERIAL_UART, true));
+
+    dma_channel_configure(
+        SERIAL_TX_DMA_CHANNEL, &config, &uart_get_hw(SERIAL_UART)->dr, uart_tx_ring, 0, false);
+
+    /* When a transfer completes, the IRQ handler starts the next one */
+    dma_channel_set_irq0_enabled(SERIAL_TX_DMA_CHANNEL, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, uart_tx_dma_handler);
+    irq_set_enabled(DMA_IRQ_0, true);
+
+    serial_rx_dma_init(state);
+}
+
+/* ================================================== *
+ * Set up DMA to fill the UART receive ring buffer
+ * ================================================== */
+
+void serial_rx_dma_init(device_t *state) {
+    state->uart_rx.tail         = 0;
+    state->uart_rx.reload_count = UART_RX_DMA_COUNT;
+
+    dma_channel_claim(SERIAL_RX_DMA_CHANNEL);
+    dma_channel_claim(SERIAL_RX_DMA_CTRL_CHANNEL);
+
+    /* RX channel: read the UART data register, write to the ring (wrapping around it) */
+    dma_channel_config config = dma_channel_get_default_config(SERIAL_RX_DMA_CHANNEL);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_ring(&config, true, UART_RX_RING_BITS);
+    channel_config_set_dreq(&config, uart_get_dreq(SERIAL_UART, false));
+
+    /* Once the count runs out, the control channel restarts us where we left off */
+    channel_config_set_chain_to(&config, SERIAL_RX_DMA_CTRL_CHANNEL);
+
+    /* Control channel: write the reload count to the RX channel's count register, triggering it */
+    dma_channel_config ctrl = dma_channel_get_default_config(SERIAL_RX_DMA_CTRL_CHANNEL);
+    channel_config_set_transfer_data_size(&ctrl, DMA_SIZE_32);
+    channel_config_set_read_increment(&ctrl, false);
+    channel_config_set_write_increment(&ctrl, false);
+
+    dma_channel_configure(SERIAL_RX_DMA_CTRL_CHANNEL,
+                          &ctrl,
+                          &dma_hw->ch[SERIAL_RX_DMA_CHANNEL].al1_transfer_count_trig,
+                          &state->uart_rx.reload_count,
+                          1,
+                          false);
+
+    dma_channel_configure(SERIAL_RX_DMA_CHANNEL,
+                          &config,
+                          uart_rx_ring,
+                          &uart_get_hw(SERIAL_UART)->dr,
+                          UART_RX_DMA_COUNT,
+                          true);
+}
+
 /* ================================================== *
  * PIO USB configuration, D+ pin 14, D- pin 15
  * ================================================== */
@@ -68,19 +143,32 @@ void initial_setup(device_t *state) {
     /* PIO USB requires a clock multiple of 12 MHz, setting to 120 MHz */
     set_sys_clock_khz(120000, true);
 
-    /* Search the persistent storage sector in flash for valid config or use defaults */
+    /* Find the newest valid config in the flash log or use defaults */
     load_config(state);
 
+#ifndef PROTOCOL_V1
+    /* Then see if the other boards have something newer */
+    start_config_sync(state);
+#endif
+
     /* Init and enable the on-board LED GPIO as output */
     gpio_init(GPIO_LED_PIN);
     gpio_set_dir(GPIO_LED_PIN, GPIO_OUT);
 
     /* Initialize and configure UART */
     serial_init();
+    serial_dma_init(state);
+
+    /* Initialize keyboard and mouse queues, core1 fills them and core0 sends to the host */
+    ring_init(&state->kbd_queue, sizeof(hid_keyboard_report_t), KBD_QUEUE_LENGTH);
+    ring_init(&state->mouse_queue, sizeof(mouse_event_t), MOUSE_QUEUE_LENGTH);
 
-    /* Initialize keyboard and mouse queues */
-    queue_init(&state->kbd_queue, sizeof(hid_keyboard_report_t), KBD_QUEUE_LENGTH);
-    queue_init(&state->mouse_queue, sizeof(mouse_abs_report_t), MOUSE_QUEUE_LENGTH);
+    /* Packets core1 receives, but are too slow to handle there */
+    ring_init(&state->deferred_queue, sizeof(uart_packet_t), DEFERRED_QUEUE_LENGTH);
+
+    /* Initial state, A is the default output. This queues a key release, so do it before core1
+       starts - from then on core1 is the only one adding to the queues. */
+    switch_output(state, OUTPUT_A);
 
     /* Setup RP2040 Core 1 */
     multicore_reset_core1();
@@ -95,6 +183,9 @@ void initial_setup(device_t *state) {
     /* Update the core1 initial pass timestamp before enabling the watchdog */
     state->core1_last_loop_pass = time_us_64();
 
+    /* Any interrupt becoming pending wakes core0 from WFE, even one that fired just before */
+    scb_hw->scr |= M0PLUS_SCR_SEVONPEND_BITS;
+
     /* Setup the watchdog so we reboot and recover from a crash */
     watchdog_enable(WATCHDOG_TIMEOUT, WATCHDOG_PAUSE_ON_DEBUG);
 }
@@ -102,7 +102,7 @@ extern "C" {
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_HID    1
+#define CFG_TUD_HID    2 // Separate keyboard and mouse interfaces
 #define CFG_TUD_CDC    0
 #define CFG_TUD_MSC    0
 #define CFG_TUD_MIDI   0
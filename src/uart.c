@@ -21,7 +21,86 @@
  * ===============  Sending Packets  ================ *
  * ================================================== */
 
-void send_packet(const uint8_t *data, enum packet_type_e packet_type, int length) {
+/* Aligned to its size, so the DMA read address can wrap around it in hardware */
+uint8_t uart_tx_ring[UART_TX_RING_SIZE] __attribute__((aligned(UART_TX_RING_SIZE)));
+
+/* Hand whatever is queued over to the DMA, unless a transfer is already running.
+   Must be called with the tx lock held. */
+void uart_tx_kick(uart_tx_t *tx) {
+    if (tx->in_flight || tx->head == tx->tail)
+        return;
+
+    tx->in_flight = tx->head - tx->tail;
+
+    dma_channel_set_read_addr(SERIAL_TX_DMA_CHANNEL, &uart_tx_ring[tx->tail & UART_TX_RING_MASK], false);
+    dma_channel_set_trans_count(SERIAL_TX_DMA_CHANNEL, tx->in_flight, true);
+}
+
+/* DMA finished a transfer - release that part of the ring and start on anything queued meanwhile */
+void uart_tx_dma_handler(void) {
+    uart_tx_t *tx = &global_state.uart_tx;
+
+    dma_channel_acknowledge_irq0(SERIAL_TX_DMA_CHANNEL);
+
+    critical_section_enter_blocking(&tx->lock);
+    tx->tail += tx->in_flight;
+    tx->in_flight = 0;
+    uart_tx_kick(tx);
+    critical_section_exit(&tx->lock);
+}
+
+/* Copy data to the transmit ring and return immediately. Whole packets only,
+   if there is no room we drop it and count the overflow. */
+bool uart_tx_enqueue(const uint8_t *data, int length) {
+    uart_tx_t *tx = &global_state.uart_tx;
+
+    critical_section_enter_blocking(&tx->lock);
+
+    uint32_t used = tx->head - tx->tail;
+
+    if (used + length > UART_TX_RING_SIZE) {
+        tx->overflow_count++;
+        critical_section_exit(&tx->lock);
+        return false;
+    }
+
+    for (int i = 0; i < length; i++)
+        uart_tx_ring[(tx->head + i) & UART_TX_RING_MASK] = data[i];
+
+    tx->head += length;
+
+    if (used + length > tx->high_watermark)
+        tx->high_watermark = used + length;
+
+    uart_tx_kick(tx);
+    critical_section_exit(&tx->lock);
+
+    return true;
+}
+
+/* Wait until everything queued has actually left the UART. Only for the few places that
+   can't continue before the other board got the message, e.g. right before a reboot. */
+void uart_tx_flush(void) {
+    uart_tx_t *tx = &global_state.uart_tx;
+
+    while (tx->head != tx->tail)
+        tight_loop_contents();
+
+    /* DMA is done, but the last bytes might still be sitting in the hardware FIFO */
+    uart_tx_wait_blocking(SERIAL_UART);
+}
+
+/* Returns payload length for a packet type, 0 means we don't know this type */
+int get_payload_length(uint8_t packet_type) {
+    if (packet_type >= PACKET_TYPE_COUNT)
+        return 0;
+
+    return uart_handler[packet_type].length;
+}
+
+#ifdef PROTOCOL_V1
+/* There's only the other board, so the destination doesn't matter */
+void send_packet_to(uint8_t destination, const uint8_t *data, enum packet_type_e packet_type, int length) {
     uint8_t raw_packet[RAW_PACKET_LENGTH] = {[0] = START1,
                                              [1] = START2,
                                              [2] = packet_type,
@@ -31,8 +110,45 @@ void send_packet(const uint8_t *data, enum packet_type_e packet_type, int length
     if (length > 0)
         memcpy(&raw_packet[START_LENGTH + TYPE_LENGTH], data, length);
 
-    /* Packets are short, fixed length, high speed and there is no flow control to block this */
-    uart_write_blocking(SERIAL_UART, raw_packet, RAW_PACKET_LENGTH);
+    /* Queue the packet, DMA takes it from there so we don't wait for the UART */
+    uart_tx_enqueue(raw_packet, RAW_PACKET_LENGTH);
+}
+#else
+void send_packet_to(uint8_t destination, const uint8_t *data, enum packet_type_e packet_type, int length) {
+    uint8_t packet[PACKET_LENGTH] = {[0] = packet_type, [1] = MAKE_ADDRESS(BOARD_ROLE, destination)};
+    uint8_t frame[MAX_FRAME_LENGTH + 1];
+    int payload_length = get_payload_length(packet_type);
+    int header_length  = TYPE_LENGTH + ADDRESS_LENGTH;
+
+    if (!payload_length)
+        return;
+
+    /* Payload length is defined by type, anything shorter is zero-padded */
+    if (length > payload_length)
+        length = payload_length;
+
+    if (length > 0)
+        memcpy(&packet[header_length], data, length);
+
+    /* CRC covers the type, address and the payload */
+    packet[header_length + payload_length] = calc_crc8(packet, header_length + payload_length, 0);
+
+    /* Encode, so there are no zeros inside, then terminate the frame with one */
+    int frame_length      = cobs_encode(packet, header_length + payload_length + CHECKSUM_LENGTH, frame);
+    frame[frame_length++] = FRAME_DELIMITER;
+
+    /* Queue the frame, DMA takes it from there so we don't wait for the UART */
+    uart_tx_enqueue(frame, frame_length);
+}
+#endif
+
+/* Most messages are for everyone, the ones that aren't use send_packet_to() */
+void send_packet(const uint8_t *data, enum packet_type_e packet_type, int length) {
+#ifdef PROTOCOL_V1
+    send_packet_to(0, data, packet_type, length);
+#else
+    send_packet_to(ADDR_BROADCAST, data, packet_type, length);
+#endif
 }
 
 void send_value(const uint8_t value, enum packet_type_e packet_type) {
@@ -40,48 +156,180 @@ void send_value(const uint8_t value, enum packet_type_e packet_type) {
     send_packet(&data, packet_type, sizeof(uint8_t));
 }
 
+/**================================================== *
+ * ===============  COBS Framing  =================== *
+ * ================================================== */
+
+/* Consistent Overhead Byte Stuffing - replaces every zero with the distance to the next one,
+   so the only zero on the wire is the frame delimiter. Returns the encoded length. */
+int cobs_encode(const uint8_t *data, int length, uint8_t *encoded) {
+    int code_index = 0;
+    int index      = 1;
+    uint8_t code   = 1;
+
+    for (int i = 0; i < length; i++) {
+        if (data[i] == 0) {
+            encoded[code_index] = code;
+            code_index          = index++;
+            code                = 1;
+            continue;
+        }
+
+        encoded[index++] = data[i];
+
+        /* Block of 254 non-zero bytes is full, start a new one */
+        if (++code == 0xFF) {
+            encoded[code_index] = code;
+            code_index          = index++;
+            code                = 1;
+        }
+    }
+
+    encoded[code_index] = code;
+    return index;
+}
+
+/* Reverse of the above, returns decoded length or -1 if the frame is malformed.
+   Decoded data is never longer than the encoded one. */
+int cobs_decode(const uint8_t *encoded, int length, uint8_t *data) {
+    int index = 0;
+
+    for (int i = 0; i < length;) {
+        uint8_t code = encoded[i++];
+
+        if (code == 0)
+            return -1;
+
+        for (int n = 1; n < code; n++) {
+            if (i >= length)
+                return -1;
+
+            data[index++] = encoded[i++];
+        }
+
+        /* Every block except the last and the full ones ended with a zero */
+        if (code != 0xFF && i < length)
+            data[index++] = 0;
+    }
+
+    return index;
+}
+
 /**================================================== *
  * ===============  Parsing Packets  ================ *
  * ================================================== */
 
-const uart_handler_t uart_handler[] = {
-    {.type = KEYBOARD_REPORT_MSG, .handler = handle_keyboard_uart_msg},
-    {.type = MOUSE_REPORT_MSG, .handler = handle_mouse_abs_uart_msg},
-    {.type = OUTPUT_SELECT_MSG, .handler = handle_output_select_msg},
-    {.type = FIRMWARE_UPGRADE_MSG, .handler = handle_fw_upgrade_msg},
-    {.type = MOUSE_ZOOM_MSG, .handler = handle_mouse_zoom_msg},
-    {.type = KBD_SET_REPORT_MSG, .handler = handle_set_report_msg},
-    {.type = SWITCH_LOCK_MSG, .handler = handle_switch_lock_msg},
-    {.type = SYNC_BORDERS_MSG, .handler = handle_sync_borders_msg},
-    {.type = FLASH_LED_MSG, .handler = handle_flash_led_msg},
-    {.type = SCREENSAVER_MSG, .handler = handle_screensaver_msg},
-    {.type = WIPE_CONFIG_MSG, .handler = handle_wipe_config_msg},
+/* Boards built without instrumentation still need the lengths, to forward these to the others */
+#ifdef INSTRUMENTATION
+#define INSTRUMENTATION_HANDLER(handler) handler
+#else
+#define INSTRUMENTATION_HANDLER(handler) NULL
+#endif
+
+/* Indexed directly by packet type. Deferred handlers are the ones that might take long
+   (e.g. write to flash), so they run on core0 and keep the USB host core responsive. */
+const uart_handler_t uart_handler[PACKET_TYPE_COUNT] = {
+    [KEYBOARD_REPORT_MSG]  = {.handler = handle_keyboard_uart_msg, .length = KBD_REPORT_LENGTH},
+    [MOUSE_REPORT_MSG]     = {.handler = handle_mouse_abs_uart_msg, .length = MOUSE_REPORT_LENGTH},
+    [OUTPUT_SELECT_MSG]    = {.handler = handle_output_select_msg, .length = sizeof(uint8_t)},
+    [FIRMWARE_UPGRADE_MSG] = {.handler = handle_fw_upgrade_msg, .length = sizeof(uint8_t)},
+    [MOUSE_ZOOM_MSG]       = {.handler = handle_mouse_zoom_msg, .length = sizeof(uint8_t)},
+    [KBD_SET_REPORT_MSG]   = {.handler = handle_set_report_msg, .length = sizeof(uint8_t)},
+    [SWITCH_LOCK_MSG]      = {.handler = handle_switch_lock_msg, .length = sizeof(uint8_t)},
+    [SYNC_BORDERS_MSG]     = {.handler = handle_sync_borders_msg, .length = sizeof(border_size_t), .deferred = true},
+    [FLASH_LED_MSG]        = {.handler = handle_flash_led_msg, .length = sizeof(uint8_t)},
+    [SCREENSAVER_MSG]      = {.handler = handle_screensaver_msg, .length = sizeof(uint8_t)},
+    [WIPE_CONFIG_MSG]      = {.handler = handle_wipe_config_msg, .length = sizeof(uint8_t), .deferred = true},
+    [DUMP_STATS_MSG]       = {.handler = INSTRUMENTATION_HANDLER(handle_dump_stats_msg), .length = sizeof(uint8_t)},
+    [PING_MSG]             = {.handler = INSTRUMENTATION_HANDLER(handle_ping_msg), .length = sizeof(uint32_t)},
+    [PONG_MSG]             = {.handler = INSTRUMENTATION_HANDLER(handle_pong_msg), .length = sizeof(uint32_t)},
+#ifndef PROTOCOL_V1
+    [CONFIG_HASH_MSG]      = {.handler = handle_config_hash_msg, .length = PACKET_DATA_LENGTH, .deferred = true},
+    [CONFIG_BLOCK_MSG]     = {.handler = handle_config_block_msg, .length = PACKET_DATA_LENGTH, .deferred = true},
+#endif
 };
 
 void process_packet(uart_packet_t *packet, device_t *state) {
-    if (!verify_checksum(packet))
+    uart_rx_t *rx = &state->uart_rx;
+
+    /* Type is used as an index, so it has to be within bounds and known */
+    if (packet->type >= PACKET_TYPE_COUNT || !uart_handler[packet->type].length) {
+        rx->unknown_type_count++;
         return;
+    }
 
-    for (int i = 0; i < ARRAY_SIZE(uart_handler); i++) {
-        if (uart_handler[i].type == packet->type) {
-            uart_handler[i].handler(packet, state);
-            return;
-        }
+
+#ifdef PROTOCOL_V1
+    /* v2 frames have their CRC checked in process_frame(), before they are forwarded */
+    if (!verify_checksum(packet)) {
+        rx->checksum_fail_count++;
+        return;
     }
+#endif
+
+    const uart_handler_t *entry = &uart_handler[packet->type];
+    rx->packet_count[packet->type]++;
+
+    /* Known, but not handled in this build. It was forwarded already, if it had to be. */
+    if (!entry->handler)
+        return;
+
+    if (!entry->deferred) {
+        entry->handler(packet, state);
+        return;
+    }
+
+    if (!ring_try_add(&state->deferred_queue, packet))
+        rx->deferred_overflow_count++;
+}
+
+bool deferred_packets_pending(device_t *state) {
+    return ring_peek(&state->deferred_queue) != NULL;
+}
+
+/* Runs on core0, handles packets core1 received but handed over to us */
+void process_deferred_packets_task(device_t *state) {
+    uart_packet_t packet;
+
+    if (!ring_try_remove(&state->deferred_queue, &packet))
+        return;
+
+    uart_handler[packet.type].handler(&packet, state);
 }
 
 /**================================================== *
  * ==============  Receiving Packets  =============== *
  * ================================================== */
 
-/* We are in IDLE state until we detect the packet start (0xAA 0x55) */
-void handle_idle_state(uint8_t *raw_packet, device_t *state) {
-    if (!uart_is_readable(SERIAL_UART)) {
-        return;
-    }
+/* Aligned to its size, so the DMA write address can wrap around it in hardware */
+uint8_t uart_rx_ring[UART_RX_RING_SIZE] __attribute__((aligned(UART_RX_RING_SIZE)));
+
+/* DMA keeps advancing its write address, so that's where the received data ends */
+uint32_t uart_rx_head(void) {
+    uint32_t write_addr = dma_channel_hw_addr(SERIAL_RX_DMA_CHANNEL)->write_addr;
+    return (write_addr - (uint32_t)(uintptr_t)uart_rx_ring) & UART_RX_RING_MASK;
+}
+
+/* Processes all data received over serial from the other board */
+void receive_packets_task(device_t *state) {
+    static uart_packet_t packet;
 
-    raw_packet[0] = raw_packet[1];          /* Remember the previous byte received */
-    raw_packet[1] = uart_getc(SERIAL_UART); /* Try to match packet start */
+#ifdef INSTRUMENTATION
+    /* How much piled up since the last time, only counted when there is anything at all */
+    uint32_t backlog = (uart_rx_head() - state->uart_rx.tail) & UART_RX_RING_MASK;
+
+    if (backlog)
+        STATS_RECORD(&state->uart_rx.backlog, backlog);
+#endif
+
+    receive_packets(&packet, state);
+}
+
+#ifdef PROTOCOL_V1
+/* We are in IDLE state until we detect the packet start (0xAA 0x55) */
+void handle_idle_state(uint8_t *raw_packet, uint8_t byte, device_t *state) {
+    raw_packet[0] = raw_packet[1]; /* Remember the previous byte received */
+    raw_packet[1] = byte;          /* Try to match packet start */
 
     /* If we found 0xAA 0x55, we're in sync and can move on to read/process the packet */
     if (raw_packet[0] == START1 && raw_packet[1] == START2) {
@@ -89,42 +337,136 @@ void handle_idle_state(uint8_t *raw_packet, device_t *state) {
     }
 }
 
-/* Read a character off the line until we reach fixed packet length */
-void handle_reading_state(uint8_t *raw_packet, device_t *state, int *count) {
-    while (uart_is_readable(SERIAL_UART) && *count < PACKET_LENGTH) {        
-        /* Read and store the incoming byte */
-        raw_packet[(*count)++] = uart_getc(SERIAL_UART);
-    }
+/* Store bytes until we reach fixed packet length, then process it and go back to IDLE */
+void handle_reading_state(uart_packet_t *packet, uint8_t byte, device_t *state, int *count) {
+    uint8_t *raw_packet = (uint8_t *)packet;
+
+    raw_packet[(*count)++] = byte;
 
-    /* Check if a complete packet is received */
     if (*count >= PACKET_LENGTH) {
-        state->receiver_state = PROCESSING_PACKET;
+        process_packet(packet, state);
+        state->receiver_state = IDLE;
+        *count                = 0;
     }
 }
 
-/* Process that packet, restart counters and state machine to have it back to IDLE */
-void handle_processing_state(uart_packet_t *packet, device_t *state, int *count) {
+/* Very simple state machine, goes through everything DMA received since the last
+   call and processes every complete packet found in there. */
+void receive_packets(uart_packet_t *packet, device_t *state) {
+    uart_rx_t *rx    = &state->uart_rx;
+    uint32_t head    = uart_rx_head();
+    static int count = 0;
+
+    while (rx->tail != head) {
+        uint8_t byte = uart_rx_ring[rx->tail];
+        rx->tail     = (rx->tail + 1) & UART_RX_RING_MASK;
+
+        switch (state->receiver_state) {
+            case IDLE:
+                handle_idle_state((uint8_t *)packet, byte, state);
+                break;
+
+            case READING_PACKET:
+                handle_reading_state(packet, byte, state, &count);
+                break;
+        }
+    }
+}
+#else
+/* Pass the frame on to the next board exactly as we got it, no need to encode it again */
+void forward_frame(const uint8_t *frame, int length, device_t *state) {
+    uint8_t buffer[MAX_FRAME_LENGTH + 1];
+
+    memcpy(buffer, frame, length);
+    buffer[length++] = FRAME_DELIMITER;
+
+    if (uart_tx_enqueue(buffer, length))
+        state->uart_rx.forwarded_count++;
+}
+
+/* Frames go around the ring until they reach their destination. Broadcasts stop at the board
+   right before the source, our own frames are never sent again in case the ring is miswired. */
+bool should_forward(uint8_t address) {
+    uint8_t source      = ADDRESS_SRC(address);
+    uint8_t destination = ADDRESS_DST(address);
+
+    if (destination == BOARD_ROLE || source == BOARD_ROLE || source == NEXT_HOP)
+        return false;
+
+    return destination == ADDR_BROADCAST || destination < NUM_SCREENS;
+}
+
+/* Decode a received frame and process the packet inside, if it's valid */
+void process_frame(uint8_t *frame, int length, uart_packet_t *packet, device_t *state) {
+    const int header_length = TYPE_LENGTH + ADDRESS_LENGTH;
+    uint8_t raw_packet[MAX_FRAME_LENGTH];
+    int raw_length = cobs_decode(frame, length, raw_packet);
+
+    if (raw_length < header_length + CHECKSUM_LENGTH)
+        return;
+
+    /* Length has to match exactly what this packet type is supposed to carry */
+    int payload_length = get_payload_length(raw_packet[0]);
+
+    if (!payload_length) {
+        state->uart_rx.unknown_type_count++;
+        return;
+    }
+
+    if (raw_length != header_length + payload_length + CHECKSUM_LENGTH)
+        return;
+
+    /* Checked here already, so we don't pass corrupted frames around the ring */
+    if (calc_crc8(raw_packet, raw_length, 0) != 0) {
+        state->uart_rx.checksum_fail_count++;
+        return;
+    }
+
+    uint8_t address = raw_packet[TYPE_LENGTH];
+
+    /* Forward first, the boards further down the ring shouldn't wait for our handler */
+    if (should_forward(address))
+        forward_frame(frame, length, state);
+
+    if (ADDRESS_DST(address) != BOARD_ROLE && ADDRESS_DST(address) != ADDR_BROADCAST)
+        return;
+
+    /* Unused part of data stays zeroed, so handlers can treat it as fixed length */
+    memset(packet, 0, sizeof(uart_packet_t));
+
+    packet->type     = raw_packet[0];
+    packet->address  = address;
+    packet->checksum = raw_packet[header_length + payload_length];
+    memcpy(packet->data, &raw_packet[header_length], payload_length);
+
     process_packet(packet, state);
-    state->receiver_state = IDLE;
-    *count                = 0;
 }
 
-/* Very simple state machine to receive and process packets over serial */
-void receive_char(uart_packet_t *packet, device_t *state) {
-    uint8_t *raw_packet = (uint8_t *)packet;
-    static int count    = 0;
+/* Collect bytes until the frame delimiter, then process the frame. Goes through everything
+   DMA received since the last call. Frames that are too long can't be valid and are dropped. */
+void receive_packets(uart_packet_t *packet, device_t *state) {
+    static uint8_t frame[MAX_FRAME_LENGTH];
+    static int count = 0;
 
-    switch (state->receiver_state) {
-        case IDLE:
-            handle_idle_state(raw_packet, state);
-            break;
+    uart_rx_t *rx = &state->uart_rx;
+    uint32_t head = uart_rx_head();
+
+    while (rx->tail != head) {
+        uint8_t byte = uart_rx_ring[rx->tail];
+        rx->tail     = (rx->tail + 1) & UART_RX_RING_MASK;
+
+        if (byte == FRAME_DELIMITER) {
+            if (count > 0 && count <= MAX_FRAME_LENGTH)
+                process_frame(frame, count, packet, state);
+
+            count = 0;
+            continue;
+        }
 
-        case READING_PACKET:
-            handle_reading_state(raw_packet, state, &count);
-            break;
+        if (count < MAX_FRAME_LENGTH)
+            frame[count] = byte;
 
-        case PROCESSING_PACKET:
-            handle_processing_state(packet, state, &count);
-            break;
+        count++;
     }
 }
+#endif
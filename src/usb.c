@@ -44,7 +44,8 @@ void tud_hid_set_report_cb(uint8_t instance,
                            hid_report_type_t report_type,
                            uint8_t const *buffer,
                            uint16_t bufsize) {
-    if (report_id != REPORT_ID_KEYBOARD || bufsize != 1 || report_type != HID_REPORT_TYPE_OUTPUT)
+    if (instance != ITF_NUM_KEYBOARD || report_id != REPORT_ID_KEYBOARD || bufsize != 1
+        || report_type != HID_REPORT_TYPE_OUTPUT)
         return;
 
     uint8_t leds = buffer[0];
@@ -67,6 +68,40 @@ void tud_hid_set_report_cb(uint8_t instance,
         send_value(leds, KBD_SET_REPORT_MSG);
 }
 
+/* Invoked when a report was delivered to the host. The endpoint is free again, so arm the
+ * next pending report for that interface right away instead of waiting for the main loop. */
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len) {
+    if (instance == ITF_NUM_KEYBOARD)
+        process_kbd_queue_task(&global_state);
+    else
+        process_mouse_queue_task(&global_state);
+}
+
+/* Keyboard goes first, key presses are rarer and more latency sensitive than mouse motion */
+void send_pending_reports(device_t *state) {
+    process_kbd_queue_task(state);
+    process_mouse_queue_task(state);
+}
+
+bool reports_pending(device_t *state) {
+    return kbd_report_pending(state) || mouse_report_pending(state);
+}
+
+/* USB device stack only has work when its interrupt queued an event */
+void usb_device_task(device_t *state) {
+    tud_task();
+}
+
+bool usb_device_event_ready(device_t *state) {
+    return tud_task_event_ready();
+}
+
+/* USB host task, needs to run as often as possible */
+void usb_host_task(device_t *state) {
+    if (tuh_inited())
+        tuh_task();
+}
+
 /* Invoked when device is mounted */
 void tud_mount_cb(void) {
     global_state.tud_connected = true;
@@ -81,45 +116,101 @@ void tud_umount_cb(void) {
  * ===============  USB HOST Section  =============== *
  * ================================================== */
 
+/* Find the slot for this particular HID interface, NULL if we're not tracking it */
+hid_device_t *find_hid_device(device_t *state, uint8_t dev_addr, uint8_t instance) {
+    for (int i = 0; i < MAX_HID_DEVICES; i++) {
+        hid_device_t *device = &state->hid_devices[i];
+
+        if (device->itf_protocol != HID_ITF_PROTOCOL_NONE && device->dev_addr == dev_addr
+            && device->instance == instance)
+            return device;
+    }
+
+    return NULL;
+}
+
+/* Take a free slot for a newly mounted interface, NULL if all of them are taken */
+hid_device_t *add_hid_device(device_t *state, uint8_t dev_addr, uint8_t instance, uint8_t itf_protocol) {
+    for (int i = 0; i < MAX_HID_DEVICES; i++) {
+        hid_device_t *device = &state->hid_devices[i];
+
+        if (device->itf_protocol != HID_ITF_PROTOCOL_NONE)
+            continue;
+
+        memset(device, 0, sizeof(hid_device_t));
+        device->dev_addr     = dev_addr;
+        device->instance     = instance;
+        device->itf_protocol = itf_protocol;
+        return device;
+    }
+
+    return NULL;
+}
+
+/* Something was plugged in or removed, see what's left */
+void update_connected_devices(device_t *state) {
+    state->keyboard_connected = false;
+    state->mouse_connected    = false;
+
+    for (int i = 0; i < MAX_HID_DEVICES; i++) {
+        state->keyboard_connected |= (state->hid_devices[i].itf_protocol == HID_ITF_PROTOCOL_KEYBOARD);
+        state->mouse_connected |= (state->hid_devices[i].itf_protocol == HID_ITF_PROTOCOL_MOUSE);
+    }
+}
+
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance) {
-    uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+    hid_device_t *device = find_hid_device(&global_state, dev_addr, instance);
+    hid_keyboard_report_t combined_report;
 
-    switch (itf_protocol) {
-        case HID_ITF_PROTOCOL_KEYBOARD:
-            global_state.keyboard_connected = false;
-            break;
+    if (!device)
+        return;
 
-        case HID_ITF_PROTOCOL_MOUSE:
-            global_state.mouse_connected = false;
+    uint8_t itf_protocol = device->itf_protocol;
 
-            /* Clear this so reconnecting a mouse doesn't try to continue in HID REPORT protocol */
-            memset(&global_state.mouse_dev, 0, sizeof(global_state.mouse_dev));
-            break;
+    /* Free the slot, this also makes sure reconnecting a mouse doesn't try to continue in HID REPORT protocol */
+    memset(device, 0, sizeof(hid_device_t));
+    update_connected_devices(&global_state);
+
+    /* Keys held down on the keyboard that's gone must not stay pressed */
+    if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
+        combine_keyboard_reports(&global_state, &combined_report);
+        send_key(&combined_report, &global_state);
     }
+
+    /* Same goes for the buttons on a mouse */
+    if (itf_protocol == HID_ITF_PROTOCOL_MOUSE)
+        release_mouse_buttons(&global_state);
 }
 
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const *desc_report, uint16_t desc_len) {
     uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+    hid_device_t *device       = NULL;
 
-    switch (itf_protocol) {
-        case HID_ITF_PROTOCOL_KEYBOARD:
-            /* Keeping this is required for setting leds from device set_report callback */
-            global_state.kbd_dev_addr       = dev_addr;
-            global_state.kbd_instance       = instance;
-            global_state.keyboard_connected = true;
-            break;
+    if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD || itf_protocol == HID_ITF_PROTOCOL_MOUSE)
+        device = add_hid_device(&global_state, dev_addr, instance, itf_protocol);
 
-        case HID_ITF_PROTOCOL_MOUSE:
-            /* Switch to using protocol report instead of boot report, it's more complicated but
-               at least we get all the information we need (looking at you, mouse wheel) */
-            if (tuh_hid_get_protocol(dev_addr, instance) == HID_PROTOCOL_BOOT) {
-                tuh_hid_set_protocol(dev_addr, instance, HID_PROTOCOL_REPORT);
-            }
-            parse_report_descriptor(&global_state.mouse_dev, MAX_REPORTS, desc_report, desc_len);
-
-            global_state.mouse_connected = true;
-            break;
+    /* Out of slots, or not something we know how to use */
+    if (!device)
+        return;
+
+    if (itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
+        /* Switch to using protocol report instead of boot report, it's more complicated but
+           at least we get all the information we need (looking at you, mouse wheel) */
+        device->mouse.protocol = tuh_hid_get_protocol(dev_addr, instance);
+
+        if (device->mouse.protocol == HID_PROTOCOL_BOOT) {
+            tuh_hid_set_protocol(dev_addr, instance, HID_PROTOCOL_REPORT);
+        }
+
+        /* Reconnecting a device we've seen recently (e.g. a wireless dongle) skips the parsing */
+        uint16_t vid, pid;
+        tuh_vid_pid_get(dev_addr, &vid, &pid);
+        parse_report_descriptor_cached(
+            &global_state.descriptor_cache, &device->mouse, vid, pid, desc_report, desc_len);
     }
+
+    update_connected_devices(&global_state);
+
     /* Flash local led to indicate a device was connected */
     blink_led(&global_state);
 
@@ -132,15 +223,18 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const *desc_re
 
 /* Invoked when received report from device via interrupt endpoint */
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const *report, uint16_t len) {
-    uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+    hid_device_t *device = find_hid_device(&global_state, dev_addr, instance);
 
-    switch (itf_protocol) {
+    if (!device)
+        return;
+
+    switch (device->itf_protocol) {
         case HID_ITF_PROTOCOL_KEYBOARD:
-            process_keyboard_report((uint8_t *)report, len, &global_state);
+            process_keyboard_report((uint8_t *)report, len, device, &global_state);
             break;
 
         case HID_ITF_PROTOCOL_MOUSE:
-            process_mouse_report((uint8_t *)report, len, &global_state);
+            process_mouse_report((uint8_t *)report, len, device, &global_state);
             break;
     }
 
@@ -149,7 +243,10 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
 }
 
 /* Set protocol in a callback. If we were called, command succeeded. We're only
-   doing this for the mouse for now, so we can only be called about the mouse */
+   doing this for mice for now, so we can only be called about a mouse */
 void tuh_hid_set_protocol_complete_cb(uint8_t dev_addr, uint8_t idx, uint8_t protocol) {
-    global_state.mouse_dev.protocol = protocol;
+    hid_device_t *device = find_hid_device(&global_state, dev_addr, idx);
+
+    if (device)
+        device->mouse.protocol = protocol;
 }
@@ -41,7 +41,7 @@ tusb_desc_device_t const desc_device = {.bLength         = sizeof(tusb_desc_devi
                                         // https://github.com/raspberrypi/usb-pid
                                         .idVendor  = 0x2E8A,
                                         .idProduct = 0x107C,
-                                        .bcdDevice = 0x0100,
+                                        .bcdDevice = 0x0101,
 
                                         .iManufacturer = 0x01,
                                         .iProduct      = 0x02,
@@ -59,15 +59,18 @@ uint8_t const *tud_descriptor_device_cb(void) {
 // HID Report Descriptor
 //--------------------------------------------------------------------+
 
-uint8_t const desc_hid_report[] = {TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(REPORT_ID_KEYBOARD)),
-                                   TUD_HID_REPORT_DESC_ABSMOUSE(HID_REPORT_ID(REPORT_ID_MOUSE))};
+uint8_t const desc_hid_report_keyboard[] = {TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(REPORT_ID_KEYBOARD))};
+
+uint8_t const desc_hid_report_mouse[] = {TUD_HID_REPORT_DESC_ABSMOUSE(HID_REPORT_ID(REPORT_ID_MOUSE))};
 
 // Invoked when received GET HID REPORT DESCRIPTOR
 // Application return pointer to descriptor
 // Descriptor contents must exist long enough for transfer to complete
 uint8_t const *tud_hid_descriptor_report_cb(uint8_t instance) {
-    (void)instance;
-    return desc_hid_report;
+    if (instance == ITF_NUM_MOUSE)
+        return desc_hid_report_mouse;
+
+    return desc_hid_report_keyboard;
 }
 
 bool tud_hid_n_abs_mouse_report(uint8_t instance,
@@ -83,18 +86,17 @@ bool tud_hid_n_abs_mouse_report(uint8_t instance,
 
 bool tud_hid_abs_mouse_report(
     uint8_t report_id, uint8_t buttons, int16_t x, int16_t y, int8_t vertical, int8_t horizontal) {
-    return tud_hid_n_abs_mouse_report(0, report_id, buttons, x, y, vertical, horizontal);
+    return tud_hid_n_abs_mouse_report(ITF_NUM_MOUSE, report_id, buttons, x, y, vertical, horizontal);
 }
 
 //--------------------------------------------------------------------+
 // Configuration Descriptor
 //--------------------------------------------------------------------+
 
-enum { ITF_NUM_HID, ITF_NUM_TOTAL };
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + ITF_NUM_TOTAL * TUD_HID_DESC_LEN)
 
-#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_HID_DESC_LEN)
-
-#define EPNUM_HID 0x81
+#define EPNUM_HID_KEYBOARD 0x81
+#define EPNUM_HID_MOUSE    0x82
 
 uint8_t const desc_configuration[] = {
     // Config number, interface count, string index, total length, attribute, power in mA
@@ -102,11 +104,19 @@ uint8_t const desc_configuration[] = {
 
     // Interface number, string index, protocol, report descriptor len, EP In address, size &
     // polling interval
-    TUD_HID_DESCRIPTOR(ITF_NUM_HID,
+    TUD_HID_DESCRIPTOR(ITF_NUM_KEYBOARD,
+                       0,
+                       HID_ITF_PROTOCOL_NONE,
+                       sizeof(desc_hid_report_keyboard),
+                       EPNUM_HID_KEYBOARD,
+                       CFG_TUD_HID_EP_BUFSIZE,
+                       1),
+
+    TUD_HID_DESCRIPTOR(ITF_NUM_MOUSE,
                        0,
                        HID_ITF_PROTOCOL_NONE,
-                       sizeof(desc_hid_report),
-                       EPNUM_HID,
+                       sizeof(desc_hid_report_mouse),
+                       EPNUM_HID_MOUSE,
                        CFG_TUD_HID_EP_BUFSIZE,
                        1)};
 
@@ -25,6 +25,15 @@
 #ifndef USB_DESCRIPTORS_H_
 #define USB_DESCRIPTORS_H_
 
+// Keyboard and mouse get their own HID interface and IN endpoint, so they don't
+// compete for the same 1 ms polling slot. Interface number is also the HID instance.
+enum
+{
+  ITF_NUM_KEYBOARD = 0,
+  ITF_NUM_MOUSE,
+  ITF_NUM_TOTAL
+};
+
 enum
 {
   REPORT_ID_KEYBOARD = 1,
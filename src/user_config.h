@@ -36,6 +36,9 @@
  * MOUSE_SPEED_A_FACTOR_X: [1-128], mouse moves at this speed in X direction
  * MOUSE_SPEED_A_FACTOR_Y: [1-128], mouse moves at this speed in Y direction
  *
+ * MOUSE_ACCEL_A: [ACCEL_CURVE_NONE, ACCEL_CURVE_MILD, ACCEL_CURVE_STRONG], makes
+ * fast movements cover more distance than slow ones. Mild tops out at 2x, strong at 3x.
+ *
  * JUMP_THRESHOLD: [0-32768], sets the "force" you need to use to drag the
  * mouse to another screen, 0 meaning no force needed at all, and ~500 some force
  * needed, ~1000 no accidental jumps, you need to really mean it.
@@ -47,10 +50,12 @@
 /* Output A values */
 #define MOUSE_SPEED_A_FACTOR_X 16
 #define MOUSE_SPEED_A_FACTOR_Y 16
+#define MOUSE_ACCEL_A          ACCEL_CURVE_NONE
 
 /* Output B values */
 #define MOUSE_SPEED_B_FACTOR_X 16
 #define MOUSE_SPEED_B_FACTOR_Y 16
+#define MOUSE_ACCEL_B          ACCEL_CURVE_NONE
 
 #define JUMP_THRESHOLD 0
 
@@ -31,8 +31,140 @@ uint8_t calc_checksum(const uint8_t *data, int length) {
     return checksum;
 }
 
+/* CRC-8 lookup table, polynomial 0x07. Placed in RAM, so lookups never wait on flash. */
+const uint8_t __not_in_flash("crc8_tbl") crc8_tbl[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31,
+    0x24, 0x23, 0x2a, 0x2d, 0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+    0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d, 0xe0, 0xe7, 0xee, 0xe9,
+    0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1,
+    0xb4, 0xb3, 0xba, 0xbd, 0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+    0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea, 0xb7, 0xb0, 0xb9, 0xbe,
+    0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16,
+    0x03, 0x04, 0x0d, 0x0a, 0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+    0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a, 0x89, 0x8e, 0x87, 0x80,
+    0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8,
+    0xdd, 0xda, 0xd3, 0xd4, 0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+    0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44, 0x19, 0x1e, 0x17, 0x10,
+    0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f,
+    0x6a, 0x6d, 0x64, 0x63, 0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+    0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13, 0xae, 0xa9, 0xa0, 0xa7,
+    0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef,
+    0xfa, 0xfd, 0xf4, 0xf3,
+};
+
+/* The same CRC, advanced by 2, 3 and 4 bytes: crc8_slice_tbl[n][i] is crc8_tbl applied n + 2 times.
+   The CRC is linear, so four bytes can be looked up independently and XORed together. */
+const uint8_t __not_in_flash("crc8_tbl") crc8_slice_tbl[3][256] = {
+    {
+        0x00, 0x15, 0x2a, 0x3f, 0x54, 0x41, 0x7e, 0x6b, 0xa8, 0xbd, 0x82, 0x97,
+        0xfc, 0xe9, 0xd6, 0xc3, 0x57, 0x42, 0x7d, 0x68, 0x03, 0x16, 0x29, 0x3c,
+        0xff, 0xea, 0xd5, 0xc0, 0xab, 0xbe, 0x81, 0x94, 0xae, 0xbb, 0x84, 0x91,
+        0xfa, 0xef, 0xd0, 0xc5, 0x06, 0x13, 0x2c, 0x39, 0x52, 0x47, 0x78, 0x6d,
+        0xf9, 0xec, 0xd3, 0xc6, 0xad, 0xb8, 0x87, 0x92, 0x51, 0x44, 0x7b, 0x6e,
+        0x05, 0x10, 0x2f, 0x3a, 0x5b, 0x4e, 0x71, 0x64, 0x0f, 0x1a, 0x25, 0x30,
+        0xf3, 0xe6, 0xd9, 0xcc, 0xa7, 0xb2, 0x8d, 0x98, 0x0c, 0x19, 0x26, 0x33,
+        0x58, 0x4d, 0x72, 0x67, 0xa4, 0xb1, 0x8e, 0x9b, 0xf0, 0xe5, 0xda, 0xcf,
+        0xf5, 0xe0, 0xdf, 0xca, 0xa1, 0xb4, 0x8b, 0x9e, 0x5d, 0x48, 0x77, 0x62,
+        0x09, 0x1c, 0x23, 0x36, 0xa2, 0xb7, 0x88, 0x9d, 0xf6, 0xe3, 0xdc, 0xc9,
+        0x0a, 0x1f, 0x20, 0x35, 0x5e, 0x4b, 0x74, 0x61, 0xb6, 0xa3, 0x9c, 0x89,
+        0xe2, 0xf7, 0xc8, 0xdd, 0x1e, 0x0b, 0x34, 0x21, 0x4a, 0x5f, 0x60, 0x75,
+        0xe1, 0xf4, 0xcb, 0xde, 0xb5, 0xa0, 0x9f, 0x8a, 0x49, 0x5c, 0x63, 0x76,
+        0x1d, 0x08, 0x37, 0x22, 0x18, 0x0d, 0x32, 0x27, 0x4c, 0x59, 0x66, 0x73,
+        0xb0, 0xa5, 0x9a, 0x8f, 0xe4, 0xf1, 0xce, 0xdb, 0x4f, 0x5a, 0x65, 0x70,
+        0x1b, 0x0e, 0x31, 0x24, 0xe7, 0xf2, 0xcd, 0xd8, 0xb3, 0xa6, 0x99, 0x8c,
+        0xed, 0xf8, 0xc7, 0xd2, 0xb9, 0xac, 0x93, 0x86, 0x45, 0x50, 0x6f, 0x7a,
+        0x11, 0x04, 0x3b, 0x2e, 0xba, 0xaf, 0x90, 0x85, 0xee, 0xfb, 0xc4, 0xd1,
+        0x12, 0x07, 0x38, 0x2d, 0x46, 0x53, 0x6c, 0x79, 0x43, 0x56, 0x69, 0x7c,
+        0x17, 0x02, 0x3d, 0x28, 0xeb, 0xfe, 0xc1, 0xd4, 0xbf, 0xaa, 0x95, 0x80,
+        0x14, 0x01, 0x3e, 0x2b, 0x40, 0x55, 0x6a, 0x7f, 0xbc, 0xa9, 0x96, 0x83,
+        0xe8, 0xfd, 0xc2, 0xd7,
+    },
+    {
+        0x00, 0x6b, 0xd6, 0xbd, 0xab, 0xc0, 0x7d, 0x16, 0x51, 0x3a, 0x87, 0xec,
+        0xfa, 0x91, 0x2c, 0x47, 0xa2, 0xc9, 0x74, 0x1f, 0x09, 0x62, 0xdf, 0xb4,
+        0xf3, 0x98, 0x25, 0x4e, 0x58, 0x33, 0x8e, 0xe5, 0x43, 0x28, 0x95, 0xfe,
+        0xe8, 0x83, 0x3e, 0x55, 0x12, 0x79, 0xc4, 0xaf, 0xb9, 0xd2, 0x6f, 0x04,
+        0xe1, 0x8a, 0x37, 0x5c, 0x4a, 0x21, 0x9c, 0xf7, 0xb0, 0xdb, 0x66, 0x0d,
+        0x1b, 0x70, 0xcd, 0xa6, 0x86, 0xed, 0x50, 0x3b, 0x2d, 0x46, 0xfb, 0x90,
+        0xd7, 0xbc, 0x01, 0x6a, 0x7c, 0x17, 0xaa, 0xc1, 0x24, 0x4f, 0xf2, 0x99,
+        0x8f, 0xe4, 0x59, 0x32, 0x75, 0x1e, 0xa3, 0xc8, 0xde, 0xb5, 0x08, 0x63,
+        0xc5, 0xae, 0x13, 0x78, 0x6e, 0x05, 0xb8, 0xd3, 0x94, 0xff, 0x42, 0x29,
+        0x3f, 0x54, 0xe9, 0x82, 0x67, 0x0c, 0xb1, 0xda, 0xcc, 0xa7, 0x1a, 0x71,
+        0x36, 0x5d, 0xe0, 0x8b, 0x9d, 0xf6, 0x4b, 0x20, 0x0b, 0x60, 0xdd, 0xb6,
+        0xa0, 0xcb, 0x76, 0x1d, 0x5a, 0x31, 0x8c, 0xe7, 0xf1, 0x9a, 0x27, 0x4c,
+        0xa9, 0xc2, 0x7f, 0x14, 0x02, 0x69, 0xd4, 0xbf, 0xf8, 0x93, 0x2e, 0x45,
+        0x53, 0x38, 0x85, 0xee, 0x48, 0x23, 0x9e, 0xf5, 0xe3, 0x88, 0x35, 0x5e,
+        0x19, 0x72, 0xcf, 0xa4, 0xb2, 0xd9, 0x64, 0x0f, 0xea, 0x81, 0x3c, 0x57,
+        0x41, 0x2a, 0x97, 0xfc, 0xbb, 0xd0, 0x6d, 0x06, 0x10, 0x7b, 0xc6, 0xad,
+        0x8d, 0xe6, 0x5b, 0x30, 0x26, 0x4d, 0xf0, 0x9b, 0xdc, 0xb7, 0x0a, 0x61,
+        0x77, 0x1c, 0xa1, 0xca, 0x2f, 0x44, 0xf9, 0x92, 0x84, 0xef, 0x52, 0x39,
+        0x7e, 0x15, 0xa8, 0xc3, 0xd5, 0xbe, 0x03, 0x68, 0xce, 0xa5, 0x18, 0x73,
+        0x65, 0x0e, 0xb3, 0xd8, 0x9f, 0xf4, 0x49, 0x22, 0x34, 0x5f, 0xe2, 0x89,
+        0x6c, 0x07, 0xba, 0xd1, 0xc7, 0xac, 0x11, 0x7a, 0x3d, 0x56, 0xeb, 0x80,
+        0x96, 0xfd, 0x40, 0x2b,
+    },
+    {
+        0x00, 0x16, 0x2c, 0x3a, 0x58, 0x4e, 0x74, 0x62, 0xb0, 0xa6, 0x9c, 0x8a,
+        0xe8, 0xfe, 0xc4, 0xd2, 0x67, 0x71, 0x4b, 0x5d, 0x3f, 0x29, 0x13, 0x05,
+        0xd7, 0xc1, 0xfb, 0xed, 0x8f, 0x99, 0xa3, 0xb5, 0xce, 0xd8, 0xe2, 0xf4,
+        0x96, 0x80, 0xba, 0xac, 0x7e, 0x68, 0x52, 0x44, 0x26, 0x30, 0x0a, 0x1c,
+        0xa9, 0xbf, 0x85, 0x93, 0xf1, 0xe7, 0xdd, 0xcb, 0x19, 0x0f, 0x35, 0x23,
+        0x41, 0x57, 0x6d, 0x7b, 0x9b, 0x8d, 0xb7, 0xa1, 0xc3, 0xd5, 0xef, 0xf9,
+        0x2b, 0x3d, 0x07, 0x11, 0x73, 0x65, 0x5f, 0x49, 0xfc, 0xea, 0xd0, 0xc6,
+        0xa4, 0xb2, 0x88, 0x9e, 0x4c, 0x5a, 0x60, 0x76, 0x14, 0x02, 0x38, 0x2e,
+        0x55, 0x43, 0x79, 0x6f, 0x0d, 0x1b, 0x21, 0x37, 0xe5, 0xf3, 0xc9, 0xdf,
+        0xbd, 0xab, 0x91, 0x87, 0x32, 0x24, 0x1e, 0x08, 0x6a, 0x7c, 0x46, 0x50,
+        0x82, 0x94, 0xae, 0xb8, 0xda, 0xcc, 0xf6, 0xe0, 0x31, 0x27, 0x1d, 0x0b,
+        0x69, 0x7f, 0x45, 0x53, 0x81, 0x97, 0xad, 0xbb, 0xd9, 0xcf, 0xf5, 0xe3,
+        0x56, 0x40, 0x7a, 0x6c, 0x0e, 0x18, 0x22, 0x34, 0xe6, 0xf0, 0xca, 0xdc,
+        0xbe, 0xa8, 0x92, 0x84, 0xff, 0xe9, 0xd3, 0xc5, 0xa7, 0xb1, 0x8b, 0x9d,
+        0x4f, 0x59, 0x63, 0x75, 0x17, 0x01, 0x3b, 0x2d, 0x98, 0x8e, 0xb4, 0xa2,
+        0xc0, 0xd6, 0xec, 0xfa, 0x28, 0x3e, 0x04, 0x12, 0x70, 0x66, 0x5c, 0x4a,
+        0xaa, 0xbc, 0x86, 0x90, 0xf2, 0xe4, 0xde, 0xc8, 0x1a, 0x0c, 0x36, 0x20,
+        0x42, 0x54, 0x6e, 0x78, 0xcd, 0xdb, 0xe1, 0xf7, 0x95, 0x83, 0xb9, 0xaf,
+        0x7d, 0x6b, 0x51, 0x47, 0x25, 0x33, 0x09, 0x1f, 0x64, 0x72, 0x48, 0x5e,
+        0x3c, 0x2a, 0x10, 0x06, 0xd4, 0xc2, 0xf8, 0xee, 0x8c, 0x9a, 0xa0, 0xb6,
+        0x03, 0x15, 0x2f, 0x39, 0x5b, 0x4d, 0x77, 0x61, 0xb3, 0xa5, 0x9f, 0x89,
+        0xeb, 0xfd, 0xc7, 0xd1,
+    },
+};
+
+/* Table-driven CRC-8, pass the previous result as crc to continue a calculation, or 0 to start one.
+   Four bytes at a time, so each step waits on one lookup instead of four in a row, that keeps it
+   as cheap per byte as the XOR checksum. */
+uint8_t calc_crc8(const uint8_t *data, int length, uint8_t crc) {
+    int i = 0;
+
+    for (; i + 4 <= length; i += 4) {
+        crc = crc8_slice_tbl[2][crc ^ data[i]] ^ crc8_slice_tbl[1][data[i + 1]] ^ crc8_slice_tbl[0][data[i + 2]] ^
+              crc8_tbl[data[i + 3]];
+    }
+
+    for (; i < length; i++) {
+        crc = crc8_tbl[crc ^ data[i]];
+    }
+
+    return crc;
+}
+
+/* Packet CRC covers the type and address bytes as well, not only the payload. Starting from 0,
+   the CRC after one byte is just its table entry. */
+uint8_t calc_packet_crc(uint8_t packet_type, uint8_t address, const uint8_t *payload, int length) {
+    return calc_crc8(payload, length, crc8_tbl[crc8_tbl[packet_type] ^ address]);
+}
+
 bool verify_checksum(const uart_packet_t *packet) {
+#ifdef PROTOCOL_V1
+    /* Older firmware only knows about the XOR checksum */
     uint8_t checksum = calc_checksum(packet->data, PACKET_DATA_LENGTH);
+#else
+    uint8_t checksum = calc_packet_crc(packet->type, packet->address, packet->data, get_payload_length(packet->type));
+#endif
     return checksum == packet->checksum;
 }
 
@@ -52,56 +184,258 @@ void kick_watchdog(device_t *state) {
         watchdog_update();
 }
 
+/* Update the timestamp, so core0 can figure out if we're dead */
+void core1_heartbeat_task(device_t *state) {
+    state->core1_last_loop_pass = time_us_64();
+}
+
 /* ================================================== *
  * Flash and config functions
  * ================================================== */
 
-void wipe_config(void) {
+/* Erase the sector at offset within the config storage if asked, then write data there, if any.
+   Nothing may run from or read flash meanwhile, so core1 is parked and our interrupts are off.
+   Returns how long that lasted. Core0 only, core1 is the lockout victim. */
+uint32_t write_config_flash(uint32_t offset, bool erase, const uint8_t *data, int length) {
+    uint32_t start = time_us_32();
+
+    multicore_lockout_start_blocking();
     uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+
+    if (erase)
+        flash_range_erase(CONFIG_STORAGE_OFFSET + (offset & ~(FLASH_SECTOR_SIZE - 1)), FLASH_SECTOR_SIZE);
+
+    if (data)
+        flash_range_program(CONFIG_STORAGE_OFFSET + offset, data, length);
+
     restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+
+    return time_us_32() - start;
+}
+
+const config_record_t *config_record(int slot) {
+    return (const config_record_t *)(ADDR_CONFIG_BASE_ADDR + slot * CONFIG_RECORD_LENGTH);
+}
+
+bool flash_is_blank(const uint8_t *data, int length) {
+    for (int i = 0; i < length; i++)
+        if (data[i] != 0xFF)
+            return false;
+
+    return true;
+}
+
+uint8_t calc_record_crc(const config_record_t *record, const uint8_t *config) {
+    uint8_t crc = calc_crc8((const uint8_t *)record, offsetof(config_record_t, crc), 0);
+    return calc_crc8(config, record->length, crc);
+}
+
+bool record_is_valid(const config_record_t *record) {
+    if (record->magic != CONFIG_RECORD_MAGIC)
+        return false;
+
+    if (record->length > CONFIG_RECORD_LENGTH - sizeof(config_record_t))
+        return false;
+
+    return calc_record_crc(record, (const uint8_t *)(record + 1)) == record->crc;
+}
+
+/* Scans each slot once, returns the slot holding the newest valid record or -1 if there's none.
+   A torn write fails the CRC, so we end up with the record before it. */
+int find_newest_record(void) {
+    int newest = -1;
+
+    for (int slot = 0; slot < CONFIG_RECORD_SLOTS; slot++) {
+        const config_record_t *record = config_record(slot);
+
+        if (newest >= 0 && record->sequence <= config_record(newest)->sequence)
+            continue;
+
+        if (record_is_valid(record))
+            newest = slot;
+    }
+
+    return newest;
+}
+
+/* Erase every sector with something in it, returns the longest blackout */
+uint32_t wipe_config(void) {
+    uint32_t longest = 0;
+
+    for (int sector = 0; sector < CONFIG_STORAGE_SECTORS; sector++) {
+        uint32_t offset = sector * FLASH_SECTOR_SIZE;
+
+        if (flash_is_blank(ADDR_CONFIG_BASE_ADDR + offset, FLASH_SECTOR_SIZE))
+            continue;
+
+        uint32_t blackout = write_config_flash(offset, true, NULL, 0);
+
+        if (blackout > longest)
+            longest = blackout;
+    }
+
+    return longest;
 }
 
 void load_config(device_t *state) {
-    const config_t *config   = ADDR_CONFIG_BASE_ADDR;
+    config_store_t *store    = &state->config_store;
     config_t *running_config = &state->config;
+    int slot                 = find_newest_record();
+
+    /* Carry on with the log where it left off */
+    store->sequence  = slot < 0 ? 0 : config_record(slot)->sequence;
+    store->next_slot = (slot + 1) % CONFIG_RECORD_SLOTS;
+
+    /* Load the newest stored config, or one from before the log, upgrading it if it's older */
+    int upgrades = slot < 0 ? migrate_legacy_config(ADDR_CONFIG_BASE_ADDR + CONFIG_STORAGE_LEN - FLASH_SECTOR_SIZE,
+                                                    running_config)
+                            : migrate_config((const uint8_t *)(config_record(slot) + 1), config_record(slot)->length,
+                                             running_config);
+
+    /* Nothing we can use, fall back to default config */
+    if (upgrades < 0)
+        memcpy(running_config, &default_config, sizeof(config_t));
 
-    /* Load the flash config first, including the checksum */
-    memcpy(running_config, config, sizeof(config_t));
+    /* Store what we upgraded in the current format, so it doesn't need doing on every boot */
+    if (upgrades > 0 || (upgrades == 0 && slot < 0))
+        request_config_save(state);
+
+    /* Monitor layout might have changed, so work out the screen edges again */
+    build_edge_tables(state);
+}
+
+/* Appends a record with the running config to the log, blocking, returns how long the blackout
+   lasted. Usually that's programming a single page, a sector is only erased when the log moves
+   on to it. Use request_config_save() instead, unless you really can't wait. */
+uint32_t save_config(device_t *state) {
+    config_store_t *store = &state->config_store;
+    uint8_t buf[CONFIG_RECORD_LENGTH];
+    config_record_t *record = (config_record_t *)buf;
+    config_t *config        = (config_t *)(record + 1);
+    int slot                = store->next_slot;
+
+    /* Copy the config to buffer, so it can't change while we're writing. Unused bytes
+       are left erased, so programming doesn't need to touch them. Core1 keeps changing the
+       running config, so both checksums are calculated over the copy only. */
+    memset(buf, 0xFF, sizeof(buf));
+    memcpy(config, &state->config, sizeof(config_t));
 
     /* Calculate and update checksum, size without checksum */
-    uint8_t checksum = calc_checksum((uint8_t *)running_config, sizeof(config_t) - sizeof(uint32_t));
+    config->checksum       = calc_checksum((uint8_t *)config, sizeof(config_t) - sizeof(uint32_t));
+    state->config.checksum = config->checksum;
 
-    /* We expect a certain byte to start the config header */
-    bool magic_header_fail = (running_config->magic_header != 0xB00B1E5);
+    record->magic    = CONFIG_RECORD_MAGIC;
+    record->sequence = store->sequence + 1;
+    record->length   = sizeof(config_t);
+    record->crc      = calc_record_crc(record, (const uint8_t *)config);
 
-    /* We expect the checksum to match */
-    bool checksum_fail = (running_config->checksum != checksum);
+    /* Leftovers of an interrupted write can't be programmed over, skip to the next sector */
+    if (slot % CONFIG_RECORDS_PER_SECTOR && !flash_is_blank((const uint8_t *)config_record(slot), CONFIG_RECORD_LENGTH))
+        slot = (slot / CONFIG_RECORDS_PER_SECTOR + 1) * CONFIG_RECORDS_PER_SECTOR % CONFIG_RECORD_SLOTS;
 
-    /* We expect the config version to match exactly, to avoid erroneous values */
-    bool version_fail = (running_config->version != CURRENT_CONFIG_VERSION);
+    /* Entering a sector, it holds the oldest records so it's safe to erase, if it needs it */
+    uint32_t offset = slot * CONFIG_RECORD_LENGTH;
+    bool erase      = slot % CONFIG_RECORDS_PER_SECTOR == 0 &&
+                 !flash_is_blank(ADDR_CONFIG_BASE_ADDR + offset, FLASH_SECTOR_SIZE);
 
-    /* On any condition failing, we fall back to default config */
-    if (magic_header_fail || checksum_fail || version_fail)
-        memcpy(running_config, &default_config, sizeof(config_t));
+    uint32_t blackout = write_config_flash(offset, erase, buf, CONFIG_RECORD_LENGTH);
+
+    store->sequence  = record->sequence;
+    store->next_slot = (slot + 1) % CONFIG_RECORD_SLOTS;
+
+    return blackout;
 }
 
-void save_config(device_t *state) {
-    uint8_t buf[FLASH_PAGE_SIZE];
-    uint8_t *raw_config = (uint8_t *)&state->config;
+/* Back to defaults right away, the stored config is erased later */
+void reset_config(device_t *state) {
+    memcpy(&state->config, &default_config, sizeof(config_t));
+    request_edge_tables_rebuild(state);
+    request_config_wipe(state);
+}
 
-    /* Calculate and update checksum, size without checksum */
-    uint8_t checksum       = calc_checksum(raw_config, sizeof(config_t) - sizeof(uint32_t));
-    state->config.checksum = checksum;
+/**================================================== *
+ * ==============  Deferred Flash Writes  =========== *
+ * ================================================== *
+ *
+ * Erasing a sector takes tens of milliseconds, during which core1 is parked and core0 has
+ * interrupts off, so no USB on either side. Callers only ask for a save; core0 does it
+ * once the changes stopped coming for a while and there's no input being processed.
+ */
 
-    /* Copy the config to buffer and wipe the old one */
-    memcpy(buf, raw_config, sizeof(config_t));
-    wipe_config();
+/* Either core can ask, every new request restarts the debounce period */
+void request_config_save(device_t *state) {
+    config_store_t *store = &state->config_store;
+    uint32_t now          = time_us_32();
 
-    /* Disable interrupts, then write the flash page and re-enable */
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_program(PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE, buf, FLASH_PAGE_SIZE);
-    restore_interrupts(ints);
+    if (!store->save_pending && !store->wipe_pending)
+        store->first_request = now;
+
+    store->due = now + CONFIG_SAVE_DEBOUNCE_US;
+
+    /* Due time must be in place before core0 sees the flag */
+    __dmb();
+    store->save_pending = true;
+}
+
+void request_config_wipe(device_t *state) {
+    config_store_t *store = &state->config_store;
+    uint32_t now          = time_us_32();
+
+    if (!store->save_pending && !store->wipe_pending)
+        store->first_request = now;
+
+    store->due = now + CONFIG_SAVE_DEBOUNCE_US;
+
+    __dmb();
+    store->wipe_pending = true;
+}
+
+/* Nothing waiting to go to the computer or to be handled, and no local input lately */
+bool input_is_quiet(device_t *state) {
+    mouse_mailbox_t *mailbox = &state->mouse_mailbox;
+
+    if (ring_peek(&state->kbd_queue) || ring_peek(&state->mouse_queue) || deferred_packets_pending(state))
+        return false;
+
+    if (mailbox->sequence != mailbox->sent_sequence)
+        return false;
+
+    return time_us_64() - state->last_activity[BOARD_ROLE] > CONFIG_SAVE_QUIET_US;
+}
+
+bool config_store_ready(device_t *state) {
+    config_store_t *store = &state->config_store;
+    uint32_t now          = time_us_32();
+
+    if (!store->save_pending && !store->wipe_pending)
+        return false;
+
+    if ((int32_t)(now - store->due) < 0)
+        return false;
+
+    return input_is_quiet(state) || now - store->first_request > CONFIG_SAVE_MAX_DELAY_US;
+}
+
+void config_store_task(device_t *state) {
+    config_store_t *store = &state->config_store;
+    uint32_t blackout;
+
+    /* The newest record is what gets loaded, so saving the running config covers a wipe too */
+    if (store->save_pending) {
+        store->save_pending = false;
+        store->wipe_pending = false;
+        blackout            = save_config(state);
+    } else {
+        store->wipe_pending = false;
+        blackout            = wipe_config();
+    }
+
+    store->write_count++;
+    store->last_blackout_us = blackout;
+
+    if (blackout > store->max_blackout_us)
+        store->max_blackout_us = blackout;
 }
 
 /* Have something fun and entertaining when idle */